@@ -0,0 +1,1308 @@
+// Copyright 2020 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "vperfetto-combiner.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#ifdef _WIN32
+#include <fstream>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace vperfetto {
+
+namespace pbzero = ::perfetto::protos::pbzero;
+
+using ::protozero::ConstBytes;
+using ::protozero::Field;
+using ::protozero::Message;
+using ::protozero::ProtoDecoder;
+using ::protozero::proto_utils::ProtoWireType;
+
+// Rewritten packets are staged here before being written out. Most packets fit
+// in the first slice, which is kept around between packets.
+static const size_t kPacketBufferInitialSliceSize = 64 * 1024;
+static const size_t kPacketBufferMaxSliceSize = 1024 * 1024;
+
+// In parallel mode the addon trace is cut into chunks of about this size
+// (unless the caller asks for another), and at most this many chunks per job
+// are kept in memory waiting to be written.
+static const size_t kParallelChunkSize = 4 * 1024 * 1024;
+static const size_t kParallelChunksInFlightPerJob = 2;
+
+// The kinds of values TracePacketRewriter hands to its visitor. A visitor is
+// any type with
+//
+//     template <TraceValue kValue, typename T> T visit(T value);
+//     bool dropPacketField(const Field& field);
+//     bool onSequenceClock(ConstBytes packet);
+//     void appendPacketFields(ConstBytes packet, Message* out);
+//
+// visit() returns the value to write back. dropPacketField() sees every
+// top-level TracePacket field before it is rewritten and returns true to leave
+// it out. onSequenceClock() returns true if the packet's timestamp is on its
+// sequence's own clock, and so is to be left alone. appendPacketFields() can
+// add fields to a rewritten packet after the ones it had. Since the rewriter is
+// instantiated per visitor, |kValue| is a constant and visit() inlines down to
+// the one transform that applies.
+enum class TraceValue {
+    kTimestamp,
+    kRealtimeTimestamp,
+    // TracePacketDefaults.timestamp_clock_id.
+    kDefaultClockId,
+    kTrustedUid,
+    kSequenceId,
+    kPid,
+    kTid,
+    kCpu,
+    kUuid,
+};
+
+// Calls |onPacket| with the bytes of each TracePacket in |trace| until it
+// returns false. Returns false if |trace| could not be decoded to the end.
+template <typename PacketCallback>
+static bool forEachTracePacket(ConstBytes trace, PacketCallback onPacket) {
+    ProtoDecoder decoder(trace.data, trace.size);
+    for (Field field = decoder.ReadField(); field.valid(); field = decoder.ReadField()) {
+        if (field.id() != pbzero::Trace::kPacketFieldNumber ||
+            field.type() != ProtoWireType::kLengthDelimited) {
+            continue;
+        }
+        if (!onPacket(field.as_bytes())) return true;
+    }
+
+    if (decoder.bytes_left()) {
+        fprintf(stderr, "%s: warning: could not decode trace past byte %zu of %zu\n", __func__,
+                decoder.read_offset(), trace.size);
+        return false;
+    }
+    return true;
+}
+
+// Visits every field of the proto message in |bytes|. |handleField| returns
+// true if it took care of the field (rewrote it into |out| or dropped it);
+// every other field is copied into |out| as is. |out| may be null, in which
+// case the message is only visited.
+template <typename FieldHandler>
+static void rewriteFields(ConstBytes bytes, Message* out, FieldHandler handleField) {
+    ProtoDecoder decoder(bytes.data, bytes.size);
+    for (;;) {
+        const uint8_t* fieldBegin = decoder.begin() + decoder.read_offset();
+        Field field = decoder.ReadField();
+        if (!field.valid()) break;
+        if (handleField(field) || !out) continue;
+        const uint8_t* fieldEnd = decoder.begin() + decoder.read_offset();
+        out->AppendRawProtoBytes(fieldBegin, fieldEnd - fieldBegin);
+    }
+}
+
+template <TraceValue kValue, typename T, typename Visitor>
+static bool rewriteVarInt(const Field& field, Message* out, Visitor& visitor) {
+    if (field.type() != ProtoWireType::kVarInt) return false;
+    T value = visitor.template visit<kValue>(static_cast<T>(field.as_uint64()));
+    if (out) out->AppendVarInt(field.id(), value);
+    return true;
+}
+
+template <typename MessageRewriter>
+static bool rewriteNested(const Field& field, Message* out, MessageRewriter rewriteMessage) {
+    if (field.type() != ProtoWireType::kLengthDelimited) return false;
+    Message* nested = out ? out->BeginNestedMessage<Message>(field.id()) : nullptr;
+    rewriteMessage(field.as_bytes(), nested);
+    if (nested) nested->Finalize();
+    return true;
+}
+
+// Replace PID in "X|PID..."
+template <typename Visitor>
+static std::string replace_pid(std::string buf, Visitor& visitor) {
+    // parse "X|PID..."
+    size_t p1 = buf.find_first_of("|");
+    if (p1 == std::string::npos)
+        return buf;
+    ++p1;
+    size_t p2 = buf.find_first_not_of("0123456789", p1);
+    std::string buf2 = buf;
+    if (p2 != std::string::npos)
+        buf2[p2] = '\0';
+    int32_t old_pid = atoi(buf2.c_str() + p1);
+    int32_t new_pid = visitor.template visit<TraceValue::kPid>(old_pid);
+    // gen new string
+    buf2 = buf.substr(0, p1);
+    buf2 += std::to_string(new_pid);
+    if (p2 != std::string::npos)
+        buf2 += buf.substr(p2);
+    return buf2;
+}
+
+// The pid and target cpu fields of the ftrace events that refer to other tasks.
+struct FtraceEventIdFields {
+    uint32_t pidFieldIds[2];
+    uint32_t targetCpuFieldId;
+};
+
+static const FtraceEventIdFields* getFtraceEventIdFields(uint32_t eventFieldId) {
+    switch (eventFieldId) {
+        case pbzero::FtraceEvent::kTaskRenameFieldNumber: {
+            static const FtraceEventIdFields fields = {
+                { pbzero::TaskRenameFtraceEvent::kPidFieldNumber, 0 }, 0 };
+            return &fields;
+        }
+        case pbzero::FtraceEvent::kSchedSwitchFieldNumber: {
+            static const FtraceEventIdFields fields = {
+                { pbzero::SchedSwitchFtraceEvent::kPrevPidFieldNumber,
+                  pbzero::SchedSwitchFtraceEvent::kNextPidFieldNumber }, 0 };
+            return &fields;
+        }
+        case pbzero::FtraceEvent::kSchedWakeupFieldNumber: {
+            static const FtraceEventIdFields fields = {
+                { pbzero::SchedWakeupFtraceEvent::kPidFieldNumber, 0 },
+                pbzero::SchedWakeupFtraceEvent::kTargetCpuFieldNumber };
+            return &fields;
+        }
+        case pbzero::FtraceEvent::kSchedBlockedReasonFieldNumber: {
+            static const FtraceEventIdFields fields = {
+                { pbzero::SchedBlockedReasonFtraceEvent::kPidFieldNumber, 0 }, 0 };
+            return &fields;
+        }
+        case pbzero::FtraceEvent::kSchedWakingFieldNumber: {
+            static const FtraceEventIdFields fields = {
+                { pbzero::SchedWakingFtraceEvent::kPidFieldNumber, 0 },
+                pbzero::SchedWakingFtraceEvent::kTargetCpuFieldNumber };
+            return &fields;
+        }
+        case pbzero::FtraceEvent::kSchedWakeupNewFieldNumber: {
+            static const FtraceEventIdFields fields = {
+                { pbzero::SchedWakeupNewFtraceEvent::kPidFieldNumber, 0 },
+                pbzero::SchedWakeupNewFtraceEvent::kTargetCpuFieldNumber };
+            return &fields;
+        }
+        case pbzero::FtraceEvent::kSchedProcessExecFieldNumber: {
+            static const FtraceEventIdFields fields = {
+                { pbzero::SchedProcessExecFtraceEvent::kPidFieldNumber,
+                  pbzero::SchedProcessExecFtraceEvent::kOldPidFieldNumber }, 0 };
+            return &fields;
+        }
+        case pbzero::FtraceEvent::kSchedProcessExitFieldNumber: {
+            static const FtraceEventIdFields fields = {
+                { pbzero::SchedProcessExitFtraceEvent::kPidFieldNumber,
+                  pbzero::SchedProcessExitFtraceEvent::kTgidFieldNumber }, 0 };
+            return &fields;
+        }
+        case pbzero::FtraceEvent::kSchedProcessForkFieldNumber: {
+            static const FtraceEventIdFields fields = {
+                { pbzero::SchedProcessForkFtraceEvent::kParentPidFieldNumber,
+                  pbzero::SchedProcessForkFtraceEvent::kChildPidFieldNumber }, 0 };
+            return &fields;
+        }
+        case pbzero::FtraceEvent::kSchedProcessFreeFieldNumber: {
+            static const FtraceEventIdFields fields = {
+                { pbzero::SchedProcessFreeFtraceEvent::kPidFieldNumber, 0 }, 0 };
+            return &fields;
+        }
+        case pbzero::FtraceEvent::kSchedProcessHangFieldNumber: {
+            static const FtraceEventIdFields fields = {
+                { pbzero::SchedProcessHangFtraceEvent::kPidFieldNumber, 0 }, 0 };
+            return &fields;
+        }
+        case pbzero::FtraceEvent::kSchedProcessWaitFieldNumber: {
+            static const FtraceEventIdFields fields = {
+                { pbzero::SchedProcessWaitFtraceEvent::kPidFieldNumber, 0 }, 0 };
+            return &fields;
+        }
+        default:
+            return nullptr;
+    }
+}
+
+// Rewrites the timestamps and ids of single TracePackets through |Visitor|
+// (see TraceValue). This handles the same fields that the libprotobuf-based
+// combiner used to.
+template <typename Visitor>
+class TracePacketRewriter {
+public:
+    TracePacketRewriter(Visitor& visitor) : mV(visitor) {}
+
+    // |out| may be null to only visit the packet; nothing is encoded then.
+    void rewritePacket(ConstBytes packet, Message* out) const {
+        bool onSequenceClock = mV.onSequenceClock(packet);
+        rewriteFields(packet, out, [this, out, onSequenceClock](const Field& field) {
+            if (mV.dropPacketField(field)) return true;
+            switch (field.id()) {
+                case pbzero::TracePacket::kTimestampFieldNumber:
+                    // The clock snapshot that relates it to BOOTTIME moves instead.
+                    if (onSequenceClock) return false;
+                    return rewriteVarInt<TraceValue::kTimestamp, uint64_t>(field, out, mV);
+                case pbzero::TracePacket::kClockSnapshotFieldNumber:
+                    return rewriteNested(field, out, [this](ConstBytes b, Message* o) { rewriteClockSnapshot(b, o); });
+                case pbzero::TracePacket::kTrustedUidFieldNumber:
+                    return rewriteVarInt<TraceValue::kTrustedUid, uint32_t>(field, out, mV);
+                case pbzero::TracePacket::kTrustedPacketSequenceIdFieldNumber:
+                    return rewriteVarInt<TraceValue::kSequenceId, uint32_t>(field, out, mV);
+                case pbzero::TracePacket::kFtraceEventsFieldNumber:
+                    return rewriteNested(field, out, [this](ConstBytes b, Message* o) { rewriteFtraceEventBundle(b, o); });
+                case pbzero::TracePacket::kTrackEventFieldNumber:
+                    return rewriteNested(field, out, [this](ConstBytes b, Message* o) { rewriteTrackUuid(b, o, pbzero::TrackEvent::kTrackUuidFieldNumber); });
+                case pbzero::TracePacket::kTracePacketDefaultsFieldNumber:
+                    return rewriteNested(field, out, [this](ConstBytes b, Message* o) { rewriteTracePacketDefaults(b, o); });
+                case pbzero::TracePacket::kTrackDescriptorFieldNumber:
+                    return rewriteNested(field, out, [this](ConstBytes b, Message* o) { rewriteTrackDescriptor(b, o); });
+                case pbzero::TracePacket::kProcessTreeFieldNumber:
+                    return rewriteNested(field, out, [this](ConstBytes b, Message* o) { rewriteProcessTree(b, o); });
+                case pbzero::TracePacket::kAndroidLogFieldNumber:
+                    return rewriteNested(field, out, [this](ConstBytes b, Message* o) { rewriteAndroidLog(b, o); });
+                default:
+                    return false;
+            }
+        });
+        if (out) mV.appendPacketFields(packet, out);
+    }
+
+private:
+    void rewriteClockSnapshot(ConstBytes snapshot, Message* out) const {
+        rewriteFields(snapshot, out, [this, out](const Field& field) {
+            if (field.id() != pbzero::ClockSnapshot::kClocksFieldNumber) return false;
+            return rewriteNested(field, out, [this](ConstBytes b, Message* o) {
+                rewriteFields(b, o, [this, o](const Field& f) {
+                    if (f.id() != pbzero::ClockSnapshot_Clock::kTimestampFieldNumber) return false;
+                    return rewriteVarInt<TraceValue::kTimestamp, uint64_t>(f, o, mV);
+                });
+            });
+        });
+    }
+
+    void rewriteFtraceEventBundle(ConstBytes bundle, Message* out) const {
+        rewriteFields(bundle, out, [this, out](const Field& field) {
+            switch (field.id()) {
+                case pbzero::FtraceEventBundle::kCpuFieldNumber:
+                    return rewriteVarInt<TraceValue::kCpu, int32_t>(field, out, mV);
+                case pbzero::FtraceEventBundle::kEventFieldNumber:
+                    return rewriteNested(field, out, [this](ConstBytes b, Message* o) { rewriteFtraceEvent(b, o); });
+                default:
+                    return false;
+            }
+        });
+    }
+
+    void rewriteFtraceEvent(ConstBytes event, Message* out) const {
+        rewriteFields(event, out, [this, out](const Field& field) {
+            switch (field.id()) {
+                case pbzero::FtraceEvent::kTimestampFieldNumber:
+                    return rewriteVarInt<TraceValue::kTimestamp, uint64_t>(field, out, mV);
+                case pbzero::FtraceEvent::kPidFieldNumber:
+                    return rewriteVarInt<TraceValue::kPid, int32_t>(field, out, mV);
+                case pbzero::FtraceEvent::kPrintFieldNumber:
+                    return rewriteNested(field, out, [this](ConstBytes b, Message* o) { rewritePrint(b, o); });
+                default:
+                    break;
+            }
+
+            const FtraceEventIdFields* idFields = getFtraceEventIdFields(field.id());
+            if (!idFields) return false;
+
+            return rewriteNested(field, out, [this, idFields](ConstBytes b, Message* o) {
+                rewriteFields(b, o, [this, idFields, o](const Field& f) {
+                    if (f.id() == idFields->pidFieldIds[0] || f.id() == idFields->pidFieldIds[1]) {
+                        return rewriteVarInt<TraceValue::kPid, int32_t>(f, o, mV);
+                    }
+                    if (f.id() == idFields->targetCpuFieldId) {
+                        return rewriteVarInt<TraceValue::kCpu, int32_t>(f, o, mV);
+                    }
+                    return false;
+                });
+            });
+        });
+    }
+
+    void rewritePrint(ConstBytes print, Message* out) const {
+        rewriteFields(print, out, [this, out](const Field& field) {
+            if (field.id() != pbzero::PrintFtraceEvent::kBufFieldNumber ||
+                field.type() != ProtoWireType::kLengthDelimited) {
+                return false;
+            }
+            std::string buf = replace_pid(field.as_std_string(), mV);
+            if (out) out->AppendString(field.id(), buf);
+            return true;
+        });
+    }
+
+    // TrackEvent and TrackEventDefaults both only need their track uuid rewritten.
+    void rewriteTrackUuid(ConstBytes message, Message* out, uint32_t uuidFieldId) const {
+        rewriteFields(message, out, [this, out, uuidFieldId](const Field& field) {
+            if (field.id() != uuidFieldId) return false;
+            return rewriteVarInt<TraceValue::kUuid, uint64_t>(field, out, mV);
+        });
+    }
+
+    void rewriteTracePacketDefaults(ConstBytes defaults, Message* out) const {
+        rewriteFields(defaults, out, [this, out](const Field& field) {
+            switch (field.id()) {
+                case pbzero::TracePacketDefaults::kTimestampClockIdFieldNumber:
+                    return rewriteVarInt<TraceValue::kDefaultClockId, uint32_t>(field, out, mV);
+                case pbzero::TracePacketDefaults::kTrackEventDefaultsFieldNumber:
+                    return rewriteNested(field, out, [this](ConstBytes b, Message* o) {
+                        rewriteTrackUuid(b, o, pbzero::TrackEventDefaults::kTrackUuidFieldNumber);
+                    });
+                default:
+                    return false;
+            }
+        });
+    }
+
+    void rewriteTrackDescriptor(ConstBytes descriptor, Message* out) const {
+        rewriteFields(descriptor, out, [this, out](const Field& field) {
+            switch (field.id()) {
+                case pbzero::TrackDescriptor::kUuidFieldNumber:
+                case pbzero::TrackDescriptor::kParentUuidFieldNumber:
+                    return rewriteVarInt<TraceValue::kUuid, uint64_t>(field, out, mV);
+                case pbzero::TrackDescriptor::kProcessFieldNumber:
+                    return rewriteNested(field, out, [this](ConstBytes b, Message* o) {
+                        rewriteFields(b, o, [this, o](const Field& f) {
+                            if (f.id() != pbzero::ProcessDescriptor::kPidFieldNumber) return false;
+                            return rewriteVarInt<TraceValue::kPid, int32_t>(f, o, mV);
+                        });
+                    });
+                case pbzero::TrackDescriptor::kThreadFieldNumber:
+                    return rewriteNested(field, out, [this](ConstBytes b, Message* o) {
+                        rewriteFields(b, o, [this, o](const Field& f) {
+                            switch (f.id()) {
+                                case pbzero::ThreadDescriptor::kPidFieldNumber:
+                                    return rewriteVarInt<TraceValue::kPid, int32_t>(f, o, mV);
+                                case pbzero::ThreadDescriptor::kTidFieldNumber:
+                                    return rewriteVarInt<TraceValue::kTid, int32_t>(f, o, mV);
+                                default:
+                                    return false;
+                            }
+                        });
+                    });
+                default:
+                    return false;
+            }
+        });
+    }
+
+    void rewriteProcessTree(ConstBytes tree, Message* out) const {
+        rewriteFields(tree, out, [this, out](const Field& field) {
+            switch (field.id()) {
+                case pbzero::ProcessTree::kProcessesFieldNumber:
+                    return rewriteNested(field, out, [this](ConstBytes b, Message* o) {
+                        rewriteFields(b, o, [this, o](const Field& f) {
+                            switch (f.id()) {
+                                case pbzero::ProcessTree_Process::kPidFieldNumber:
+                                case pbzero::ProcessTree_Process::kPpidFieldNumber:
+                                    return rewriteVarInt<TraceValue::kPid, int32_t>(f, o, mV);
+                                default:
+                                    return false;
+                            }
+                        });
+                    });
+                case pbzero::ProcessTree::kThreadsFieldNumber:
+                    return rewriteNested(field, out, [this](ConstBytes b, Message* o) {
+                        rewriteFields(b, o, [this, o](const Field& f) {
+                            switch (f.id()) {
+                                case pbzero::ProcessTree_Thread::kTidFieldNumber:
+                                    return rewriteVarInt<TraceValue::kTid, int32_t>(f, o, mV);
+                                case pbzero::ProcessTree_Thread::kTgidFieldNumber:
+                                    return rewriteVarInt<TraceValue::kPid, int32_t>(f, o, mV);
+                                default:
+                                    return false;
+                            }
+                        });
+                    });
+                default:
+                    return false;
+            }
+        });
+    }
+
+    void rewriteAndroidLog(ConstBytes log, Message* out) const {
+        rewriteFields(log, out, [this, out](const Field& field) {
+            if (field.id() != pbzero::AndroidLogPacket::kEventsFieldNumber) return false;
+            return rewriteNested(field, out, [this](ConstBytes b, Message* o) {
+                rewriteFields(b, o, [this, o](const Field& f) {
+                    switch (f.id()) {
+                        case pbzero::AndroidLogPacket_LogEvent::kPidFieldNumber:
+                            return rewriteVarInt<TraceValue::kPid, int32_t>(f, o, mV);
+                        case pbzero::AndroidLogPacket_LogEvent::kTidFieldNumber:
+                            return rewriteVarInt<TraceValue::kTid, int32_t>(f, o, mV);
+                        case pbzero::AndroidLogPacket_LogEvent::kTimestampFieldNumber:
+                            return rewriteVarInt<TraceValue::kRealtimeTimestamp, uint64_t>(f, o, mV);
+                        default:
+                            return false;
+                    }
+                });
+            });
+        });
+    }
+
+    Visitor& mV;
+};
+
+// Reads REALTIME and BOOTTIME out of a ClockSnapshot. Returns false unless
+// the snapshot has both.
+static bool readClockSnapshotTimes(ConstBytes snapshot, uint64_t* realtime, uint64_t* boottime) {
+    uint64_t snapshotRealtime = 0;
+    uint64_t snapshotBoottime = 0;
+    ProtoDecoder snapshotDecoder(snapshot);
+    for (Field clock = snapshotDecoder.ReadField(); clock.valid(); clock = snapshotDecoder.ReadField()) {
+        if (clock.id() != pbzero::ClockSnapshot::kClocksFieldNumber) continue;
+        ProtoDecoder clockDecoder(clock.as_bytes());
+        uint32_t clockId = clockDecoder.FindField(pbzero::ClockSnapshot_Clock::kClockIdFieldNumber).as_uint32();
+        uint64_t timestamp = clockDecoder.FindField(pbzero::ClockSnapshot_Clock::kTimestampFieldNumber).as_uint64();
+        if (clockId == static_cast<uint32_t>(pbzero::BuiltinClock::BUILTIN_CLOCK_BOOTTIME))
+            snapshotBoottime = timestamp;
+        if (clockId == static_cast<uint32_t>(pbzero::BuiltinClock::BUILTIN_CLOCK_REALTIME))
+            snapshotRealtime = timestamp;
+    }
+
+    if (snapshotRealtime == 0 || snapshotBoottime == 0) return false;
+    *realtime = snapshotRealtime;
+    *boottime = snapshotBoottime;
+    return true;
+}
+
+// Clock ids from here on are scoped to the sequence they are used on.
+static const uint32_t kFirstSequenceScopedClockId = 64;
+
+// Where the clock-snapshot merge puts an addon sequence's BOOTTIME
+// timestamps: the last sequence-scoped clock id, which producers are not
+// expected to use themselves.
+static const uint32_t kAddonBoottimeClockId = 127;
+
+// True if the TracePacketDefaults in |defaults| put the sequence's timestamps
+// on a sequence-scoped clock.
+static bool defaultsToSequenceClock(ConstBytes defaults) {
+    ProtoDecoder defaultsDecoder(defaults);
+    Field clockId = defaultsDecoder.FindField(pbzero::TracePacketDefaults::kTimestampClockIdFieldNumber);
+    return clockId.valid() && clockId.as_uint32() >= kFirstSequenceScopedClockId;
+}
+
+// True if the TracePacketDefaults in |defaults| put the sequence's timestamps
+// on BOOTTIME, as the SDK's track event sequences do on Linux.
+static bool defaultsToBoottime(ConstBytes defaults) {
+    ProtoDecoder defaultsDecoder(defaults);
+    Field clockId = defaultsDecoder.FindField(pbzero::TracePacketDefaults::kTimestampClockIdFieldNumber);
+    return clockId.valid() &&
+           clockId.as_uint32() == static_cast<uint32_t>(pbzero::BuiltinClock::BUILTIN_CLOCK_BOOTTIME);
+}
+
+// Reads the BOOTTIME that an incremental clock set up by |snapshot| starts
+// at. Returns false unless the snapshot has both an incremental clock and
+// BOOTTIME.
+static bool readIncrementalClockBase(ConstBytes snapshot, uint64_t* boottime) {
+    bool incremental = false;
+    bool hasBoottime = false;
+    ProtoDecoder snapshotDecoder(snapshot);
+    for (Field clock = snapshotDecoder.ReadField(); clock.valid(); clock = snapshotDecoder.ReadField()) {
+        if (clock.id() != pbzero::ClockSnapshot::kClocksFieldNumber) continue;
+        ProtoDecoder clockDecoder(clock.as_bytes());
+        if (clockDecoder.FindField(pbzero::ClockSnapshot_Clock::kIsIncrementalFieldNumber).as_bool()) {
+            incremental = true;
+        }
+        uint32_t clockId = clockDecoder.FindField(pbzero::ClockSnapshot_Clock::kClockIdFieldNumber).as_uint32();
+        if (clockId == static_cast<uint32_t>(pbzero::BuiltinClock::BUILTIN_CLOCK_BOOTTIME)) {
+            hasBoottime = true;
+            *boottime = clockDecoder.FindField(pbzero::ClockSnapshot_Clock::kTimestampFieldNumber).as_uint64();
+        }
+    }
+    return incremental && hasBoottime;
+}
+
+static void addSequenceId(std::vector<uint32_t>* ids, uint32_t id) {
+    auto it = std::lower_bound(ids->begin(), ids->end(), id);
+    if (it == ids->end() || *it != id) ids->insert(it, id);
+}
+
+static bool hasSequenceId(const std::vector<uint32_t>& ids, uint32_t id) {
+    return std::binary_search(ids.begin(), ids.end(), id);
+}
+
+// Reads the clock sync data out of a ClockSnapshot into |point|. Only
+// snapshots of exactly two clocks, one of them an absolute raw cpu clock
+// (id 64), count. Returns false for other two-clock snapshots, which rule out
+// the whole packet.
+static bool readCpuClockSnapshot(ConstBytes snapshot, TraceClockSyncPoint* point) {
+    static const uint32_t kCpuClockId = 64;
+
+    struct {
+        uint32_t id;
+        uint64_t timestamp;
+        bool isRawCpuClock;
+    } clocks[2];
+    int numClocks = 0;
+
+    ProtoDecoder snapshotDecoder(snapshot);
+    for (Field field = snapshotDecoder.ReadField(); field.valid(); field = snapshotDecoder.ReadField()) {
+        if (field.id() != pbzero::ClockSnapshot::kClocksFieldNumber) continue;
+        if (++numClocks > 2) return true;
+        ProtoDecoder clockDecoder(field.as_bytes());
+        auto& clock = clocks[numClocks - 1];
+        clock.id = clockDecoder.FindField(pbzero::ClockSnapshot_Clock::kClockIdFieldNumber).as_uint32();
+        clock.timestamp = clockDecoder.FindField(pbzero::ClockSnapshot_Clock::kTimestampFieldNumber).as_uint64();
+        clock.isRawCpuClock = clock.id == kCpuClockId &&
+            !clockDecoder.FindField(pbzero::ClockSnapshot_Clock::kIsIncrementalFieldNumber).valid() &&
+            !clockDecoder.FindField(pbzero::ClockSnapshot_Clock::kUnitMultiplierNsFieldNumber).valid();
+    }
+    if (numClocks != 2) return true;
+
+    int cpuClock = clocks[0].isRawCpuClock ? 0 : (clocks[1].isRawCpuClock ? 1 : -1);
+    if (cpuClock < 0) return false;
+    int regClock = (cpuClock == 0) ? 1 : 0;
+
+    point->hasSnapshot = true;
+    point->snapshotClockId = clocks[regClock].id;
+    point->snapshotClockTime = clocks[regClock].timestamp;
+    point->snapshotCpuTime = clocks[cpuClock].timestamp;
+    return true;
+}
+
+// Reads clock_sync_{boottime,monotonic,cputime} debug annotations out of a
+// TrackEvent into |point|.
+static void readClockSyncAnnotations(ConstBytes trackEvent, TraceClockSyncPoint* point) {
+    ProtoDecoder eventDecoder(trackEvent);
+    for (Field field = eventDecoder.ReadField(); field.valid(); field = eventDecoder.ReadField()) {
+        if (field.id() != pbzero::TrackEvent::kDebugAnnotationsFieldNumber) continue;
+        ProtoDecoder annotationDecoder(field.as_bytes());
+        Field name = annotationDecoder.FindField(pbzero::DebugAnnotation::kNameFieldNumber);
+        if (!name.valid()) continue;
+        uint64_t value = annotationDecoder.FindField(pbzero::DebugAnnotation::kUintValueFieldNumber).as_uint64();
+        ::protozero::ConstChars nameChars = name.as_string();
+        std::string nameStr(nameChars.data, nameChars.size);
+        if (nameStr == "clock_sync_boottime") {
+            point->hasBoottime = true;
+            point->boottime = value;
+        } else if (nameStr == "clock_sync_monotonic") {
+            point->hasMonotonic = true;
+            point->monotonic = value;
+        } else if (nameStr == "clock_sync_cputime") {
+            point->hasCpuTime = true;
+            point->cpuTime = value;
+        }
+    }
+}
+
+// Visitor that leaves the trace alone and fills in a TraceSummary.
+class TraceScanner {
+public:
+    TraceScanner(TraceSummary* summary) : mSummary(summary) {}
+
+    template <TraceValue kValue, typename T>
+    T visit(T value) {
+        switch (kValue) {
+            case TraceValue::kTrustedUid:
+                mSummary->maxTrustedUid = std::max(mSummary->maxTrustedUid, static_cast<uint32_t>(value));
+                break;
+            case TraceValue::kSequenceId:
+                mSummary->maxSequenceId = std::max(mSummary->maxSequenceId, static_cast<uint32_t>(value));
+                mPacketSequenceId = static_cast<uint32_t>(value);
+                break;
+            case TraceValue::kPid:
+                if (value > 0) mSummary->maxPid = std::max(mSummary->maxPid, static_cast<uint32_t>(value));
+                break;
+            case TraceValue::kTid:
+                if (value > 0) mSummary->maxTid = std::max(mSummary->maxTid, static_cast<uint32_t>(value));
+                break;
+            case TraceValue::kCpu:
+                if (value > 0) mSummary->maxCpu = std::max(mSummary->maxCpu, static_cast<uint32_t>(value));
+                break;
+            default:
+                break;
+        }
+        return value;
+    }
+
+    bool dropPacketField(const Field& field) {
+        switch (field.id()) {
+            case pbzero::TracePacket::kTimestampFieldNumber:
+                if (field.type() != ProtoWireType::kVarInt) break;
+                mPacketHasTimestamp = true;
+                mPacketTimestamp = field.as_uint64();
+                break;
+            case pbzero::TracePacket::kTracePacketDefaultsFieldNumber:
+                if (field.type() != ProtoWireType::kLengthDelimited) break;
+                mPacketSetsSequenceClock = defaultsToSequenceClock(field.as_bytes());
+                mPacketSetsBoottime = defaultsToBoottime(field.as_bytes());
+                break;
+            case pbzero::TracePacket::kClockSnapshotFieldNumber:
+                if (field.type() != ProtoWireType::kLengthDelimited) break;
+                if (!mSummary->hasClockSnapshot) {
+                    mSummary->hasClockSnapshot =
+                        readClockSnapshotTimes(field.as_bytes(), &mSummary->realtime, &mSummary->boottime);
+                }
+                mPacketHasClockBase = readIncrementalClockBase(field.as_bytes(), &mPacketClockBase);
+                mPacketRuledOut = !readCpuClockSnapshot(field.as_bytes(), &mPacketClockSync) || mPacketRuledOut;
+                break;
+            case pbzero::TracePacket::kTrackEventFieldNumber:
+                if (field.type() != ProtoWireType::kLengthDelimited) break;
+                readClockSyncAnnotations(field.as_bytes(), &mPacketClockSync);
+                break;
+            default:
+                break;
+        }
+        return false;
+    }
+
+    // The scanner sees timestamps as they are and sorts them out per packet.
+    bool onSequenceClock(ConstBytes) { return false; }
+
+    void appendPacketFields(ConstBytes, Message*) {}
+
+    void beginPacket() {
+        mPacketClockSync = TraceClockSyncPoint();
+        mPacketRuledOut = false;
+        mPacketSequenceId = 0;
+        mPacketHasTimestamp = false;
+        mPacketSetsSequenceClock = false;
+        mPacketSetsBoottime = false;
+        mPacketHasClockBase = false;
+    }
+
+    void endPacket() {
+        if (mPacketSetsSequenceClock) {
+            addSequenceId(&mSummary->incrementalClockSequenceIds, mPacketSequenceId);
+        }
+        if (mPacketSetsBoottime) {
+            addSequenceId(&mSummary->boottimeSequenceIds, mPacketSequenceId);
+        }
+        if (!mSummary->hasTimestamp) {
+            // Timestamps on a sequence's own clock are deltas; where that
+            // clock starts is the first time the sequence has.
+            if (mPacketHasClockBase) {
+                mSummary->hasTimestamp = true;
+                mSummary->firstTimestamp = mPacketClockBase;
+            } else if (mPacketHasTimestamp &&
+                       !hasSequenceId(mSummary->incrementalClockSequenceIds, mPacketSequenceId)) {
+                mSummary->hasTimestamp = true;
+                mSummary->firstTimestamp = mPacketTimestamp;
+            }
+        }
+
+        const TraceClockSyncPoint& p = mPacketClockSync;
+        if (mPacketRuledOut) return;
+        if (!p.hasSnapshot && !p.hasBoottime && !p.hasMonotonic && !p.hasCpuTime) return;
+        mSummary->clockSyncPoints.push_back(p);
+    }
+
+private:
+    TraceSummary* mSummary;
+
+    // Clock sync data of the packet being scanned.
+    TraceClockSyncPoint mPacketClockSync;
+    bool mPacketRuledOut = false;
+
+    // What decides whether the packet being scanned has the first timestamp.
+    uint32_t mPacketSequenceId = 0;
+    bool mPacketHasTimestamp = false;
+    uint64_t mPacketTimestamp = 0;
+    bool mPacketSetsSequenceClock = false;
+    bool mPacketSetsBoottime = false;
+    bool mPacketHasClockBase = false;
+    uint64_t mPacketClockBase = 0;
+};
+
+const TraceSummary& ScannedTrace::summary() {
+    if (mScanned) return mSummary;
+
+    TraceScanner scanner(&mSummary);
+    TracePacketRewriter<TraceScanner> visitor(scanner);
+    mSummary.decoded = forEachTracePacket(mBytes, [&scanner, &visitor](ConstBytes packet) {
+        scanner.beginPacket();
+        visitor.rewritePacket(packet, nullptr);
+        scanner.endPacket();
+        return true;
+    });
+    mScanned = true;
+
+    fprintf(stderr, "%s: trace's max trusted uid %u seq %u pid %u, %zu clock sync points\n", __func__,
+            mSummary.maxTrustedUid, mSummary.maxSequenceId, mSummary.maxPid,
+            mSummary.clockSyncPoints.size());
+    return mSummary;
+}
+
+// Scans the packets at the start of |trace| into |summary|, up to one that is
+// cut off, and returns how many bytes they take up.
+static size_t scanCompletePackets(ConstBytes trace, TraceSummary* summary) {
+    TraceScanner scanner(summary);
+    TracePacketRewriter<TraceScanner> visitor(scanner);
+    ProtoDecoder decoder(trace.data, trace.size);
+    size_t scanned = 0;
+    for (Field field = decoder.ReadField(); field.valid(); field = decoder.ReadField()) {
+        if (field.id() == pbzero::Trace::kPacketFieldNumber &&
+            field.type() == ProtoWireType::kLengthDelimited) {
+            scanner.beginPacket();
+            visitor.rewritePacket(field.as_bytes(), nullptr);
+            scanner.endPacket();
+        }
+        scanned = decoder.read_offset();
+    }
+    return scanned;
+}
+
+void StreamedTrace::append(const void* data, size_t size) {
+    const char* bytes = static_cast<const char*>(data);
+    mBytes.insert(mBytes.end(), bytes, bytes + size);
+    ConstBytes unscanned{reinterpret_cast<const uint8_t*>(mBytes.data()) + mScannedSize,
+                         mBytes.size() - mScannedSize};
+    mScannedSize += scanCompletePackets(unscanned, &mSummary);
+}
+
+ScannedTrace StreamedTrace::trace() {
+    mSummary.decoded = mScannedSize == mBytes.size();
+    if (!mSummary.decoded) {
+        fprintf(stderr, "%s: warning: trace cut off at byte %zu of %zu\n", __func__,
+                mScannedSize, mBytes.size());
+    }
+    return ScannedTrace(traceBytes(mBytes), mSummary);
+}
+
+void StreamedTrace::clear() {
+    mBytes.clear();
+    mBytes.shrink_to_fit();
+    mScannedSize = 0;
+    mSummary = TraceSummary();
+}
+
+// Visitor that moves the addon trace into the main trace's time base and id
+// space. It has no mutable state, so one instance is shared by all jobs.
+struct AddonTraceTransforms {
+
+    template <TraceValue kValue, typename T>
+    T visit(T value) const {
+        switch (kValue) {
+            case TraceValue::kTimestamp:
+                return static_cast<T>(value + timestampDiff);
+            case TraceValue::kRealtimeTimestamp:
+                return static_cast<T>(value + realtimeDiff);
+            case TraceValue::kDefaultClockId:
+                if (clockSnapshotTimeDiff &&
+                    value == static_cast<T>(pbzero::BuiltinClock::BUILTIN_CLOCK_BOOTTIME)) {
+                    return static_cast<T>(kAddonBoottimeClockId);
+                }
+                return value;
+            case TraceValue::kTrustedUid:
+                return static_cast<T>(value + trustedUidOffset);
+            case TraceValue::kSequenceId:
+                return static_cast<T>(value + sequenceIdOffset);
+            case TraceValue::kPid:
+            case TraceValue::kTid:
+                if (value == 0) return 0;
+                return static_cast<T>(value + pidTidOffset);
+            case TraceValue::kCpu:
+                return static_cast<T>(value + cpuOffset);
+            case TraceValue::kUuid:
+                if (value == 0) return 0;
+                return static_cast<T>(value ^ uuidMask);
+        }
+        return value;
+    }
+
+    // Clock snapshots and service events only make sense in the trace they
+    // were recorded in. The exception are the snapshots that start a
+    // sequence's incremental clock, which its timestamps can't do without.
+    bool dropPacketField(const Field& field) const {
+        if (field.id() == pbzero::TracePacket::kClockSnapshotFieldNumber) {
+            uint64_t boottime;
+            return field.type() != ProtoWireType::kLengthDelimited ||
+                   !readIncrementalClockBase(field.as_bytes(), &boottime);
+        }
+        return field.id() == pbzero::TracePacket::kServiceEventFieldNumber;
+    }
+
+    bool onSequenceClock(ConstBytes packet) const {
+        if (sequenceClockSequenceIds.empty()) return false;
+        ProtoDecoder packetDecoder(packet);
+        // A clock of the packet's own overrides the sequence's.
+        Field clockId = packetDecoder.FindField(pbzero::TracePacket::kTimestampClockIdFieldNumber);
+        if (clockId.valid()) return clockId.as_uint32() >= kFirstSequenceScopedClockId;
+        Field sequenceId = packetDecoder.FindField(pbzero::TracePacket::kTrustedPacketSequenceIdFieldNumber);
+        return hasSequenceId(sequenceClockSequenceIds, sequenceId.as_uint32());
+    }
+
+    // With |clockSnapshotTimeDiff|, the packet that moves a sequence from
+    // BOOTTIME to kAddonBoottimeClockId also gets the snapshot that relates
+    // the two, |timestampDiff| apart. The SDK writes its defaults in a packet
+    // of their own, and trace processor reads them before the snapshot.
+    void appendPacketFields(ConstBytes packet, Message* out) const {
+        if (!clockSnapshotTimeDiff) return;
+        ProtoDecoder packetDecoder(packet);
+        Field defaults = packetDecoder.FindField(pbzero::TracePacket::kTracePacketDefaultsFieldNumber);
+        if (!defaults.valid() || defaults.type() != ProtoWireType::kLengthDelimited ||
+            !defaultsToBoottime(defaults.as_bytes())) {
+            return;
+        }
+
+        // Any point works; the packet's own time keeps both clocks in range.
+        uint64_t time = packetDecoder.FindField(pbzero::TracePacket::kTimestampFieldNumber).as_uint64();
+        if (timestampDiff < 0 && time < static_cast<uint64_t>(-timestampDiff)) {
+            time = static_cast<uint64_t>(-timestampDiff);
+        }
+        auto* snapshot = out->BeginNestedMessage<pbzero::ClockSnapshot>(pbzero::TracePacket::kClockSnapshotFieldNumber);
+        auto* addonClock = snapshot->add_clocks();
+        addonClock->set_clock_id(kAddonBoottimeClockId);
+        addonClock->set_timestamp(time);
+        auto* mainClock = snapshot->add_clocks();
+        mainClock->set_clock_id(static_cast<uint32_t>(pbzero::BuiltinClock::BUILTIN_CLOCK_BOOTTIME));
+        mainClock->set_timestamp(time + timestampDiff);
+        snapshot->Finalize();
+    }
+
+    int64_t timestampDiff = 0;
+    uint64_t realtimeDiff = 0;
+    uint32_t trustedUidOffset = 0;
+    uint32_t sequenceIdOffset = 0;
+    uint64_t pidTidOffset = 0;
+    int32_t cpuOffset = 0;
+    uint64_t uuidMask = 0;
+    // Sequences whose timestamps are on a sequence-scoped clock and are left
+    // alone: the incremental ones, and with |clockSnapshotTimeDiff| the ones
+    // on BOOTTIME too.
+    std::vector<uint32_t> sequenceClockSequenceIds;
+    bool clockSnapshotTimeDiff = false;
+};
+
+// Finds the first clock snapshot in |trace| with both REALTIME and BOOTTIME,
+// stopping there. Leaves |realtime| and |boottime| untouched if there is none.
+static void getClockSnapshotTimes(ScannedTrace& trace, uint64_t* realtime, uint64_t* boottime) {
+    if (trace.scanned()) {
+        const TraceSummary& summary = trace.summary();
+        if (summary.hasClockSnapshot) {
+            *realtime = summary.realtime;
+            *boottime = summary.boottime;
+        }
+        return;
+    }
+
+    forEachTracePacket(trace.bytes(), [realtime, boottime](ConstBytes packet) {
+        ProtoDecoder packetDecoder(packet.data, packet.size);
+        Field snapshot = packetDecoder.FindField(pbzero::TracePacket::kClockSnapshotFieldNumber);
+        if (!snapshot.valid()) return true;
+        return !readClockSnapshotTimes(snapshot.as_bytes(), realtime, boottime);
+    });
+}
+
+// Finds the sequences of |trace| that have timestamps on their own clock (see
+// TraceSummary::incrementalClockSequenceIds), and with |boottime| the ones on
+// BOOTTIME as well. Unless the trace was scanned already, only packets with
+// TracePacketDefaults are decoded.
+static void getSequenceClockSequenceIds(ScannedTrace& trace, bool boottime, std::vector<uint32_t>* ids) {
+    if (trace.scanned()) {
+        *ids = trace.summary().incrementalClockSequenceIds;
+        if (boottime) {
+            for (uint32_t id : trace.summary().boottimeSequenceIds) addSequenceId(ids, id);
+        }
+        return;
+    }
+
+    forEachTracePacket(trace.bytes(), [ids, boottime](ConstBytes packet) {
+        ProtoDecoder packetDecoder(packet.data, packet.size);
+        Field defaults = packetDecoder.FindField(pbzero::TracePacket::kTracePacketDefaultsFieldNumber);
+        if (!defaults.valid() || defaults.type() != ProtoWireType::kLengthDelimited) return true;
+        if (defaultsToSequenceClock(defaults.as_bytes()) ||
+            (boottime && defaultsToBoottime(defaults.as_bytes()))) {
+            Field sequenceId = packetDecoder.FindField(pbzero::TracePacket::kTrustedPacketSequenceIdFieldNumber);
+            addSequenceId(ids, sequenceId.as_uint32());
+        }
+        return true;
+    });
+}
+
+#ifdef _WIN32
+
+MappedTraceFile::MappedTraceFile(const char* filename) {
+    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+    if (!file) {
+        fprintf(stderr, "%s: error: could not open %s\n", __func__, filename);
+        return;
+    }
+    std::ifstream::pos_type end = file.tellg();
+    file.seekg(0, std::ios::beg);
+    mContents.resize(end);
+    file.read(mContents.data(), end);
+    if (!mContents.empty()) {
+        mData = mContents.data();
+        mSize = mContents.size();
+    }
+}
+
+MappedTraceFile::~MappedTraceFile() = default;
+
+#else
+
+MappedTraceFile::MappedTraceFile(const char* filename) {
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "%s: error: could not open %s: %s\n", __func__, filename, strerror(errno));
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        fprintf(stderr, "%s: error: %s is empty or could not be stat'ed\n", __func__, filename);
+        close(fd);
+        return;
+    }
+
+    size_t size = static_cast<size_t>(st.st_size);
+    void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping holds its own reference to the file.
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "%s: error: could not map %s: %s\n", __func__, filename, strerror(errno));
+        return;
+    }
+
+    // Packets are decoded front to back, once; let the kernel read ahead
+    // aggressively and drop pages behind us.
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    mData = data;
+    mSize = size;
+}
+
+MappedTraceFile::~MappedTraceFile() {
+    if (mData) munmap(mData, mSize);
+}
+
+#endif
+
+// Rewrites each packet of |trace| and appends it to |out|.
+template <typename Rewriter, typename Output>
+static bool rewriteTracePackets(ConstBytes trace, const Rewriter& rewriter, Output& out) {
+    ::protozero::HeapBuffered<Message> packetBuffer(kPacketBufferInitialSliceSize, kPacketBufferMaxSliceSize);
+
+    return forEachTracePacket(trace, [&rewriter, &packetBuffer, &out](ConstBytes packet) {
+        rewriter.rewritePacket(packet, packetBuffer->BeginNestedMessage<Message>(pbzero::Trace::kPacketFieldNumber));
+        for (const auto& range : packetBuffer.GetRanges()) {
+            out.write(reinterpret_cast<const char*>(range.begin), range.size());
+        }
+        packetBuffer.Reset();
+        return true;
+    });
+}
+
+// Output sink for rewriteTracePackets that keeps a chunk in memory until it is
+// its turn to be written.
+struct ChunkOutput {
+    void write(const char* data, size_t size) { bytes.append(data, size); }
+    std::string bytes;
+};
+
+// Splits |trace| into runs of whole Trace.packet fields of about |chunkSize|
+// bytes each. Each run is itself a valid Trace.
+static bool splitTraceIntoChunks(ConstBytes trace, size_t chunkSize, std::vector<ConstBytes>* chunks) {
+    ProtoDecoder decoder(trace.data, trace.size);
+    size_t chunkBegin = 0;
+    while (decoder.ReadField().valid()) {
+        size_t offset = decoder.read_offset();
+        if (offset - chunkBegin >= chunkSize) {
+            chunks->push_back(ConstBytes{trace.data + chunkBegin, offset - chunkBegin});
+            chunkBegin = offset;
+        }
+    }
+
+    size_t decodedSize = trace.size - decoder.bytes_left();
+    if (decodedSize > chunkBegin) {
+        chunks->push_back(ConstBytes{trace.data + chunkBegin, decodedSize - chunkBegin});
+    }
+
+    if (decoder.bytes_left()) {
+        fprintf(stderr, "%s: warning: could not decode trace past byte %zu of %zu\n", __func__,
+                decodedSize, trace.size);
+        return false;
+    }
+    return true;
+}
+
+// Same as rewriteTracePackets, but chunks of about |chunkSize| of |trace| are
+// rewritten on up to |jobs| worker threads while the calling thread writes
+// finished chunks to |out| in their original order.
+template <typename Rewriter>
+static bool rewriteTracePacketsParallel(ConstBytes trace, const Rewriter& rewriter,
+                                        unsigned jobs, size_t chunkSize, std::ostream& out) {
+    std::vector<ConstBytes> chunks;
+    bool ok = splitTraceIntoChunks(trace, chunkSize, &chunks);
+    // No point in threads that would find no chunk left.
+    jobs = static_cast<unsigned>(std::min<size_t>(jobs, chunks.size()));
+
+    const size_t maxChunksInFlight = jobs * kParallelChunksInFlightPerJob;
+    std::vector<ChunkOutput> outputs(chunks.size());
+    std::vector<bool> rewritten(chunks.size(), false);
+    size_t nextChunk = 0;
+    size_t chunksWritten = 0;
+    std::mutex lock;
+    std::condition_variable cv;
+
+    auto worker = [&]() {
+        for (;;) {
+            size_t index;
+            {
+                std::unique_lock<std::mutex> l(lock);
+                cv.wait(l, [&] {
+                    return nextChunk == chunks.size() ||
+                           nextChunk < chunksWritten + maxChunksInFlight;
+                });
+                if (nextChunk == chunks.size()) return;
+                index = nextChunk++;
+            }
+
+            ChunkOutput chunkOut;
+            rewriteTracePackets(chunks[index], rewriter, chunkOut);
+
+            {
+                std::lock_guard<std::mutex> l(lock);
+                outputs[index] = std::move(chunkOut);
+                rewritten[index] = true;
+            }
+            cv.notify_all();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < jobs; ++i) {
+        workers.emplace_back(worker);
+    }
+
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        ChunkOutput chunkOut;
+        {
+            std::unique_lock<std::mutex> l(lock);
+            cv.wait(l, [&] { return rewritten[i]; });
+            chunkOut = std::move(outputs[i]);
+        }
+        out.write(chunkOut.bytes.data(), chunkOut.bytes.size());
+        {
+            std::lock_guard<std::mutex> l(lock);
+            ++chunksWritten;
+        }
+        cv.notify_all();
+    }
+
+    for (auto& t : workers) {
+        t.join();
+    }
+
+    return ok;
+}
+
+// The uuid mask for combining |addonTrace| into |mainTrace|. It only has to
+// look random; deriving it from the inputs, rather than drawing it, makes
+// combining the same traces give the same output every time, however many
+// jobs there are.
+static uint64_t deriveUuidMask(ConstBytes mainTrace, ConstBytes addonTrace) {
+    static const size_t kHashedPrefixSize = 4096;
+    // FNV-1a over the sizes and the start of both traces, then a splitmix64
+    // finalizer to spread the bits.
+    uint64_t hash = 14695981039346656037ull;
+    auto update = [&hash](const uint8_t* data, size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            hash = (hash ^ data[i]) * 1099511628211ull;
+        }
+    };
+    for (ConstBytes trace : { mainTrace, addonTrace }) {
+        uint64_t size = trace.size;
+        update(reinterpret_cast<const uint8_t*>(&size), sizeof(size));
+        update(trace.data, std::min(trace.size, kHashedPrefixSize));
+    }
+    hash ^= hash >> 30;
+    hash *= 0xbf58476d1ce4e5b9ull;
+    hash ^= hash >> 27;
+    hash *= 0x94d049bb133111ebull;
+    hash ^= hash >> 31;
+    return hash ? hash : 1;
+}
+
+bool writeCombinedTrace(
+    ScannedTrace& mainTrace,
+    ScannedTrace& addonTrace,
+    int64_t mainTimeDiff, bool addTraces,
+    bool clockSnapshotTimeDiff,
+    unsigned jobs,
+    std::ostream& out,
+    size_t jobChunkSize) {
+
+    ConstBytes addonBytes = addonTrace.bytes();
+    out.write(reinterpret_cast<const char*>(mainTrace.bytes().data), mainTrace.bytes().size);
+
+    if (addTraces) {
+        out.write(reinterpret_cast<const char*>(addonBytes.data), addonBytes.size);
+        return true;
+    }
+
+    // The max seqid/pid/tid and clocks of the main trace. Usually cached from
+    // deriving the time diff.
+    const TraceSummary& mainIds = mainTrace.summary();
+    bool ok = mainIds.decoded;
+
+    // Use the same offset in case pids and tids are mixed up.
+    uint32_t maxPidTid = std::max(mainIds.maxPid, mainIds.maxTid);
+    // Use an offset that is easy to read out the original addon pid for debugging.
+    uint64_t pidTidOffset = 1000000;
+    while(pidTidOffset < maxPidTid)
+        pidTidOffset *= 10;
+
+    uint64_t realtime = mainIds.hasClockSnapshot ? mainIds.realtime : 0;
+    uint64_t boottime = mainIds.hasClockSnapshot ? mainIds.boottime : 0;
+    uint64_t mainBoottimeToRealtime = realtime - boottime;
+    // If the addon has no clock snapshot, assume it has the same realtime offset as the main trace.
+    getClockSnapshotTimes(addonTrace, &realtime, &boottime);
+    uint64_t addonRealtimeToBoottime = boottime - realtime;
+
+    AddonTraceTransforms transforms;
+    transforms.timestampDiff = mainTimeDiff;
+    transforms.realtimeDiff = addonRealtimeToBoottime + mainTimeDiff + mainBoottimeToRealtime;
+    transforms.trustedUidOffset = mainIds.maxTrustedUid;
+    transforms.sequenceIdOffset = mainIds.maxSequenceId;
+    transforms.pidTidOffset = pidTidOffset;
+    // Easier to see host CPUs vs guest CPUs with fixed offset.
+    // 1000 would be more ideal, but the Perfetto UI doesn't allow CPU IDs that high.
+    transforms.cpuOffset = 100;
+    // Track uuids are remapped with an xor mask. Unlike a lookup table this
+    // needs no extra pass over the addon trace, keeps references through
+    // parent_uuid and track_uuid consistent and still makes collisions with
+    // the main trace's uuids vanishingly unlikely.
+    transforms.uuidMask = deriveUuidMask(mainTrace.bytes(), addonBytes);
+    transforms.clockSnapshotTimeDiff = clockSnapshotTimeDiff;
+    getSequenceClockSequenceIds(addonTrace, clockSnapshotTimeDiff, &transforms.sequenceClockSequenceIds);
+
+    fprintf(stderr, "%s: postprocessing trace with main time diff of %lld%s, and offseting by main max seqid %u, pid offset %llu\n", __func__,
+            (long long)mainTimeDiff,
+            clockSnapshotTimeDiff ? " (clock snapshots)" : "",
+            mainIds.maxSequenceId,
+            (unsigned long long)pidTidOffset);
+
+    TracePacketRewriter<const AddonTraceTransforms> rewriter(transforms);
+
+    if (jobs == 0) {
+        jobs = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    if (!jobChunkSize) {
+        jobChunkSize = kParallelChunkSize;
+    }
+
+    // Not worth spinning up threads for an addon that fits in one chunk.
+    if (jobs > 1 && addonBytes.size > jobChunkSize) {
+        fprintf(stderr, "%s: rewriting addon trace on up to %u threads\n", __func__, jobs);
+        ok = rewriteTracePacketsParallel(addonBytes, rewriter, jobs, jobChunkSize, out) && ok;
+    } else {
+        ok = rewriteTracePackets(addonBytes, rewriter, out) && ok;
+    }
+
+    return ok;
+}
+
+// Offsets for the online addon. The main trace is this process's own (the
+// SDK build's host trace): its trace writers get small sequence ids, and its
+// pids and tids are under the kernel's pid_max (at most 2^22).
+static const uint32_t kOnlineSequenceIdOffset = 1 << 16;
+static const uint32_t kOnlineTrustedUidOffset = 1 << 20;
+static const uint64_t kOnlinePidTidOffset = 10000000;
+
+struct OnlineTraceCombiner::Rewriter {
+    Rewriter() : rewriter(transforms),
+                 packetBuffer(kPacketBufferInitialSliceSize, kPacketBufferMaxSliceSize) {}
+
+    // Picks up what the addon's packets say about its clocks before the
+    // packet itself is rewritten with them.
+    void onPacket(ConstBytes packet) {
+        ProtoDecoder packetDecoder(packet.data, packet.size);
+        for (Field field = packetDecoder.ReadField(); field.valid(); field = packetDecoder.ReadField()) {
+            if (field.type() != ProtoWireType::kLengthDelimited) continue;
+            if (field.id() == pbzero::TracePacket::kTracePacketDefaultsFieldNumber &&
+                defaultsToSequenceClock(field.as_bytes())) {
+                Field sequenceId = packetDecoder.FindField(pbzero::TracePacket::kTrustedPacketSequenceIdFieldNumber);
+                addSequenceId(&transforms.sequenceClockSequenceIds, sequenceId.as_uint32());
+            } else if (field.id() == pbzero::TracePacket::kClockSnapshotFieldNumber && !hasClockSnapshot) {
+                uint64_t realtime, boottime;
+                if (readClockSnapshotTimes(field.as_bytes(), &realtime, &boottime)) {
+                    hasClockSnapshot = true;
+                    transforms.realtimeDiff = boottime - realtime + transforms.timestampDiff + mainBoottimeToRealtime;
+                }
+            }
+        }
+
+        rewriter.rewritePacket(packet, packetBuffer->BeginNestedMessage<Message>(pbzero::Trace::kPacketFieldNumber));
+    }
+
+    AddonTraceTransforms transforms;
+    TracePacketRewriter<const AddonTraceTransforms> rewriter;
+    ::protozero::HeapBuffered<Message> packetBuffer;
+    uint64_t mainBoottimeToRealtime = 0;
+    bool hasClockSnapshot = false;
+};
+
+OnlineTraceCombiner::OnlineTraceCombiner(int64_t timestampDiff, std::ostream& out) :
+    mRewriter(new Rewriter()), mOut(out) {
+    AddonTraceTransforms& transforms = mRewriter->transforms;
+    mRewriter->mainBoottimeToRealtime =
+        (uint64_t)::perfetto::base::GetWallTimeNs().count() - (uint64_t)::perfetto::base::GetBootTimeNs().count();
+    transforms.timestampDiff = timestampDiff;
+    // Until the addon has a clock snapshot, assume it has the same realtime
+    // offset as the main trace.
+    transforms.realtimeDiff = timestampDiff;
+    transforms.trustedUidOffset = kOnlineTrustedUidOffset;
+    transforms.sequenceIdOffset = kOnlineSequenceIdOffset;
+    transforms.pidTidOffset = kOnlinePidTidOffset;
+    transforms.cpuOffset = 100;
+    transforms.uuidMask = ::perfetto::base::GenUuidv4Lsb();
+
+    fprintf(stderr, "%s: rewriting addon trace as it arrives with time diff %lld\n", __func__,
+            (long long)timestampDiff);
+}
+
+OnlineTraceCombiner::~OnlineTraceCombiner() = default;
+
+void OnlineTraceCombiner::appendAddon(const void* data, size_t size) {
+    mAddonSize += size;
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    mPending.insert(mPending.end(), bytes, bytes + size);
+
+    ProtoDecoder decoder(mPending.data(), mPending.size());
+    size_t rewritten = 0;
+    for (Field field = decoder.ReadField(); field.valid(); field = decoder.ReadField()) {
+        if (field.id() == pbzero::Trace::kPacketFieldNumber &&
+            field.type() == ProtoWireType::kLengthDelimited) {
+            mRewriter->onPacket(field.as_bytes());
+            for (const auto& range : mRewriter->packetBuffer.GetRanges()) {
+                mOut.write(reinterpret_cast<const char*>(range.begin), range.size());
+            }
+            mRewriter->packetBuffer.Reset();
+        }
+        rewritten = decoder.read_offset();
+    }
+    mPending.erase(mPending.begin(), mPending.begin() + rewritten);
+}
+
+bool OnlineTraceCombiner::finish(ConstBytes mainTrace) {
+    bool ok = mPending.empty();
+    if (!ok) {
+        fprintf(stderr, "%s: warning: addon trace cut off, last %zu bytes left out\n", __func__,
+                mPending.size());
+        mPending.clear();
+    }
+    mOut.write(reinterpret_cast<const char*>(mainTrace.data), mainTrace.size);
+    return ok;
+}
+
+} // namespace vperfetto
@@ -0,0 +1,215 @@
+// Copyright 2020 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include "perfetto.h"
+
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <vector>
+
+// Streaming trace combiner used by the SDK build (vperfetto-sdk.cpp).
+//
+// Traces are never parsed into a ::perfetto::protos::Trace. Instead, the addon
+// trace is decoded one TracePacket at a time with protozero::ProtoDecoder; only
+// the timestamp/pid/tid/cpu/uuid/sequence id fields are re-encoded, and every
+// other field is copied through byte for byte.
+
+namespace vperfetto {
+
+static inline ::protozero::ConstBytes traceBytes(const std::vector<char>& trace) {
+    return ::protozero::ConstBytes{reinterpret_cast<const uint8_t*>(trace.data()), trace.size()};
+}
+
+// A read-only view of a trace file on disk. On POSIX the file is mapped
+// MAP_PRIVATE with MADV_SEQUENTIAL, so decoding pulls pages straight from the
+// page cache and inputs larger than RAM never get copied onto the heap.
+// Elsewhere the file is read into memory.
+class MappedTraceFile {
+public:
+    explicit MappedTraceFile(const char* filename);
+    ~MappedTraceFile();
+
+    MappedTraceFile(const MappedTraceFile&) = delete;
+    MappedTraceFile& operator=(const MappedTraceFile&) = delete;
+
+    // False if the file could not be opened or mapped, or is empty.
+    bool valid() const { return mData != nullptr; }
+    size_t size() const { return mSize; }
+    ::protozero::ConstBytes bytes() const {
+        return ::protozero::ConstBytes{static_cast<const uint8_t*>(mData), mSize};
+    }
+
+private:
+    void* mData = nullptr;
+    size_t mSize = 0;
+#ifdef _WIN32
+    std::vector<char> mContents;
+#endif
+};
+
+// Clock sync data found in a single TracePacket: a ClockSnapshot of exactly
+// two clocks, one of them the raw cpu clock (id 64), and/or clock_sync_*
+// debug annotations on its TrackEvent.
+struct TraceClockSyncPoint {
+    bool hasSnapshot = false;
+    uint32_t snapshotClockId = 0;
+    uint64_t snapshotClockTime = 0;
+    uint64_t snapshotCpuTime = 0;
+
+    bool hasBoottime = false;
+    uint64_t boottime = 0;
+    bool hasMonotonic = false;
+    uint64_t monotonic = 0;
+    bool hasCpuTime = false;
+    uint64_t cpuTime = 0;
+};
+
+// Everything the time sync derivation and the combiner need to know about a
+// trace before rewriting it, gathered in one pass.
+struct TraceSummary {
+    // False if the trace could not be decoded to the end.
+    bool decoded = true;
+
+    // Timestamp of the first packet that has one. Sequences whose timestamps
+    // are deltas count from the BOOTTIME their clock starts at.
+    bool hasTimestamp = false;
+    uint64_t firstTimestamp = 0;
+
+    // Sorted ids of the sequences whose TracePacketDefaults put timestamps on
+    // a sequence-scoped clock, like the non-SDK build's incremental one.
+    std::vector<uint32_t> incrementalClockSequenceIds;
+    // Sorted ids of the sequences whose TracePacketDefaults put timestamps on
+    // BOOTTIME, like the SDK's track event sequences.
+    std::vector<uint32_t> boottimeSequenceIds;
+
+    // The first clock snapshot with both REALTIME and BOOTTIME.
+    bool hasClockSnapshot = false;
+    uint64_t realtime = 0;
+    uint64_t boottime = 0;
+
+    // In trace order.
+    std::vector<TraceClockSyncPoint> clockSyncPoints;
+
+    uint32_t maxTrustedUid = 0;
+    uint32_t maxSequenceId = 0;
+    uint32_t maxPid = 0;
+    uint32_t maxTid = 0;
+    uint32_t maxCpu = 0;
+};
+
+// A trace to be combined. The trace is scanned the first time its summary is
+// asked for, and the result is kept for every later user.
+class ScannedTrace {
+public:
+    explicit ScannedTrace(::protozero::ConstBytes bytes) : mBytes(bytes) {}
+    // For a trace that was scanned already, like a StreamedTrace.
+    ScannedTrace(::protozero::ConstBytes bytes, const TraceSummary& summary) :
+        mBytes(bytes), mScanned(true), mSummary(summary) {}
+
+    ::protozero::ConstBytes bytes() const { return mBytes; }
+    bool scanned() const { return mScanned; }
+    const TraceSummary& summary();
+
+private:
+    ::protozero::ConstBytes mBytes;
+    bool mScanned = false;
+    TraceSummary mSummary;
+};
+
+// A trace that arrives in pieces, such as the guest trace over a socket. The
+// packets are scanned as they complete, so once the last piece is in only
+// the combining is left to do.
+class StreamedTrace {
+public:
+    void append(const void* data, size_t size);
+
+    // The trace so far, and its summary. A packet cut off at the end counts
+    // as undecodable. Valid until the next append() or clear().
+    ScannedTrace trace();
+
+    size_t size() const { return mBytes.size(); }
+    void clear();
+
+private:
+    std::vector<char> mBytes;
+    // How much of |mBytes| is whole packets that have been scanned.
+    size_t mScannedSize = 0;
+    TraceSummary mSummary;
+};
+
+// Writes |mainTrace| followed by |addonTrace| into |out|.
+// Unless |addTraces| is set, the addon's timestamps are shifted by
+// |mainTimeDiff|, its clock snapshots and service events are dropped and its
+// uids, sequence ids, pids, tids, cpus and track uuids are offset so they don't
+// collide with the ones in |mainTrace|. Timestamps on an addon sequence's
+// own clock are left alone; the clock snapshots that set that clock's base
+// are kept and shifted instead.
+// With |clockSnapshotTimeDiff|, the same goes for the timestamps of addon
+// sequences on BOOTTIME: their defaults move them onto a sequence-scoped
+// clock, and a clock snapshot next to the defaults puts that clock
+// |mainTimeDiff| from BOOTTIME, for trace processor to convert at load time.
+// Ftrace events and packets on sequences without defaults are still shifted.
+// With |jobs| > 1 the addon is split at packet boundaries into chunks of about
+// |jobChunkSize| bytes (0: 4 MiB) and the chunks are rewritten on up to that
+// many threads; the output is identical to a single job.
+// Returns false if either trace could not be decoded; packets decoded up to
+// that point are still written.
+bool writeCombinedTrace(
+    ScannedTrace& mainTrace,
+    ScannedTrace& addonTrace,
+    int64_t mainTimeDiff, bool addTraces,
+    bool clockSnapshotTimeDiff,
+    unsigned jobs,
+    std::ostream& out,
+    size_t jobChunkSize = 0);
+
+// writeCombinedTrace() for an addon trace that streams in while the main
+// trace is still being recorded: each addon packet is rewritten as soon as it
+// is complete and goes straight to |out|, so once the main trace ends only it
+// is left to write. What writeCombinedTrace() scans the main trace for is
+// fixed up front instead: sequence id, uid and pid/tid offsets are picked
+// above what a live process's trace has, and the main trace's REALTIME offset
+// is read from the clocks now. The addon's own clock state (incremental clock
+// sequences, REALTIME offset) is picked up from its packets as they go by.
+class OnlineTraceCombiner {
+public:
+    // |timestampDiff| moves addon timestamps into the main trace's time base.
+    OnlineTraceCombiner(int64_t timestampDiff, std::ostream& out);
+    ~OnlineTraceCombiner();
+
+    OnlineTraceCombiner(const OnlineTraceCombiner&) = delete;
+    OnlineTraceCombiner& operator=(const OnlineTraceCombiner&) = delete;
+
+    // Rewrites the addon packets completed by these bytes. A packet cut off at
+    // the end waits for the rest.
+    void appendAddon(const void* data, size_t size);
+
+    // Writes |mainTrace| as is, after the addon. Returns false if the addon
+    // ended in the middle of a packet, which is left out.
+    bool finish(::protozero::ConstBytes mainTrace);
+
+    size_t addonSize() const { return mAddonSize; }
+
+private:
+    struct Rewriter;
+    std::unique_ptr<Rewriter> mRewriter;
+    std::ostream& mOut;
+    // The start of a packet still to arrive in full.
+    std::vector<uint8_t> mPending;
+    size_t mAddonSize = 0;
+};
+
+} // namespace vperfetto
@@ -0,0 +1,85 @@
+// Copyright 2020 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include "perfetto.h"
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Counter tracks for the SDK builds (vperfetto-sdk.cpp, vperfetto-min.cpp).
+// Include after PERFETTO_DEFINE_CATEGORIES.
+//
+// The v7 SDK has no counter tracks of its own, so each counter name gets a
+// Track whose TrackDescriptor is marked as a counter. The track and its
+// descriptor are created the first time the name is seen in the process; the
+// SDK then emits the descriptor once per trace writer. A StaticCounterName
+// (VPERFETTO_TRACE_COUNTER) looks its track up once, so its samples are
+// counter events on a known track. Other samples go through a per-thread
+// cache keyed on the name's contents, so names built at runtime get one track
+// each too.
+
+namespace vperfetto {
+
+// Counter track ids sit far above thread ids, since the SDK derives the uuids
+// of both by xoring the id with the process track's uuid.
+static const uint64_t kCounterTrackIdBase = 0x7c00000000000000ULL;
+
+// The id of the counter track for |name|. |storedName| is set to the
+// process-lifetime copy of the name, for caches to key on.
+static inline uint64_t getCounterTrackId(const char* name, std::string_view* storedName = nullptr) {
+    static std::mutex sCounterTracksLock;
+    static std::unordered_map<std::string, uint64_t> sCounterTrackIds;
+
+    std::lock_guard<std::mutex> lock(sCounterTracksLock);
+    auto it = sCounterTrackIds.find(name);
+    if (it == sCounterTrackIds.end()) {
+        uint64_t id = kCounterTrackIdBase + sCounterTrackIds.size();
+        it = sCounterTrackIds.emplace(name, id).first;
+
+        ::perfetto::Track track(id);
+        auto desc = track.Serialize();
+        desc.set_name(name);
+        desc.mutable_counter();
+        ::perfetto::TrackEvent::SetTrackDescriptor(track, desc);
+    }
+    if (storedName) *storedName = it->first;
+    return it->second;
+}
+
+static inline ::perfetto::Track getCounterTrack(const char* name) {
+    thread_local std::unordered_map<std::string_view, ::perfetto::Track> tCounterTracks;
+
+    auto it = tCounterTracks.find(name);
+    if (__builtin_expect(it != tCounterTracks.end(), true)) {
+        return it->second;
+    }
+    std::string_view storedName;
+    uint64_t id = getCounterTrackId(name, &storedName);
+    return tCounterTracks.emplace(storedName, ::perfetto::Track(id)).first->second;
+}
+
+} // namespace vperfetto
+
+// Records |value| on counter track |track| (see getCounterTrack()).
+#define VPERFETTO_COUNTER_EVENT(category, track, value) \
+    PERFETTO_INTERNAL_TRACK_EVENT( \
+            category, nullptr, \
+            ::perfetto::protos::pbzero::TrackEvent::TYPE_COUNTER, track, \
+            [&](::perfetto::EventContext ctx) { \
+            ctx.event()->set_counter_value(value); \
+            })
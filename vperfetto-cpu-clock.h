@@ -0,0 +1,203 @@
+// Copyright 2020 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// The raw CPU counter behind the non-SDK build's rawCpuClock mode: the TSC on
+// x86 and cntvct_el0 on arm64, the same counters arcvm-time-sync-app reads.
+// Reading one takes a few ns, where BOOTTIME is a clock_gettime() per event.
+//
+// Events still go in the trace in BOOTTIME nanoseconds, since trace processor
+// converts between clocks 1:1 and ticks aren't nanoseconds. CpuClock keeps a
+// tick rate calibrated against BOOTTIME that tracing threads convert with,
+// and each of its calibration points goes in the trace as a ClockSnapshot of
+// BOOTTIME and the raw counter (clock 64): the host side of the combiner's
+// CPU time sync.
+
+namespace vperfetto {
+
+// From vperfetto.h, which has no include guard.
+uint64_t bootTimeNs();
+
+static inline bool hasCpuTicks() {
+#if defined(__x86_64__) || defined(__i386__) || defined(__aarch64__)
+    return true;
+#else
+    return false;
+#endif
+}
+
+static inline uint64_t readCpuTicks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t vct;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(vct));
+    return vct;
+#else
+    return 0;
+#endif
+}
+
+// The counter and BOOTTIME read together, and the rate to convert later ticks
+// with.
+struct CpuClockCalibration {
+    uint64_t ticks = 0;
+    uint64_t bootTimeNs = 0;
+    // Nanoseconds per tick, in 32.32 fixed point; 0 until the first rate is
+    // measured.
+    uint64_t nsPerTickFixed = 0;
+
+    uint64_t toBootTimeNs(uint64_t t) const {
+        // Signed, as another core's counter may be a little behind.
+        int64_t delta = (int64_t)(t - ticks);
+        return bootTimeNs + (int64_t)(((__int128)delta * nsPerTickFixed) >> 32);
+    }
+};
+
+// Publishes calibrations to the tracing threads, which only reread it when
+// the generation changes. enableTracing() starts it and the host writer
+// recalibrates; a session can start while the last one's writer is still
+// finishing, so the publishing side is under a lock.
+class CpuClock {
+public:
+    static constexpr uint32_t kClockId = 64;
+
+    // Takes the first calibration point, which the rate is measured from for
+    // the rest of the session. arm64 has its counter frequency in cntfrq_el0;
+    // on x86 the first rate comes from the first recalibrateIfDue() at least
+    // kInitialCalibrationMs later, and until then the published calibration
+    // has no rate and threads read BOOTTIME.
+    void start() {
+        std::lock_guard<std::mutex> lock(mLock);
+        mStart = sample();
+        CpuClockCalibration calibration = mStart;
+#if defined(__aarch64__)
+        uint64_t frequency;
+        asm volatile("mrs %0, cntfrq_el0" : "=r"(frequency));
+        calibration.nsPerTickFixed = (1000000000ULL << 32) / frequency;
+#endif
+        mNsPerTickFixed = calibration.nsPerTickFixed;
+        mLastCalibrationNs = calibration.bootTimeNs;
+        publish(calibration);
+        mRunning.store(true, std::memory_order_release);
+    }
+
+    void stop() {
+        std::lock_guard<std::mutex> lock(mLock);
+        mRunning.store(false, std::memory_order_relaxed);
+    }
+
+    bool running() const {
+        return mRunning.load(std::memory_order_acquire);
+    }
+
+    // Publishes the first rate once kInitialCalibrationMs have passed since
+    // start(), then a new point about every kRecalibrationIntervalMs, with the
+    // rate measured since start().
+    void recalibrateIfDue() {
+        std::lock_guard<std::mutex> lock(mLock);
+        if (!running()) return;
+        CpuClockCalibration calibration = sample();
+        if (mNsPerTickFixed) {
+            if (calibration.bootTimeNs - mLastCalibrationNs < kRecalibrationIntervalMs * 1000000ULL) return;
+        } else if (calibration.bootTimeNs - mStart.bootTimeNs < kInitialCalibrationMs * 1000000ULL) {
+            return;
+        }
+#if !defined(__aarch64__)
+        mNsPerTickFixed = rate(mStart, calibration);
+#endif
+        calibration.nsPerTickFixed = mNsPerTickFixed;
+        mLastCalibrationNs = calibration.bootTimeNs;
+        publish(calibration);
+    }
+
+    uint32_t generation() const {
+        return mGeneration.load(std::memory_order_acquire);
+    }
+
+    // The calibration of |generation|, as returned by generation().
+    CpuClockCalibration calibration(uint32_t generation) const {
+        const Slot& slot = mSlots[generation & 1];
+        CpuClockCalibration calibration;
+        calibration.ticks = slot.ticks.load(std::memory_order_relaxed);
+        calibration.bootTimeNs = slot.bootTimeNs.load(std::memory_order_relaxed);
+        calibration.nsPerTickFixed = slot.nsPerTickFixed.load(std::memory_order_relaxed);
+        return calibration;
+    }
+
+private:
+    static constexpr uint32_t kInitialCalibrationMs = 10;
+    static constexpr uint32_t kRecalibrationIntervalMs = 1000;
+
+    // Reads BOOTTIME between two counter reads, a few times, and keeps the
+    // tightest pair.
+    static CpuClockCalibration sample() {
+        CpuClockCalibration best;
+        uint64_t bestWindow = UINT64_MAX;
+        for (int i = 0; i < 4; ++i) {
+            uint64_t before = readCpuTicks();
+            uint64_t bootTime = bootTimeNs();
+            uint64_t after = readCpuTicks();
+            if (after - before < bestWindow) {
+                bestWindow = after - before;
+                best.ticks = before + (after - before) / 2;
+                best.bootTimeNs = bootTime;
+            }
+        }
+        return best;
+    }
+
+    static uint64_t rate(const CpuClockCalibration& from, const CpuClockCalibration& to) {
+        uint64_t ticks = to.ticks - from.ticks;
+        if (!ticks) return 0;
+        return (uint64_t)(((unsigned __int128)(to.bootTimeNs - from.bootTimeNs) << 32) / ticks);
+    }
+
+    // A reader uses the slot of the generation it loaded; the next publish
+    // writes the other one, so it would take two publishes (seconds apart)
+    // during one read to tear it.
+    void publish(const CpuClockCalibration& calibration) {
+        uint32_t next = mGeneration.load(std::memory_order_relaxed) + 1;
+        Slot& slot = mSlots[next & 1];
+        slot.ticks.store(calibration.ticks, std::memory_order_relaxed);
+        slot.bootTimeNs.store(calibration.bootTimeNs, std::memory_order_relaxed);
+        slot.nsPerTickFixed.store(calibration.nsPerTickFixed, std::memory_order_relaxed);
+        mGeneration.store(next, std::memory_order_release);
+    }
+
+    struct Slot {
+        std::atomic<uint64_t> ticks{0};
+        std::atomic<uint64_t> bootTimeNs{0};
+        std::atomic<uint64_t> nsPerTickFixed{0};
+    };
+    Slot mSlots[2];
+    std::atomic<uint32_t> mGeneration{0};
+    std::atomic<bool> mRunning{false};
+
+    // Under |mLock|.
+    std::mutex mLock;
+    CpuClockCalibration mStart;
+    uint64_t mNsPerTickFixed = 0;
+    uint64_t mLastCalibrationNs = 0;
+};
+
+} // namespace vperfetto
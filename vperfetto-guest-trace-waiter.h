@@ -0,0 +1,218 @@
+// Copyright 2020 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <mutex>
+#include <string>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+// How the save thread knows the guest trace has arrived and can be combined,
+// in both builds. The guest trace is complete once:
+//
+// - notifyGuestTraceReady() says so,
+// - (Linux) a writer closes it or it is renamed into place, or
+// - it was already there and nothing writes to it for kSettleMs. Elsewhere,
+//   or if inotify is not available, this is the only way, with its size
+//   checked every kPollMs.
+//
+// A guest trace streamed in with pushGuestTraceChunk() has no file to watch;
+// finishGuestTrace() notifies.
+
+namespace vperfetto {
+
+class GuestTraceWaiter {
+public:
+    static constexpr uint32_t kDefaultTimeoutMs = 20000;
+
+    // Forgets what was notified for the last session.
+    void reset() {
+        std::lock_guard<std::mutex> lock(mLock);
+        mNotified = false;
+        mNotifiedPath.clear();
+    }
+
+    // The guest trace is complete, at |path| if given. Can come before or
+    // during wait().
+    void notifyReady(const char* path) {
+        std::lock_guard<std::mutex> lock(mLock);
+        mNotified = true;
+        mNotifiedPath = path ? path : "";
+        mReady.notify_all();
+#ifdef __linux__
+        if (mWakeFd >= 0) {
+            static const char kWake = 0;
+            (void)!write(mWakeFd, &kWake, 1);
+        }
+#endif
+    }
+
+    // Waits up to |timeoutMs| (0 for kDefaultTimeoutMs) for the guest trace at
+    // |path|, or only for notifyReady() if |path| is null, to be complete.
+    // Returns false on timeout; otherwise |*readyPath| is where to read it
+    // from, which notifyReady() can change.
+    bool wait(const char* path, uint32_t timeoutMs, std::string* readyPath) {
+        auto deadline = std::chrono::steady_clock::now() +
+            std::chrono::milliseconds(timeoutMs ? timeoutMs : kDefaultTimeoutMs);
+        bool ready = false;
+        if (path) {
+            bool watched = false;
+#ifdef __linux__
+            watched = waitForClose(path, deadline, &ready);
+#endif
+            if (!watched) ready = waitForStableSize(path, deadline);
+        }
+
+        std::unique_lock<std::mutex> lock(mLock);
+        if (!path) mReady.wait_until(lock, deadline, [this] { return mNotified; });
+        *readyPath = !mNotifiedPath.empty() ? mNotifiedPath : (path ? path : "");
+        return ready || mNotified;
+    }
+
+private:
+    static constexpr uint32_t kSettleMs = 500;
+    static constexpr uint32_t kPollMs = 250;
+
+    using Clock = std::chrono::steady_clock;
+
+    static uint64_t fileSize(const char* path) {
+        std::error_code error;
+        uint64_t size = std::filesystem::file_size(path, error);
+        return error ? 0 : size;
+    }
+
+    bool notified() {
+        std::lock_guard<std::mutex> lock(mLock);
+        return mNotified;
+    }
+
+    bool waitForStableSize(const char* path, Clock::time_point deadline) {
+        uint64_t lastSize = fileSize(path);
+        auto settled = Clock::now() + std::chrono::milliseconds(kSettleMs);
+        std::unique_lock<std::mutex> lock(mLock);
+        while (!mNotified) {
+            auto now = Clock::now();
+            if (now >= deadline) return false;
+            mReady.wait_until(lock, std::min(deadline, now + std::chrono::milliseconds(kPollMs)));
+            if (mNotified) break;
+            lock.unlock();
+            uint64_t size = fileSize(path);
+            now = Clock::now();
+            lock.lock();
+            if (!size || size != lastSize) {
+                lastSize = size;
+                settled = now + std::chrono::milliseconds(kSettleMs);
+            } else if (now >= settled) {
+                fprintf(stderr, "%s: guest trace size is stable\n", __func__);
+                return true;
+            }
+        }
+        return true;
+    }
+
+#ifdef __linux__
+    // Returns false if inotify can't watch |path|'s directory.
+    bool waitForClose(const char* path, Clock::time_point deadline, bool* ready) {
+        std::string file(path);
+        size_t slash = file.rfind('/');
+        std::string dir = slash == std::string::npos ? "." : (slash ? file.substr(0, slash) : "/");
+        std::string name = slash == std::string::npos ? file : file.substr(slash + 1);
+
+        int inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotifyFd < 0) return false;
+        if (inotify_add_watch(inotifyFd, dir.c_str(),
+                              IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_MODIFY) < 0) {
+            fprintf(stderr, "%s: cannot watch %s, polling the guest trace instead\n", __func__, dir.c_str());
+            close(inotifyFd);
+            return false;
+        }
+        int wakeFds[2];
+        if (pipe2(wakeFds, O_NONBLOCK | O_CLOEXEC)) {
+            close(inotifyFd);
+            return false;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+            mWakeFd = wakeFds[1];
+        }
+
+        // A trace already there may be done; one still being written shows
+        // up as writes and ends with a close.
+        bool settling = fileSize(path) > 0;
+        auto settled = Clock::now() + std::chrono::milliseconds(kSettleMs);
+
+        *ready = false;
+        alignas(struct inotify_event) char events[4096];
+        while (!*ready && !notified()) {
+            auto now = Clock::now();
+            auto until = settling ? std::min(deadline, settled) : deadline;
+            if (now >= until) {
+                *ready = settling && now >= settled;
+                if (*ready) fprintf(stderr, "%s: guest trace was already there\n", __func__);
+                break;
+            }
+            struct pollfd fds[2] = {
+                { inotifyFd, POLLIN, 0 },
+                { wakeFds[0], POLLIN, 0 },
+            };
+            int timeoutMs = (int)std::chrono::duration_cast<std::chrono::milliseconds>(until - now).count() + 1;
+            if (poll(fds, 2, timeoutMs) <= 0 || !(fds[0].revents & POLLIN)) continue;
+
+            ssize_t size;
+            while ((size = read(inotifyFd, events, sizeof(events))) > 0) {
+                for (char* p = events; p < events + size; ) {
+                    const struct inotify_event* event = (const struct inotify_event*)p;
+                    p += sizeof(struct inotify_event) + event->len;
+                    if (!event->len || name != event->name) continue;
+                    if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                        *ready = fileSize(path) > 0;
+                        if (*ready) fprintf(stderr, "%s: guest trace written\n", __func__);
+                    } else {
+                        settling = false;
+                    }
+                }
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+            mWakeFd = -1;
+        }
+        close(wakeFds[0]);
+        close(wakeFds[1]);
+        close(inotifyFd);
+        return true;
+    }
+
+    // The write end of the pipe that wakes waitForClose(), while it waits.
+    int mWakeFd = -1;
+#endif
+
+    std::mutex mLock;
+    std::condition_variable mReady;
+    bool mNotified = false;
+    std::string mNotifiedPath;
+};
+
+} // namespace vperfetto
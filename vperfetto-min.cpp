@@ -2,12 +2,24 @@
 #include "vperfetto-min.h"
 #include "vperfetto.h"
 
+#include <atomic>
 #include <chrono>
+#include <deque>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <fstream>
 #include <unordered_map>
 
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 #define DEFINE_PERFETTO_CATEGORY(name, description) \
     ::perfetto::Category(#name).SetDescription(description),
 
@@ -18,12 +30,18 @@ PERFETTO_DEFINE_CATEGORIES(
 
 PERFETTO_TRACK_EVENT_STATIC_STORAGE();
 
-#define TRACE_COUNTER(category, name, value)  \
-    PERFETTO_INTERNAL_TRACK_EVENT(                  \
-            category, name, \
-            ::perfetto::protos::pbzero::TrackEvent::TYPE_COUNTER, [&](::perfetto::EventContext ctx){ \
-            ctx.event()->set_counter_value(value); \
-            })
+// The header's inline checks index Perfetto's category state directly.
+#define CHECK_CATEGORY_INDEX(name, desc) \
+    static_assert(PERFETTO_TRACK_EVENT_NAMESPACE::internal::kConstExprCategoryRegistry.Find(#name, false) == \
+                  VPERFETTO_MIN_CATEGORY_##name, "category index mismatch");
+
+VPERFETTO_LIST_CATEGORIES(CHECK_CATEGORY_INDEX)
+static_assert(sizeof(std::atomic<uint8_t>) == sizeof(uint8_t), "category state isn't bytes");
+
+extern "C" VPERFETTO_MIN_DATA_EXPORT const volatile void* const vperfetto_min_category_state =
+    PERFETTO_TRACK_EVENT_NAMESPACE::internal::g_category_state_storage;
+
+#include "vperfetto-counters.h"
 
 #   define CC_LIKELY( exp )    (__builtin_expect( !!(exp), true ))
 #   define CC_UNLIKELY( exp )  (__builtin_expect( !!(exp), false ))
@@ -53,6 +71,8 @@ static VirtualDeviceTraceConfig sTraceConfig = {
 
 struct TraceProgress {
     std::vector<char> hostTrace;
+    // file_write_period_ms: the service wrote the trace into the file itself.
+    bool hostTraceStreamed = false;
     std::vector<char> guestTrace;
     std::vector<char> combinedTrace;
 };
@@ -113,7 +133,9 @@ bool useFilenameByEnv(const char* s) {
     return s && ("" != std::string(s));
 }
 
-VPERFETTO_EXPORT void vperfetto_min_startTracing(const vperfetto_min_config* config) {
+// Unless |blocking|, returns before the session has started; the state change
+// callback says when it has.
+static void startTracing(const vperfetto_min_config* config, bool blocking) {
     if (!validateConfig(config)) {
         fprintf(stderr, "%s: Not enabling tracing, config was invalid.\n", __func__);
         return;
@@ -144,17 +166,76 @@ VPERFETTO_EXPORT void vperfetto_min_startTracing(const vperfetto_min_config* con
             ds_cfg->set_name("track_event");
             ds_cfg->set_track_event_config_raw(track_event_cfg.SerializeAsString());
 
+            // Setup() takes a copy of the fd.
+            int fd = -1;
+            if (config->file_write_period_ms) {
+#ifdef _WIN32
+                fd = _open(sTraceConfig.hostFilename, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+                fd = open(sTraceConfig.hostFilename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+#endif
+                if (fd < 0) {
+                    fprintf(stderr, "%s: Warning: could not open %s, keeping the trace in memory\n", __func__,
+                            sTraceConfig.hostFilename);
+                } else {
+                    cfg.set_file_write_period_ms(config->file_write_period_ms);
+                }
+            }
+            sTraceProgress.hostTraceStreamed = fd >= 0;
+
             sTracingSession = ::perfetto::Tracing::NewTrace();
-            sTracingSession->Setup(cfg);
+            sTracingSession->Setup(cfg, fd);
+            if (fd >= 0) {
+#ifdef _WIN32
+                _close(fd);
+#else
+                close(fd);
+#endif
+            }
             sTracingSession->SetOnStartCallback([]() { sOnTracingStateChange(true /* enabled */); });
             sTracingSession->SetOnStopCallback([]() { sOnTracingStateChange(false /* enabled */); });
-            sTracingSession->StartBlocking();
+            if (blocking) {
+                sTracingSession->StartBlocking();
+            } else {
+                sTracingSession->Start();
+            }
         }
         sTraceConfig.tracingDisabled = false;
     }
 }
 
-VPERFETTO_EXPORT void vperfetto_min_endTracing() {
+VPERFETTO_EXPORT void vperfetto_min_startTracing(const vperfetto_min_config* config) {
+    startTracing(config, true /* blocking */);
+}
+
+VPERFETTO_EXPORT void vperfetto_min_startTracingAsync(const vperfetto_min_config* config) {
+    startTracing(config, false /* blocking */);
+}
+
+// Reads the trace out of the stopped session and writes it to the file.
+static void saveStoppedSession() {
+    // A streamed trace is complete on disk once the session stops.
+    if (!sTraceProgress.hostTraceStreamed) {
+        sTraceProgress.hostTrace = sTracingSession->ReadTraceBlocking();
+    }
+
+    fprintf(stderr, "%s: Tracing ended================================================================================\n", __func__);
+    fprintf(stderr, "%s: Saving trace to disk. Configuration:\n", __func__);
+    fprintf(stderr, "%s: host filename: %s\n", __func__, sTraceConfig.hostFilename);
+
+    sTracingSession.reset();
+
+    if (!sTraceProgress.hostTraceStreamed) {
+        std::ofstream hostFile(sTraceConfig.hostFilename, std::ios::out | std::ios::binary);
+        hostFile.write(sTraceProgress.hostTrace.data(), sTraceProgress.hostTrace.size());
+    }
+    sTraceProgress.hostTrace.clear();
+    sTraceConfig.saving = false;
+}
+
+// Unless |blocking|, returns before the session has stopped; a thread of its
+// own then saves the trace and calls the state change callback.
+static void endTracing(bool blocking) {
     if (!sTraceConfig.tracingDisabled) {
         sTraceConfig.tracingDisabled = true;
 
@@ -162,32 +243,93 @@ VPERFETTO_EXPORT void vperfetto_min_endTracing() {
         if (sTraceConfig.saving) return;
         sTraceConfig.saving = true;
 
-        if (sTracingSession) {
+        if (!sTracingSession) {
+            fprintf(stderr, "%s: Tracing ended================================================================================\n", __func__);
+            fprintf(stderr, "%s: No tracing session (assuming system backend), not saving a separate file\n", __func__);
+            ::perfetto::TrackEvent::Flush();
+            sTraceConfig.saving = false;
+            return;
+        }
+
+        if (blocking) {
             sTracingSession->StopBlocking();
-            sTraceProgress.hostTrace = sTracingSession->ReadTraceBlocking();
+            saveStoppedSession();
+            return;
+        }
 
-            fprintf(stderr, "%s: Tracing ended================================================================================\n", __func__);
-            fprintf(stderr, "%s: Saving trace to disk. Configuration:\n", __func__);
-            fprintf(stderr, "%s: host filename: %s\n", __func__, sTraceConfig.hostFilename);
+        // Reported once the trace is saved instead. The callback runs on the
+        // tracing service's thread, which reading the trace needs.
+        sTracingSession->SetOnStopCallback([]() {
+            std::thread saveThread([]() {
+                saveStoppedSession();
+                sOnTracingStateChange(false /* enabled */);
+            });
+            saveThread.detach();
+        });
+        sTracingSession->Stop();
+    }
+}
+
+VPERFETTO_EXPORT void vperfetto_min_endTracing() {
+    endTracing(true /* blocking */);
+}
 
-            sTracingSession.reset();
+VPERFETTO_EXPORT void vperfetto_min_endTracingAsync() {
+    endTracing(false /* blocking */);
+}
 
-            const char* hostFilename = sTraceConfig.hostFilename;
-            {
-                std::ofstream hostFile(sTraceConfig.hostFilename, std::ios::out | std::ios::binary);
-                hostFile.write(sTraceProgress.hostTrace.data(), sTraceProgress.hostTrace.size());
+// Event names passed to the C entry points may be built at runtime, in buffers
+// that get reused, so they can't be interned by address the way the SDK does
+// names given to TRACE_EVENT_BEGIN. They are interned by contents instead:
+// each name goes in a thread's trace once, with an iid that its events refer
+// to, until the SDK clears the thread's incremental state.
+struct EventNameTraits {
+    template <typename ValueType>
+    class Index {
+    public:
+        bool LookUpOrInsert(size_t* iid, const ValueType& name) {
+            auto it = mIids.find(name);
+            if (it != mIids.end()) {
+                *iid = it->second;
+                return true;
             }
-            sTraceConfig.saving = false;
-        } else {
-            fprintf(stderr, "%s: Tracing ended================================================================================\n", __func__);
-            fprintf(stderr, "%s: No tracing session (assuming system backend), not saving a separate file\n", __func__);
-            ::perfetto::TrackEvent::Flush();
+            // Elements of a deque stay put, so the keys can point into them.
+            mNames.emplace_back(name);
+            *iid = mIids.size() + 1;
+            mIids.emplace(mNames.back(), *iid);
+            return false;
         }
+
+    private:
+        std::deque<std::string> mNames;
+        std::unordered_map<std::string_view, size_t> mIids;
+    };
+};
+
+// Every event name of the library goes through this index, since the SDK keeps
+// one index per InternedData field and would mistake its own for this one.
+struct InternedDynamicEventName
+    : public ::perfetto::TrackEventInternedDataIndex<
+          InternedDynamicEventName,
+          ::perfetto::protos::pbzero::InternedData::kEventNamesFieldNumber,
+          std::string_view,
+          EventNameTraits> {
+    static void Add(::perfetto::protos::pbzero::InternedData* internedData,
+                    size_t iid,
+                    std::string_view name) {
+        auto* eventName = internedData->add_event_names();
+        eventName->set_iid(iid);
+        eventName->set_name(name.data(), name.size());
     }
-}
+};
+
+#define VPERFETTO_MIN_TRACE_EVENT_BEGIN(category, eventName) \
+    TRACE_EVENT_BEGIN(category, nullptr, [&](::perfetto::EventContext ctx) { \
+        ctx.event()->set_name_iid(InternedDynamicEventName::Get(&ctx, std::string_view(eventName))); \
+    })
 
 VPERFETTO_EXPORT void vperfetto_min_beginTrackEvent(const char* eventName) {
-    TRACE_EVENT_BEGIN("gfx", ::perfetto::StaticString{eventName});
+    VPERFETTO_MIN_TRACE_EVENT_BEGIN("gfx", eventName);
 }
 
 VPERFETTO_EXPORT void vperfetto_min_endTrackEvent() {
@@ -197,9 +339,7 @@ VPERFETTO_EXPORT void vperfetto_min_endTrackEvent() {
 // Start/end a particular track event in a particular category.
 #define DEFINE_CATEGORY_TRACK_EVENT_DEFINITION(name, desc) \
     VPERFETTO_EXPORT void vperfetto_min_beginTrackEvent_##name(const char* eventName) { \
-        TRACE_EVENT_BEGIN(#name, nullptr, [&](perfetto::EventContext ctx) { \
-         ctx.event()->set_name(eventName);                                       \
-      });                                                                    \
+        VPERFETTO_MIN_TRACE_EVENT_BEGIN(#name, eventName); \
     } \
     VPERFETTO_EXPORT void vperfetto_min_endTrackEvent_##name() { \
         TRACE_EVENT_END(#name); \
@@ -208,13 +348,7 @@ VPERFETTO_EXPORT void vperfetto_min_endTrackEvent() {
 VPERFETTO_LIST_CATEGORIES(DEFINE_CATEGORY_TRACK_EVENT_DEFINITION)
 
 VPERFETTO_EXPORT void vperfetto_min_traceCounter(const char* name, int64_t value) {
-    // TODO: Do stuff. This isn't supported in the SDK currently.
-    // What this really needs until its supported in the official sdk:
-    // a. a static global to track uuids and names for counters
-    // b. track objects generated dynamically
-    // c. setting the descriptor of these track objects
-    // if (CC_LIKELY(sTraceConfig.tracingDisabled)) return;
-    // TRACE_COUNTER("gfx", ::perfetto::StaticString{name}, value);
+    VPERFETTO_COUNTER_EVENT("gfx", getCounterTrack(name), value);
 }
 
 } // namespace vperfetto
@@ -26,6 +26,20 @@
     #endif // !_MSC_VER
 #endif // !VPERFETTO_EXPORT
 
+// For data, which unlike functions has to be imported explicitly on the consumer side on
+// MSVC. vperfetto-min.cpp is built with VPERFETTO_BUILDING defined.
+#ifndef VPERFETTO_MIN_DATA_EXPORT
+    #ifdef _MSC_VER
+        #ifdef VPERFETTO_BUILDING
+            #define VPERFETTO_MIN_DATA_EXPORT __declspec(dllexport)
+        #else // VPERFETTO_BUILDING
+            #define VPERFETTO_MIN_DATA_EXPORT __declspec(dllimport)
+        #endif // !VPERFETTO_BUILDING
+    #else // _MSC_VER
+        #define VPERFETTO_MIN_DATA_EXPORT __attribute__((visibility("default")))
+    #endif // !_MSC_VER
+#endif // !VPERFETTO_MIN_DATA_EXPORT
+
 // Categories that vperfetto_min is capable of tracking.
 #define VPERFETTO_LIST_CATEGORIES(f) \
     f(OpenGL, "OpenGL(ES) calls") \
@@ -49,6 +63,9 @@ struct vperfetto_min_config {
     enum vperfetto_init_flags init_flags;
     const char* filename;
     uint32_t shmem_size_hint_kb;
+    // In-process backend: when non-zero, the trace is written into |filename| about this often
+    // while tracing instead of all at once by vperfetto_min_endTracing().
+    uint32_t file_write_period_ms;
 };
 
 VPERFETTO_EXPORT void vperfetto_min_startTracing(const struct vperfetto_min_config* config);
@@ -58,13 +75,68 @@ VPERFETTO_EXPORT void vperfetto_min_startTracing(const struct vperfetto_min_conf
 // After waiting for a while, the guest/host traces are post processed and catted together into VPERFETTO_COMBINED_FILE.
 VPERFETTO_EXPORT void vperfetto_min_endTracing();
 
+// vperfetto_min_startTracing()/vperfetto_min_endTracing() for threads that can't wait on the tracing
+// service: they return right away. on_tracing_state_change is called with true once tracing has
+// started, and after vperfetto_min_endTracingAsync() with false once the trace has been saved.
+VPERFETTO_EXPORT void vperfetto_min_startTracingAsync(const struct vperfetto_min_config* config);
+VPERFETTO_EXPORT void vperfetto_min_endTracingAsync();
+
 // Start/end a particular track event on the host. By default, every such event is in the 'gfx' category.
+// Event names can be built at runtime; each distinct name is written to the trace once per thread.
 VPERFETTO_EXPORT void vperfetto_min_beginTrackEvent(const char* eventName);
 VPERFETTO_EXPORT void vperfetto_min_endTrackEvent();
 
+// Record a counter. Each distinct counter name gets its own track, described once; like event names,
+// names can be built at runtime.
+VPERFETTO_EXPORT void vperfetto_min_traceCounter(const char* name, int64_t value);
+
 // Start/end a particular track event in a particular category.
 #define DEFINE_CATEGORY_TRACK_EVENT_DECLARATION(name, desc) \
     VPERFETTO_EXPORT void vperfetto_min_beginTrackEvent_##name(const char* eventName); \
     VPERFETTO_EXPORT void vperfetto_min_endTrackEvent_##name(); \
 
 VPERFETTO_LIST_CATEGORIES(DEFINE_CATEGORY_TRACK_EVENT_DECLARATION)
+
+// Each category's index into vperfetto_min_category_state, in VPERFETTO_LIST_CATEGORIES order.
+#define DEFINE_CATEGORY_INDEX(name, desc) VPERFETTO_MIN_CATEGORY_##name,
+
+enum vperfetto_min_category {
+    VPERFETTO_LIST_CATEGORIES(DEFINE_CATEGORY_INDEX)
+};
+
+// Perfetto's own per-category state, one byte per category that is non-zero while any session
+// records it, whichever backend started the session. Points at std::atomic<uint8_t>s.
+#ifdef __cplusplus
+extern "C" VPERFETTO_MIN_DATA_EXPORT const volatile void* const vperfetto_min_category_state;
+#else
+extern VPERFETTO_MIN_DATA_EXPORT const volatile void* const vperfetto_min_category_state;
+#endif
+
+static inline int vperfetto_min_categoryEnabled(enum vperfetto_min_category category) {
+    return ((const volatile uint8_t*)vperfetto_min_category_state)[category] != 0;
+}
+
+// The calls above, made only if their category is being traced: with tracing off, each costs one
+// load and a predictable branch instead of a call into the library, and the arguments aren't
+// evaluated. VPERFETTO_MIN_BEGIN_TRACK_EVENT_IN(Vulkan, name) is vperfetto_min_beginTrackEvent_Vulkan().
+#define VPERFETTO_MIN_BEGIN_TRACK_EVENT(eventName) \
+    VPERFETTO_MIN_BEGIN_TRACK_EVENT_IN(gfx, eventName)
+#define VPERFETTO_MIN_END_TRACK_EVENT() \
+    VPERFETTO_MIN_END_TRACK_EVENT_IN(gfx)
+#define VPERFETTO_MIN_TRACE_COUNTER(name, value) \
+    do { \
+        if (vperfetto_min_categoryEnabled(VPERFETTO_MIN_CATEGORY_gfx)) vperfetto_min_traceCounter(name, value); \
+    } while (0)
+
+#define VPERFETTO_MIN_BEGIN_TRACK_EVENT_IN(category, eventName) \
+    do { \
+        if (vperfetto_min_categoryEnabled(VPERFETTO_MIN_CATEGORY_##category)) { \
+            vperfetto_min_beginTrackEvent_##category(eventName); \
+        } \
+    } while (0)
+#define VPERFETTO_MIN_END_TRACK_EVENT_IN(category) \
+    do { \
+        if (vperfetto_min_categoryEnabled(VPERFETTO_MIN_CATEGORY_##category)) { \
+            vperfetto_min_endTrackEvent_##category(); \
+        } \
+    } while (0)
@@ -0,0 +1,176 @@
+// Copyright 2020 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+// Hand-rolled encoders for the packets the non-SDK build writes on every
+// event: slice begin/end and counter TrackEvents on a thread's sequence. They
+// produce the same bytes a protozero::RootMessage<TracePacket> would, but each
+// packet is a copied header and a few varints. Every such packet fits in
+// kMaxEventPacketSize bytes, so the caller checks for space once, and both
+// length prefixes fit in one byte and are patched at the end.
+//
+// The sequence's TracePacketDefaults supply what the packets leave out: the
+// thread's track uuid, and an incremental clock, so timestamps are deltas
+// from the previous event on the sequence.
+//
+// Everything else (interned data, descriptors) still goes through protozero.
+
+namespace vperfetto {
+
+template <typename T>
+static inline uint8_t* writeVarInt(T value, uint8_t* target) {
+    // If value is <= 0 we must first sign extend to int64_t (see [1]).
+    // Finally we always cast to an unsigned value to to avoid arithmetic
+    // (sign expanding) shifts in the while loop.
+    // [1]: "If you use int32 or int64 as the type for a negative number, the
+    // resulting varint is always ten bytes long".
+    // - developers.google.com/protocol-buffers/docs/encoding
+    // So for each input type we do the following casts:
+    // uintX_t -> uintX_t -> uintX_t
+    // int8_t  -> int64_t -> uint64_t
+    // int16_t -> int64_t -> uint64_t
+    // int32_t -> int64_t -> uint64_t
+    // int64_t -> int64_t -> uint64_t
+    using MaybeExtendedType =
+        typename std::conditional<std::is_unsigned<T>::value, T, int64_t>::type;
+    using UnsignedType = typename std::make_unsigned<MaybeExtendedType>::type;
+
+    MaybeExtendedType extended_value = static_cast<MaybeExtendedType>(value);
+    UnsignedType unsigned_value = static_cast<UnsignedType>(extended_value);
+
+    while (unsigned_value >= 0x80) {
+        *target++ = static_cast<uint8_t>(unsigned_value) | 0x80;
+        unsigned_value >>= 7;
+    }
+    *target = static_cast<uint8_t>(unsigned_value);
+    return target + 1;
+}
+
+namespace packetwriter {
+
+constexpr uint8_t varIntTag(uint32_t field) { return (uint8_t)(field << 3); }
+constexpr uint8_t lengthDelimitedTag(uint32_t field) { return (uint8_t)((field << 3) | 2); }
+
+// Trace.packet, then TracePacket and TrackEvent fields.
+constexpr uint32_t kTracePacketField = 1;
+constexpr uint32_t kTimestampField = 8;
+constexpr uint32_t kTrustedPacketSequenceIdField = 10;
+constexpr uint32_t kTrackEventField = 11;
+constexpr uint32_t kSequenceFlagsField = 13;
+constexpr uint32_t kCategoryIidsField = 3;
+constexpr uint32_t kTypeField = 9;
+constexpr uint32_t kNameIidField = 10;
+constexpr uint32_t kTrackUuidField = 11;
+// counter_value = 30 needs a two-byte tag.
+constexpr uint8_t kCounterValueTag[] = { 0xf0, 0x01 };
+
+constexpr uint32_t kMaxVarIntSize = 10;
+
+// The bytes every event packet on one sequence starts with, once the packet
+// length is patched in: trusted_packet_sequence_id and
+// sequence_flags = SEQ_NEEDS_INCREMENTAL_STATE.
+struct EventPacketHeader {
+    uint8_t bytes[2 + 1 + 5 + 2] = {};
+    uint8_t size = 0;
+};
+
+static inline EventPacketHeader makeEventPacketHeader(uint32_t sequenceId) {
+    EventPacketHeader header;
+    uint8_t* p = header.bytes;
+    *p++ = lengthDelimitedTag(kTracePacketField);
+    *p++ = 0; // packet length
+    *p++ = varIntTag(kTrustedPacketSequenceIdField);
+    p = writeVarInt(sequenceId, p);
+    *p++ = varIntTag(kSequenceFlagsField);
+    *p++ = 2;
+    header.size = (uint8_t)(p - header.bytes);
+    return header;
+}
+
+// Header, timestamp, track event tag and length, then the largest of the
+// slice (category, name, type) and counter (uuid, type, value) bodies.
+constexpr size_t kMaxSliceBodySize = (1 + kMaxVarIntSize) * 3;
+constexpr size_t kMaxCounterBodySize = (1 + kMaxVarIntSize) * 2 + 2 + kMaxVarIntSize;
+constexpr size_t kMaxEventPacketSize =
+    sizeof(EventPacketHeader::bytes) + 1 + kMaxVarIntSize + 2 +
+    (kMaxSliceBodySize > kMaxCounterBodySize ? kMaxSliceBodySize : kMaxCounterBodySize);
+static_assert(kMaxEventPacketSize < 0x80, "event packet lengths must fit in a one-byte varint");
+
+// Writes the header and timestamp, leaving |*trackEvent| at the track event's
+// length byte.
+static inline uint8_t* beginEventPacket(uint8_t* p, const EventPacketHeader& header,
+                                        uint64_t timestamp, uint8_t** trackEvent) {
+    memcpy(p, header.bytes, sizeof(header.bytes));
+    p += header.size;
+    *p++ = varIntTag(kTimestampField);
+    p = writeVarInt(timestamp, p);
+    *p++ = lengthDelimitedTag(kTrackEventField);
+    *trackEvent = p++;
+    return p;
+}
+
+// Patches the lengths; |packet| is where the packet started.
+static inline uint8_t* endEventPacket(uint8_t* packet, uint8_t* trackEvent, uint8_t* p) {
+    trackEvent[0] = (uint8_t)(p - trackEvent - 1);
+    packet[1] = (uint8_t)(p - packet - 2);
+    return p;
+}
+
+} // namespace packetwriter
+
+// A TYPE_SLICE_BEGIN or TYPE_SLICE_END event on the sequence's default track.
+// |timestampDelta| is since the sequence's previous event. Writes at most
+// kMaxEventPacketSize bytes at |p| and returns the end.
+static inline uint8_t* writeSliceEventPacket(uint8_t* p, const packetwriter::EventPacketHeader& header,
+                                             uint64_t timestampDelta, uint32_t categoryIid,
+                                             uint32_t nameIid, uint32_t type) {
+    using namespace packetwriter;
+    uint8_t* packet = p;
+    uint8_t* trackEvent;
+    p = beginEventPacket(p, header, timestampDelta, &trackEvent);
+    *p++ = varIntTag(kCategoryIidsField);
+    p = writeVarInt(categoryIid, p);
+    *p++ = varIntTag(kNameIidField);
+    p = writeVarInt(nameIid, p);
+    *p++ = varIntTag(kTypeField);
+    p = writeVarInt(type, p);
+    return endEventPacket(packet, trackEvent, p);
+}
+
+// A TYPE_COUNTER event on counter track |trackUuid|. |timestampDelta| is
+// since the sequence's previous event. Writes at most kMaxEventPacketSize
+// bytes at |p| and returns the end.
+static inline uint8_t* writeCounterEventPacket(uint8_t* p, const packetwriter::EventPacketHeader& header,
+                                               uint64_t timestampDelta, uint64_t trackUuid,
+                                               uint32_t type, int64_t value) {
+    using namespace packetwriter;
+    uint8_t* packet = p;
+    uint8_t* trackEvent;
+    p = beginEventPacket(p, header, timestampDelta, &trackEvent);
+    *p++ = varIntTag(kTrackUuidField);
+    p = writeVarInt(trackUuid, p);
+    *p++ = varIntTag(kTypeField);
+    p = writeVarInt(type, p);
+    memcpy(p, kCounterValueTag, sizeof(kCounterValueTag));
+    p += sizeof(kCounterValueTag);
+    p = writeVarInt(value, p);
+    return endEventPacket(packet, trackEvent, p);
+}
+
+} // namespace vperfetto
@@ -1,24 +1,35 @@
 #include "perfetto.h"
 #include "vperfetto.h"
+#include "vperfetto-combiner.h"
+#include "vperfetto-guest-trace-waiter.h"
 #include "vperfetto-util.h"
-#include "proto/perfetto_trace.pb.h"
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
 #include <fstream>
 #include <unordered_map>
 
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 PERFETTO_DEFINE_CATEGORIES(
     ::perfetto::Category("gfx")
         .SetDescription("Events from the graphics subsystem"));
 PERFETTO_TRACK_EVENT_STATIC_STORAGE();
 
-#define TRACE_COUNTER(category, name, value)  \
-    PERFETTO_INTERNAL_TRACK_EVENT(                  \
-            category, name, \
-            ::perfetto::protos::pbzero::TrackEvent::TYPE_COUNTER, [&](::perfetto::EventContext ctx){ \
-            ctx.event()->set_counter_value(value); \
-            })
+#include "vperfetto-counters.h"
 
 #ifdef __cplusplus
 #   define CC_LIKELY( exp )    (__builtin_expect( !!(exp), true ))
@@ -49,6 +60,8 @@ static VirtualDeviceTraceConfig sTraceConfig = {
     .addTraces = false
 };
 
+VPERFETTO_DATA_EXPORT std::atomic<bool> gTracingEnabled(false);
+
 struct TraceCpuTimeSync {
     bool hasData() const { return cpuTime != 0 && clockTime != 0 && clockId != 0; }
 
@@ -60,12 +73,118 @@ struct TraceCpuTimeSync {
 
 struct TraceProgress {
     std::vector<char> hostTrace;
-    std::vector<char> guestTrace;
-    std::vector<char> combinedTrace;
+    // Flight recorder mode: what snapshotTrace() read out of the session, and
+    // so took out of its buffer, one read each, oldest first. Only the newest
+    // reads within flightRecorderKb are kept (see retainHostTraceRead()).
+    std::deque<std::vector<char>> hostTraceReads;
+    size_t hostTraceReadsSize = 0;
+    // hostFileWritePeriodMs: the service wrote the host trace into
+    // hostFilename itself, and |hostTrace| stays empty.
+    bool hostTraceStreamed = false;
+
+    // The guest trace, when it comes through pushGuestTraceChunk() rather
+    // than a file.
+    std::mutex guestTraceLock;
+    StreamedTrace guestTrace;
+    bool guestTraceFinished = false;
+
+    // onlineCombine: the combined trace, which streamed guest packets go
+    // into as they arrive.
+    std::unique_ptr<std::ofstream> onlineCombinedFile;
+    std::unique_ptr<OnlineTraceCombiner> onlineCombiner;
 };
 
 static TraceProgress sTraceProgress;
 
+// Tells the save thread when the guest trace is there to combine.
+static GuestTraceWaiter sGuestTraceWaiter;
+
+// Flight recorder mode: once the ring buffer wraps, the packets that cleared
+// a thread's incremental state and interned its event names and tracks are
+// gone, and the rest of the thread's events don't resolve without them. The
+// service is asked to have them cleared every kFlightRecorderClearPeriodMs,
+// but this SDK's producer ignores that (ProducerImpl::ClearIncrementalState()
+// is a TODO). So each thread clears its own when the generation moves on:
+// about that often, and after each snapshot reads the buffer out.
+static const uint32_t kFlightRecorderClearPeriodMs = 1000;
+
+static std::atomic<uint32_t> sIncrementalStateGeneration(0);
+
+struct IncrementalStateClearer {
+    std::thread thread;
+    std::mutex lock;
+    std::condition_variable wakeup;
+    bool stop = false;
+};
+
+static IncrementalStateClearer sIncrementalStateClearer;
+
+static void startIncrementalStateClearer() {
+    sIncrementalStateClearer.stop = false;
+    sIncrementalStateClearer.thread = std::thread([]() {
+        std::unique_lock<std::mutex> lock(sIncrementalStateClearer.lock);
+        while (!sIncrementalStateClearer.wakeup.wait_for(
+                lock, std::chrono::milliseconds(kFlightRecorderClearPeriodMs),
+                [] { return sIncrementalStateClearer.stop; })) {
+            sIncrementalStateGeneration.fetch_add(1, std::memory_order_relaxed);
+        }
+    });
+}
+
+static void stopIncrementalStateClearer() {
+    if (!sIncrementalStateClearer.thread.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(sIncrementalStateClearer.lock);
+        sIncrementalStateClearer.stop = true;
+    }
+    sIncrementalStateClearer.wakeup.notify_one();
+    sIncrementalStateClearer.thread.join();
+}
+
+// Called before each event: starts the thread's sequence over, as the
+// service's clear would, if the generation moved on since its last event.
+static inline void clearIncrementalStateIfStale() {
+    thread_local uint32_t tGeneration = 0;
+    uint32_t generation = sIncrementalStateGeneration.load(std::memory_order_relaxed);
+    if (CC_LIKELY(generation == tGeneration)) return;
+    tGeneration = generation;
+    ::perfetto::TrackEvent::Trace([](auto ctx) {
+        auto* state = ctx.GetIncrementalState();
+        state->was_cleared = true;
+        for (auto& index : state->interned_data_indices) index = {};
+        state->seen_tracks.clear();
+    });
+}
+
+// Flight recorder mode: reading the session takes the data out of its buffer,
+// so what was read is kept here for the next snapshot and the saved host
+// trace to show again, the way the non-SDK build's snapshots leave its buffer
+// alone. Adds |hostTrace| as the newest read, drops the oldest reads that no
+// longer fit in flightRecorderKb, and returns what is left as one trace.
+// Each read starts with fresh incremental state (see snapshotTrace()), so
+// dropping whole reads leaves the rest decodable.
+static std::vector<char> retainHostTraceRead(std::vector<char> hostTrace) {
+    size_t budget = (size_t)sTraceConfig.flightRecorderKb * 1024;
+    sTraceProgress.hostTraceReadsSize += hostTrace.size();
+    sTraceProgress.hostTraceReads.push_back(std::move(hostTrace));
+    while (sTraceProgress.hostTraceReads.size() > 1 && sTraceProgress.hostTraceReadsSize > budget) {
+        sTraceProgress.hostTraceReadsSize -= sTraceProgress.hostTraceReads.front().size();
+        sTraceProgress.hostTraceReads.pop_front();
+    }
+
+    std::vector<char> retained;
+    retained.reserve(sTraceProgress.hostTraceReadsSize);
+    for (const auto& read : sTraceProgress.hostTraceReads) {
+        retained.insert(retained.end(), read.begin(), read.end());
+    }
+    return retained;
+}
+
+static void clearHostTraceReads() {
+    std::deque<std::vector<char>>().swap(sTraceProgress.hostTraceReads);
+    sTraceProgress.hostTraceReadsSize = 0;
+}
+
 VPERFETTO_EXPORT void setTraceConfig(std::function<void(VirtualDeviceTraceConfig&)> f) {
     f(sTraceConfig);
 }
@@ -95,11 +214,48 @@ VPERFETTO_EXPORT void initialize(const bool** tracingDisabledPtr) {
 
 static std::unique_ptr<::perfetto::TracingSession> sTracingSession;
 
+// Opens |filename| for the tracing service to write the host trace into.
+static int openHostTraceFile(const char* filename) {
+#ifdef _WIN32
+    return _open(filename, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    return open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+#endif
+}
+
+static void closeHostTraceFile(int fd) {
+#ifdef _WIN32
+    _close(fd);
+#else
+    close(fd);
+#endif
+}
+
+// Writes the host trace read out of the session to hostFilename, unless the
+// service has streamed it there.
+static void saveHostTrace() {
+    if (!sTraceProgress.hostTraceStreamed) {
+        std::ofstream hostFile(sTraceConfig.hostFilename, std::ios::out | std::ios::binary);
+        hostFile.write(sTraceProgress.hostTrace.data(), sTraceProgress.hostTrace.size());
+    }
+    sTraceProgress.hostTrace.clear();
+}
+
+// The host trace to combine: the one read out of the session, or the streamed
+// one mapped through |*mapped|.
+static ::protozero::ConstBytes getHostTraceBytes(std::unique_ptr<MappedTraceFile>* mapped) {
+    if (!sTraceProgress.hostTraceStreamed) return traceBytes(sTraceProgress.hostTrace);
+    mapped->reset(new MappedTraceFile(sTraceConfig.hostFilename));
+    return (*mapped)->bytes();
+}
+
 bool useFilenameByEnv(const char* s) {
     return s && ("" != std::string(s));
 }
 
-VPERFETTO_EXPORT void enableTracing() {
+// Sets up the session and starts it. Unless |blocking|, returns before it has
+// started, and |onStarted| is called on a tracing service thread once it has.
+static void startTracing(bool blocking, std::function<void()> onStarted) {
     const char* hostFilenameByEnv = std::getenv("VPERFETTO_HOST_FILE");
     const char* guestFilenameByEnv = std::getenv("VPERFETTO_GUEST_FILE");
     const char* combinedFilenameByEnv = std::getenv("VPERFETTO_COMBINED_FILE");
@@ -146,7 +302,17 @@ VPERFETTO_EXPORT void enableTracing() {
 
         ::perfetto::TraceConfig cfg;
         ::perfetto::protos::gen::TrackEventConfig track_event_cfg;
-        cfg.add_buffers()->set_size_kb(1024 * 100);  // Record up to 100 MiB.
+        auto* buffer_cfg = cfg.add_buffers();
+        if (sTraceConfig.flightRecorderKb) {
+            // Keep the most recent data around for snapshotTrace().
+            fprintf(stderr, "%s: flight recorder mode, keeping the last %u KiB of host trace\n", __func__,
+                    sTraceConfig.flightRecorderKb);
+            buffer_cfg->set_size_kb(sTraceConfig.flightRecorderKb);
+            buffer_cfg->set_fill_policy(::perfetto::TraceConfig::BufferConfig::RING_BUFFER);
+            cfg.mutable_incremental_state_config()->set_clear_period_ms(kFlightRecorderClearPeriodMs);
+        } else {
+            buffer_cfg->set_size_kb(1024 * 100);  // Record up to 100 MiB.
+        }
         auto* ds_cfg = cfg.add_data_sources()->mutable_config();
         ds_cfg->set_name("track_event");
         ds_cfg->set_track_event_config_raw(track_event_cfg.SerializeAsString());
@@ -156,692 +322,343 @@ VPERFETTO_EXPORT void enableTracing() {
         auto* builtin_ds_cfg = cfg.mutable_builtin_data_sources();
         builtin_ds_cfg->set_disable_service_events(true);
 
-        sTracingSession = ::perfetto::Tracing::NewTrace();
-        sTracingSession->Setup(cfg);
-        sTracingSession->StartBlocking();
-        sTraceConfig.tracingDisabled = false;
-    }
-}
-
-static void mutateTracePackets(::perfetto::protos::Trace& pbtrace,
-    std::function<void(::perfetto::protos::TracePacket* packet)> mutator) {
-    for (int i = 0; i < pbtrace.packet_size(); ++i) {
-        auto* packet = pbtrace.mutable_packet(i);
-        mutator(packet);
-    }
-}
-
-static void iterateTraceTimestamps(
-    ::perfetto::protos::Trace& pbtrace,
-    std::function<uint64_t(uint64_t)> forEachTimestamp,
-    std::function<uint64_t(uint64_t)> forEachRealtimeTimestamp) {
-
-    for (int i = 0; i < pbtrace.packet_size(); ++i) {
-        auto* packet = pbtrace.mutable_packet(i);
-        if (packet->has_timestamp()) {
-            packet->set_timestamp(forEachTimestamp(packet->timestamp()));
-        }
-
-        if (packet->has_ftrace_events()) {
-            auto* ftevts = packet->mutable_ftrace_events();
-            for (int j = 0; j < ftevts->event_size(); ++j) {
-                auto* ftev = ftevts->mutable_event(j);
-                if (ftev->has_timestamp()) {
-                    ftev->set_timestamp(forEachTimestamp(ftev->timestamp()));
-                }
+        sGuestTraceWaiter.reset();
+        {
+            std::lock_guard<std::mutex> lock(sTraceProgress.guestTraceLock);
+            sTraceProgress.guestTrace.clear();
+            sTraceProgress.guestTraceFinished = false;
+            if (sTraceConfig.onlineCombine && sTraceConfig.combinedFilename) {
+                // Guest timestamps go back by the diff that would move host ones forward.
+                sTraceProgress.onlineCombinedFile.reset(new std::ofstream(
+                    sTraceConfig.combinedFilename, std::ios::out | std::ios::binary));
+                sTraceProgress.onlineCombiner.reset(new OnlineTraceCombiner(
+                    -sTraceConfig.guestTimeDiff, *sTraceProgress.onlineCombinedFile));
             }
         }
-
-        if (packet->has_android_log()) {
-            auto* pt = packet->mutable_android_log();
-            for (int j = 0; j < pt->events_size(); ++j) {
-                auto* ev = pt->mutable_events(j);
-                if (ev->has_timestamp()) {
-                    ev->set_timestamp(forEachRealtimeTimestamp(ev->timestamp()));
-                }
+        // Setup() takes a copy of the fd.
+        int hostFd = -1;
+        if (sTraceConfig.hostFileWritePeriodMs && !sTraceConfig.flightRecorderKb) {
+            hostFd = openHostTraceFile(sTraceConfig.hostFilename);
+            if (hostFd < 0) {
+                fprintf(stderr, "%s: warning: could not open %s, keeping host trace in memory\n", __func__,
+                        sTraceConfig.hostFilename);
+            } else {
+                fprintf(stderr, "%s: writing host trace every %u ms\n", __func__, sTraceConfig.hostFileWritePeriodMs);
+                cfg.set_file_write_period_ms(sTraceConfig.hostFileWritePeriodMs);
             }
         }
-    }
-}
-
-static void iterateTraceTrackDescriptorUuids(
-    ::perfetto::protos::Trace& pbtrace,
-    std::function<uint64_t(uint64_t)> forEachUuid) {
-
-    for (int i = 0; i < pbtrace.packet_size(); ++i) {
-        auto* packet = pbtrace.mutable_packet(i);
-
-        // trace packet defaults
-        if (packet->has_trace_packet_defaults()) {
-            auto* tpd = packet->mutable_trace_packet_defaults();
-            if (tpd->has_track_event_defaults()) {
-                auto* ted = tpd->mutable_track_event_defaults();
-                if (ted->has_track_uuid()) {
-                    ted->set_track_uuid(forEachUuid(ted->track_uuid()));
-                }
-            }
-        }
-
-        // individual track events
-        if (packet->has_track_event()) {
-            auto* te = packet->mutable_track_event();
-            if (te->has_track_uuid()) {
-                te->set_track_uuid(forEachUuid(te->track_uuid()));
-            }
-        }
-
-        // track descriptors
-        if (packet->has_track_descriptor()) {
-            auto* trd = packet->mutable_track_descriptor();
-            if (trd->has_uuid()) {
-                trd->set_uuid(forEachUuid(trd->uuid()));
-            }
-            if (trd->has_parent_uuid()) {
-                trd->set_parent_uuid(forEachUuid(trd->parent_uuid()));
-            }
+        sTraceProgress.hostTraceStreamed = hostFd >= 0;
+        clearHostTraceReads();
+        if (sTraceConfig.flightRecorderKb) startIncrementalStateClearer();
+        sTracingSession = ::perfetto::Tracing::NewTrace();
+        sTracingSession->Setup(cfg, hostFd);
+        if (hostFd >= 0) closeHostTraceFile(hostFd);
+        if (blocking) {
+            sTracingSession->StartBlocking();
+        } else {
+            if (onStarted) sTracingSession->SetOnStartCallback(std::move(onStarted));
+            sTracingSession->Start();
         }
+        sTraceConfig.tracingDisabled = false;
+        gTracingEnabled.store(true, std::memory_order_relaxed);
     }
 }
 
-// Replace PID in "X|PID..."
-std::string replace_pid(std::string buf,
-                        std::function<int32_t(int32_t)> forEachPid) {
-    // parse "X|PID..."
-    size_t p1 = buf.find_first_of("|");
-    if (p1 == std::string::npos)
-        return buf;
-    ++p1;
-    size_t p2 = buf.find_first_not_of("0123456789", p1);
-    std::string buf2 = buf;
-    if (p2 != std::string::npos)
-        buf2[p2] = '\0';
-    int32_t old_pid = atoi(buf2.c_str() + p1);
-    int32_t new_pid = forEachPid(old_pid);
-    // gen new string
-    buf2 = buf.substr(0, p1);
-    buf2 += std::to_string(new_pid);
-    if (p2 != std::string::npos)
-        buf2 += buf.substr(p2);
-    return buf2;
+VPERFETTO_EXPORT void enableTracing() {
+    startTracing(true /* blocking */, nullptr);
 }
 
-// A higher-order function to conveniently iterate over all sequence ids and pids.
-// TODO: What other Ids are important?
-// This also takes care of changing UUIDs if a process or thread descriptor gets its id modified.
-static void iterateTraceIds(
-    ::perfetto::protos::Trace& pbtrace,
-    std::function<uint32_t(uint32_t)> forEachTrustedUid,
-    std::function<uint32_t(uint32_t)> forEachSequenceId,
-    std::function<int32_t(int32_t)> forEachPid,
-    std::function<int32_t(int32_t)> forEachTid,
-    std::function<int32_t(int32_t)> forEachCpu) {
-
-    bool needRemapUuids = false;
-    std::unordered_map<uint64_t, uint64_t> uuidMap;
-
-    std::function<int32_t(int32_t, uint64_t)> transformPidWithUuidRemapTracking =
-        [&needRemapUuids, &uuidMap, forEachPid](int32_t prev, uint64_t prevUuid) {
-        int32_t next = forEachPid(prev);
-        if (prev == next) return next;
-        if (uuidMap.find(prevUuid) != uuidMap.end()) return next;
-        uuidMap[prevUuid] = ::perfetto::base::GenUuidv4Lsb();
-        needRemapUuids = true;
-        return next;
-    };
-
-    for (int i = 0; i < pbtrace.packet_size(); ++i) {
-        auto* packet = pbtrace.mutable_packet(i);
-
-        if (packet->has_trusted_uid()) {
-            packet->set_trusted_uid(
-                forEachTrustedUid(packet->trusted_uid()));
-        }
+VPERFETTO_EXPORT void enableTracingAsync(std::function<void()> onStarted) {
+    startTracing(false /* blocking */, std::move(onStarted));
+}
 
-        if (packet->has_trusted_packet_sequence_id()) {
-            packet->set_trusted_packet_sequence_id(
-                forEachSequenceId(packet->trusted_packet_sequence_id()));
-        }
+// onlineCombine: the guest packets that arrived are in the combined trace
+// already, so once the guest trace is finished only the host trace is left.
+static void finishOnlineCombinedTrace() {
+    fprintf(stderr, "%s: Waiting for the rest of the streamed guest trace...\n", __func__);
+    std::string unused;
+    if (!sGuestTraceWaiter.wait(nullptr, sTraceConfig.guestTraceTimeoutMs, &unused)) {
+        fprintf(stderr, "%s: warning: timed out, combined trace has the guest trace up to now\n", __func__);
+    }
 
-        if (packet->has_ftrace_events()) {
-            auto* ftevts = packet->mutable_ftrace_events();
+    // Take the combiner, so pushes from now on are dropped rather than wait
+    // for the host trace to be appended.
+    std::unique_ptr<OnlineTraceCombiner> onlineCombiner;
+    std::unique_ptr<std::ofstream> onlineCombinedFile;
+    {
+        std::lock_guard<std::mutex> lock(sTraceProgress.guestTraceLock);
+        onlineCombiner = std::move(sTraceProgress.onlineCombiner);
+        onlineCombinedFile = std::move(sTraceProgress.onlineCombinedFile);
+        sTraceProgress.guestTraceFinished = true;
+    }
 
-            if (ftevts->has_cpu()) {
-                ftevts->set_cpu(
-                    forEachCpu(ftevts->cpu()));
-            }
+    fprintf(stderr, "%s: guest trace streamed in: %zu bytes\n", __func__, onlineCombiner->addonSize());
+    std::unique_ptr<MappedTraceFile> streamedHostFile;
+    if (!onlineCombiner->finish(getHostTraceBytes(&streamedHostFile))) {
+        fprintf(stderr, "%s: warning: combined trace (%s) may be incomplete\n", __func__, sTraceConfig.combinedFilename);
+    }
+    onlineCombiner.reset();
+    onlineCombinedFile.reset();
 
-            for (int j = 0; j < ftevts->event_size(); ++j) {
-                auto* ftev = ftevts->mutable_event(j);
-
-                if (ftev->has_pid()) {
-                    ftev->set_pid(
-                        forEachPid(ftev->pid()));
-                }
-
-                if (ftev->has_print()) {
-                    auto* print = ftev->mutable_print();
-                    if (print->has_buf()) {
-                        print->set_buf(replace_pid(print->buf(), forEachPid));
-                    }
-                }
-
-                if (ftev->has_task_rename()) {
-                    auto* tr = ftev->mutable_task_rename();
-                    if (tr->has_pid()) {
-                        tr->set_pid(forEachPid(tr->pid()));
-                    }
-                }
-
-                if (ftev->has_sched_switch()) {
-                    auto* sw = ftev->mutable_sched_switch();
-                    if (sw->has_prev_pid() && (sw->prev_pid() != 0)) {
-                        sw->set_prev_pid(forEachPid(sw->prev_pid()));
-                    }
-                    if (sw->has_next_pid() && (sw->next_pid() != 0)) {
-                        sw->set_next_pid(forEachPid(sw->next_pid()));
-                    }
-                }
-
-                if (ftev->has_sched_wakeup()) {
-                    auto* wakeup = ftev->mutable_sched_wakeup();
-                    if (wakeup->has_pid() && (wakeup->pid() != 0)) {
-                        wakeup->set_pid(forEachPid(wakeup->pid()));
-                    }
-                    if (wakeup->has_target_cpu()) {
-                        wakeup->set_target_cpu(
-                            forEachPid(wakeup->target_cpu()));
-                    }
-                }
-
-                if (ftev->has_sched_blocked_reason()) {
-                    auto* blockedreason = ftev->mutable_sched_blocked_reason();
-                    if (blockedreason->has_pid() && (blockedreason->pid() != 0)) {
-                        blockedreason->set_pid(forEachPid(blockedreason->pid()));
-                    }
-                }
-
-                if (ftev->has_sched_waking()) {
-                    auto* waking = ftev->mutable_sched_waking();
-                    if (waking->has_pid() && (waking->pid() != 0)) {
-                        waking->set_pid(forEachPid(waking->pid()));
-                    }
-                    if (waking->has_target_cpu()) {
-                        waking->set_target_cpu(
-                            forEachPid(waking->target_cpu()));
-                    }
-                }
-
-                if (ftev->has_sched_wakeup_new()) {
-                    auto* evt = ftev->mutable_sched_wakeup_new();
-                    if (evt->has_pid() && (evt->pid() != 0)) {
-                        evt->set_pid(forEachPid(evt->pid()));
-                    }
-                    if (evt->has_target_cpu()) {
-                        evt->set_target_cpu(
-                            forEachPid(evt->target_cpu()));
-                    }
-                }
-
-                if (ftev->has_sched_process_exec()) {
-                    auto* evt = ftev->mutable_sched_process_exec();
-                    if (evt->has_pid() && (evt->pid() != 0)) {
-                        evt->set_pid(forEachPid(evt->pid()));
-                    }
-                    if (evt->has_old_pid() && (evt->old_pid() != 0)) {
-                        evt->set_old_pid(forEachPid(evt->old_pid()));
-                    }
-                }
-
-                if (ftev->has_sched_process_exit()) {
-                    auto* evt = ftev->mutable_sched_process_exit();
-                    if (evt->has_pid() && (evt->pid() != 0)) {
-                        evt->set_pid(forEachPid(evt->pid()));
-                    }
-                    if (evt->has_tgid() && (evt->tgid() != 0)) {
-                        evt->set_tgid(forEachPid(evt->tgid()));
-                    }
-                }
-
-                if (ftev->has_sched_process_fork()) {
-                    auto* evt = ftev->mutable_sched_process_fork();
-                    if (evt->has_parent_pid() && (evt->parent_pid() != 0)) {
-                        evt->set_parent_pid(forEachPid(evt->parent_pid()));
-                    }
-                    if (evt->has_child_pid() && (evt->child_pid() != 0)) {
-                        evt->set_child_pid(forEachPid(evt->child_pid()));
-                    }
-                }
-
-                if (ftev->has_sched_process_free()) {
-                    auto* evt = ftev->mutable_sched_process_free();
-                    if (evt->has_pid() && (evt->pid() != 0)) {
-                        evt->set_pid(forEachPid(evt->pid()));
-                    }
-                }
-
-                if (ftev->has_sched_process_hang()) {
-                    auto* evt = ftev->mutable_sched_process_hang();
-                    if (evt->has_pid() && (evt->pid() != 0)) {
-                        evt->set_pid(forEachPid(evt->pid()));
-                    }
-                }
-
-                if (ftev->has_sched_process_wait()) {
-                    auto* evt = ftev->mutable_sched_process_wait();
-                    if (evt->has_pid() && (evt->pid() != 0)) {
-                        evt->set_pid(forEachPid(evt->pid()));
-                    }
-                }
-            }
-        }
+    saveHostTrace();
 
-        if (packet->has_track_descriptor()) {
-            auto* trd = packet->mutable_track_descriptor();
+    fprintf(stderr, "%s: Wrote host trace (%s)\n", __func__, sTraceConfig.hostFilename);
+    fprintf(stderr, "%s: Wrote combined trace (%s)\n", __func__, sTraceConfig.combinedFilename);
+    sTraceConfig.saving = false;
+}
 
-            if (trd->has_process()) {
-                auto* p = trd->mutable_process();
-                if (p->has_pid()) {
-                    int32_t prevPid = p->pid();
-                    p->set_pid(
-                        transformPidWithUuidRemapTracking(p->pid(), trd->uuid()));
-                }
-            }
+void asyncTraceSaveFunc() {
+    if (sTraceProgress.onlineCombiner) {
+        finishOnlineCombinedTrace();
+        return;
+    }
 
-            if (trd->has_thread()) {
-                auto* t = trd->mutable_thread();
-                if (t->has_pid()) {
-                    t->set_pid(
-                        transformPidWithUuidRemapTracking(t->pid(), trd->uuid()));
-                }
-                if (t->has_tid()) {
-                    t->set_tid(forEachTid(t->tid()));
-                }
-            }
-        }
+    fprintf(stderr, "%s: Saving combined trace async...\n", __func__);
 
-        if (packet->has_process_tree()) {
-            auto* pt = packet->mutable_process_tree();
-            for (int j = 0; j < pt->processes_size(); ++j) {
-                auto* p = pt->mutable_processes(j);
-                if (p->has_pid()) {
-                    p->set_pid(forEachPid(p->pid()));
-                }
-                if (p->has_ppid()) {
-                    p->set_ppid(forEachPid(p->ppid()));
-                }
-            }
+    const char* hostFilename = sTraceConfig.hostFilename;
+    const char* combinedFilename = sTraceConfig.combinedFilename;
 
-            for (int j = 0; j < pt->threads_size(); ++j) {
-                auto* t = pt->mutable_threads(j);
-                if (t->has_tid()) {
-                    t->set_tid(forEachTid(t->tid()));
-                }
-                if (t->has_tgid()) {
-                    t->set_tgid(forEachPid(t->tgid()));
-                }
-            }
-        }
+    fprintf(stderr, "%s: Waiting for guest trace (%s)...\n", __func__,
+            sTraceConfig.guestFilename ? sTraceConfig.guestFilename : "streamed");
+    std::string guestPath;
+    if (!sGuestTraceWaiter.wait(sTraceConfig.guestFilename, sTraceConfig.guestTraceTimeoutMs, &guestPath)) {
+        fprintf(stderr, "%s: Timed out when waiting for guest trace, skipping combined trace saving.\n", __func__);
+        saveHostTrace();
+        sTraceConfig.saving = false;
+        return;
+    }
 
-        if (packet->has_android_log()) {
-            auto* al = packet->mutable_android_log();
-            for (int j = 0; j < al->events_size(); ++j) {
-                auto* ev = al->mutable_events(j);
-                if (ev->has_pid()) {
-                    ev->set_pid(forEachPid(ev->pid()));
-                }
-                if (ev->has_tid()) {
-                    ev->set_tid(forEachTid(ev->tid()));
-                }
-            }
-        }
+    // Take the streamed guest trace, if that is how it came, and leave the
+    // lock to pushGuestTraceChunk() and finishGuestTrace() while combining.
+    // Pushes from now on are dropped (see finishGuestTrace()).
+    StreamedTrace streamedGuestTrace;
+    bool guestTraceStreamed;
+    {
+        std::lock_guard<std::mutex> lock(sTraceProgress.guestTraceLock);
+        guestTraceStreamed = sTraceProgress.guestTraceFinished;
+        std::swap(streamedGuestTrace, sTraceProgress.guestTrace);
+        sTraceProgress.guestTraceFinished = true;
     }
 
-    if (needRemapUuids) {
-        fprintf(stderr, "%s: need to remap uuids...\n", __func__);
-        iterateTraceTrackDescriptorUuids(
-            pbtrace,
-            [&uuidMap](uint64_t uuid) {
-            if (uuidMap.find(uuid) == uuidMap.end()) {
-                fprintf(stderr, "%s: Warning: did not catch uuid %llu from previous trace. Was this a parent_uuid? If so, note that the trace was generated like this in the first place (with missing parent_uuid for a track descriptor)\n", __func__, (unsigned long long)uuid);
+    {
+        std::ofstream combinedFile(combinedFilename, std::ios::out | std::ios::binary);
+        std::unique_ptr<MappedTraceFile> streamedHostFile;
+        ScannedTrace hostTrace(getHostTraceBytes(&streamedHostFile));
+        bool ok;
+        if (guestTraceStreamed) {
+            // Scanned as it came in; only the host trace is left to go over.
+            fprintf(stderr, "%s: combining with the streamed guest trace (%zu bytes)\n", __func__,
+                    streamedGuestTrace.size());
+            ScannedTrace guestTrace = streamedGuestTrace.trace();
+            ok = writeCombinedTrace(guestTrace, hostTrace,
+                                    sTraceConfig.guestTimeDiff, sTraceConfig.addTraces, false, 1, combinedFile);
+        } else {
+            MappedTraceFile guestFile(guestPath.c_str());
+            if (!guestFile.valid()) {
+                fprintf(stderr, "%s: warning: could not read guest trace (%s), combined trace has host only\n", __func__, guestPath.c_str());
             }
-            return uuidMap[uuid];
-        });
+            ScannedTrace guestTrace(guestFile.bytes());
+            ok = writeCombinedTrace(guestTrace, hostTrace,
+                                    sTraceConfig.guestTimeDiff, sTraceConfig.addTraces, false, 1, combinedFile);
+        }
+        if (!ok) {
+            fprintf(stderr, "%s: warning: combined trace (%s) may be incomplete\n", __func__, combinedFilename);
+        }
     }
-}
 
-static void sCalcMaxIds(
-    ::perfetto::protos::Trace& pbtrace,
-    uint32_t* maxTrustedUidOut,
-    uint32_t* maxSequenceIdOut,
-    uint32_t* maxPidOut,
-    uint32_t* maxTidOut,
-    uint32_t* maxCpuOut) {
-
-    uint32_t maxSequenceId = 0;
-    uint32_t maxPid = 0;
-    uint32_t maxTrustedUid = 0;
-    uint32_t maxTid = 0;
-    uint32_t maxCpu = 0;
-
-    *maxSequenceIdOut = maxSequenceId;
-    *maxPidOut = maxPid;
-    *maxTrustedUidOut = maxTrustedUid;
-    *maxTidOut = maxTid;
-    *maxCpuOut = maxCpu;;
-
-    iterateTraceIds(pbtrace,
-        [&maxTrustedUid](uint32_t uid) {
-            if (uid > maxTrustedUid) {
-                maxTrustedUid = uid;
-            }
-            return uid;
-        },
-        [&maxSequenceId](uint32_t seqid) {
-            if (seqid > maxSequenceId) {
-                maxSequenceId = seqid;
-            }
-            return seqid;
-        },
-        [&maxPid](uint32_t pid) {
-            if (pid > maxPid) {
-                maxPid = pid;
-            }
-            return pid;
-        },
-        [&maxTid](uint32_t tid) {
-            if (tid > maxTid) {
-                maxTid = tid;
-            }
-            return tid;
-        },
-        [&maxCpu](uint32_t cpu) {
-            if (cpu > maxCpu) {
-                maxCpu = cpu;
-            }
-            return cpu;
-        });
+    saveHostTrace();
 
-    fprintf(stderr, "%s: trace's max trusted uid %u seq %u pid %u\n", __func__, maxTrustedUid, maxSequenceId, maxPid);
+    fprintf(stderr, "%s: Wrote host trace (%s)\n", __func__, hostFilename);
+    fprintf(stderr, "%s: Wrote combined trace (%s)\n", __func__, combinedFilename);
 
-    *maxTrustedUidOut = maxTrustedUid;
-    *maxSequenceIdOut = maxSequenceId;
-    *maxPidOut = maxPid;
-    *maxTidOut = maxTid;
-    *maxCpuOut = maxCpu;;
+    sTraceConfig.saving = false;
 }
 
-static void getClockSnapshotTimes(const ::perfetto::protos::Trace& pbtrace, uint64_t* realtime, uint64_t* boottime) {
-    using ::perfetto::protos::pbzero::BuiltinClock;
-    for (int i = 0; i < pbtrace.packet_size(); ++i) {
-        const auto& packet = pbtrace.packet(i);
-        if (packet.has_clock_snapshot()) {
-            auto snapshot = packet.clock_snapshot();
-            for (int c = 0; c < snapshot.clocks_size(); ++c) {
-                if (snapshot.clocks(c).clock_id() == BuiltinClock::BUILTIN_CLOCK_BOOTTIME)
-                    *boottime = snapshot.clocks(c).timestamp();
-                if (snapshot.clocks(c).clock_id() == BuiltinClock::BUILTIN_CLOCK_REALTIME)
-                    *realtime = snapshot.clocks(c).timestamp();
-            }
-            if (*realtime != 0 && *boottime != 0) {
-                return;
-            }
+// Reads the host trace out of the stopped session and saves it, along with the
+// combined trace if there is one to write. Combining waits for the guest
+// trace, so it gets a thread of its own unless |combineHere|.
+static void saveStoppedSession(bool combineHere) {
+    // A streamed host trace is complete on disk once the session stops.
+    if (!sTraceProgress.hostTraceStreamed) {
+        sTraceProgress.hostTrace = sTracingSession->ReadTraceBlocking();
+        if (sTraceConfig.flightRecorderKb) {
+            sTraceProgress.hostTrace = retainHostTraceRead(std::move(sTraceProgress.hostTrace));
+            clearHostTraceReads();
         }
     }
-}
-
-// Transforms addonTrace timestamps into mainTrace space and merges with mainTrace.
-static std::vector<char> constructCombinedTrace(
-    const std::vector<char>& mainTrace,
-    const std::vector<char>& addonTrace,
-    int64_t mainTimeDiff, bool addTraces) {
 
-    ::perfetto::protos::Trace main_pbtrace;
-    {
-        std::string traceStr(mainTrace.begin(), mainTrace.end());
-        if (!main_pbtrace.ParseFromString(traceStr)) {
-            fprintf(stderr, "%s: Failed to parse protobuf as a string\n", __func__);
-            return {};
-        }
+    fprintf(stderr, "%s: Tracing ended================================================================================\n", __func__);
+    fprintf(stderr, "%s: Saving trace to disk. Configuration:\n", __func__);
+    fprintf(stderr, "%s: host filename: %s\n", __func__, sTraceConfig.hostFilename);
+    fprintf(stderr, "%s: guest filename: %s\n", __func__, sTraceConfig.guestFilename);
+    fprintf(stderr, "%s: combined filename: %s\n", __func__, sTraceConfig.combinedFilename);
+
+    sTracingSession.reset();
+
+    // Without a guest file name, the guest trace is to be streamed in.
+    if (!sTraceConfig.combinedFilename) {
+        fprintf(stderr, "%s: skipping guest combined trace, "
+                        "combined file name not specified\n", __func__);
+        fprintf(stderr, "%s: saving only host trace\n", __func__);
+        saveHostTrace();
+        fprintf(stderr, "%s: saving only host trace (done)\n", __func__);
+        sTraceConfig.saving = false;
+        return;
     }
 
-    // Calculate the max seqid/pid/tid in the main
-    uint32_t maxMainTrustedUid = 0;
-    uint32_t maxMainSequenceId = 0;
-    uint32_t maxMainPid = 0;
-    uint32_t maxMainTid = 0;
-    uint32_t maxMainCpu = 0;
+    if (combineHere) {
+        asyncTraceSaveFunc();
+        return;
+    }
+    std::thread saveThread(asyncTraceSaveFunc);
+    saveThread.detach();
+}
 
-    sCalcMaxIds(main_pbtrace, &maxMainTrustedUid, &maxMainSequenceId, &maxMainPid, &maxMainTid, &maxMainCpu);
+// Stops the session and saves the traces. Unless |blocking|, returns before
+// the session has stopped; a thread of its own then saves them and calls
+// |onSaved|.
+static void stopTracing(bool blocking, std::function<void()> onSaved) {
+    if (sTracingSession) {
+        sTraceConfig.tracingDisabled = true;
+        gTracingEnabled.store(false, std::memory_order_relaxed);
 
-    // Use the same offset in case pids and tids are mixed up.
-    uint32_t maxPidTid = std::max(maxMainPid, maxMainTid);
-    // Use an offset that is easy to read out the original addon pid for debugging.
-    uint64_t pidTidOffset = 1000000;
-    while(pidTidOffset < maxPidTid)
-        pidTidOffset *= 10;
+        // Don't disable again if we are saving.
+        if (sTraceConfig.saving) return;
+        sTraceConfig.saving = true;
 
-    // Easier to see host CPUs vs guest CPUs with fixed offset.
-    // 1000 would be more ideal, but the Perfetto UI doesn't allow CPU IDs that high.
-    int32_t addonCpuOffset = 100;
+        stopIncrementalStateClearer();
 
-    ::perfetto::protos::Trace addon_pbtrace;
-    {
-        std::string traceStr(addonTrace.begin(), addonTrace.end());
-        if (!addon_pbtrace.ParseFromString(traceStr)) {
-            fprintf(stderr, "%s: Failed to parse protobuf as a string\n", __func__);
-            return {};
+        // The last event this thread wrote is still open in its chunk; hand
+        // it over before the session stops.
+        ::perfetto::TrackEvent::Flush();
+        if (blocking) {
+            sTracingSession->StopBlocking();
+            saveStoppedSession(false /* combineHere */);
+            return;
         }
-    }
-
-    uint64_t addonRealtimeToBoottime = 0;
-    uint64_t mainBoottimeToRealtime = 0;
-    uint64_t addonRealtimeToMainRealtime = 0;
-    uint64_t realtime = 0;
-    uint64_t boottime = 0;
-
-    getClockSnapshotTimes(main_pbtrace, &realtime, &boottime);
-    mainBoottimeToRealtime = realtime - boottime;
-    getClockSnapshotTimes(addon_pbtrace, &realtime, &boottime);
-    addonRealtimeToBoottime = boottime - realtime;
-    addonRealtimeToMainRealtime = addonRealtimeToBoottime + mainTimeDiff + mainBoottimeToRealtime;
-
-    fprintf(stderr, "%s: postprocessing trace with main time diff of %lld, and offseting by main max seqid %u, pid offset %u\n", __func__,
-            (long long)mainTimeDiff,
-            maxMainSequenceId,
-            pidTidOffset);
-    if (!addTraces) {
-        mutateTracePackets(addon_pbtrace,
-            [](auto* packet) {
-                bool needReplace = false;
-                if (packet->has_clock_snapshot()) {
-                    packet->clear_clock_snapshot();
-                }
-                if (packet->has_service_event()) {
-                    packet->clear_service_event();
-                }
-                if (needReplace) {
-                    auto* te = packet->mutable_track_event();
-                    te->set_type((::perfetto::protos::TrackEvent_Type)(0));
-                }
-            });
 
-        iterateTraceTimestamps(addon_pbtrace,
-            [mainTimeDiff](uint64_t ts) {
-                return ts + mainTimeDiff;
-            },
-            [addonRealtimeToMainRealtime](uint64_t ts) {
-                return ts + addonRealtimeToMainRealtime;
-            });
-
-        iterateTraceIds(addon_pbtrace,
-            [maxMainTrustedUid](uint32_t uid) {
-                return uid + maxMainTrustedUid;
-            },
-            [maxMainSequenceId](uint32_t seqid) {
-                return seqid + maxMainSequenceId;
-            },
-            [pidTidOffset](int32_t pid) {
-                if (pid == 0) return 0;
-                return (int32_t)(pid + pidTidOffset);
-            },
-            [pidTidOffset](int32_t tid) {
-                if (tid == 0) return 0;
-                return (int32_t)(tid + pidTidOffset);
-            },
-            [addonCpuOffset](int32_t cpu) {
-                return cpu + addonCpuOffset;
+        // The callback runs on the tracing service's thread, which reading
+        // the trace needs.
+        sTracingSession->SetOnStopCallback([onSaved]() {
+            std::thread saveThread([onSaved]() {
+                saveStoppedSession(true /* combineHere */);
+                if (onSaved) onSaved();
             });
+            saveThread.detach();
+        });
+        sTracingSession->Stop();
     }
-    std::string traceAfter;
-    addon_pbtrace.SerializeToString(&traceAfter);
-
-    std::vector<char> combined;
-    combined.resize(mainTrace.size() + traceAfter.size());
-    memcpy(combined.data(), mainTrace.data(), mainTrace.size());
-    memcpy(combined.data() + mainTrace.size(), traceAfter.data(), traceAfter.size());
-    // memcpy(combined.data(), traceAfter.data(), traceAfter.size());
-    // memcpy(combined.data() + traceAfter.size(), mainTrace.data(), mainTrace.size());
-    // combined.resize(traceAfter.size());
-    // memcpy(combined.data(), traceAfter.data(), traceAfter.size());
-
-    return combined;
 }
 
-void asyncTraceSaveFunc() {
-    fprintf(stderr, "%s: Saving combined trace async...\n", __func__);
-
-    static const int kWaitSecondsPerIteration = 1;
-    static const int kMaxIters = 20;
-    static const int kMinItersForGuestFileSize = 2;
-
-    const char* hostFilename = sTraceConfig.hostFilename;
-    const char* guestFilename = sTraceConfig.guestFilename;
-    const char* combinedFilename = sTraceConfig.combinedFilename;
-
-    std::streampos currGuestSize = 0;
-    int numGoodGuestFileSizeIters = 0;
-    bool good = false;
-
-    for (int i = 0; i < kMaxIters; ++i) {
-        fprintf(stderr, "%s: Waiting for 1 second...\n", __func__);
-        std::this_thread::sleep_for(std::chrono::seconds(kWaitSecondsPerIteration));
-        fprintf(stderr, "%s: Querying file size of guest trace...\n", __func__);
-        std::ifstream guestFile(guestFilename, std::ios::in | std::ios::binary | std::ios::ate);
-        std::streampos size = guestFile.tellg();
-
-        if (!size) {
-            fprintf(stderr, "%s: No size, try again\n", __func__);
-            continue;
-        }
+VPERFETTO_EXPORT void disableTracing() {
+    stopTracing(true /* blocking */, nullptr);
+}
 
-        if (size != currGuestSize) {
-            fprintf(stderr, "%s: Sized changed (%llu to %llu), try again\n", __func__,
-                    (unsigned long long)currGuestSize, (unsigned long long)size);
-            currGuestSize = size;
-            continue;
-        }
+VPERFETTO_EXPORT void disableTracingAsync(std::function<void()> onSaved) {
+    stopTracing(false /* blocking */, std::move(onSaved));
+}
 
-        ++numGoodGuestFileSizeIters;
+VPERFETTO_EXPORT void notifyGuestTraceReady(const char* guestFilename) {
+    sGuestTraceWaiter.notifyReady(guestFilename);
+}
 
-        if (numGoodGuestFileSizeIters == kMinItersForGuestFileSize) {
-            fprintf(stderr, "%s: size is stable, continue saving\n", __func__);
-            good = true;
-            break;
-        }
+VPERFETTO_EXPORT void pushGuestTraceChunk(const void* data, size_t size) {
+    std::lock_guard<std::mutex> lock(sTraceProgress.guestTraceLock);
+    if (sTraceProgress.guestTraceFinished) {
+        fprintf(stderr, "%s: warning: guest trace already finished, dropping %zu bytes\n", __func__, size);
+        return;
     }
-
-    if (!good) {
-        fprintf(stderr, "%s: Timed out when waiting for guest file to stabilize, skipping combined trace saving.\n", __func__);
-        sTraceProgress.hostTrace.clear();
-        sTraceProgress.guestTrace.clear();
-        sTraceProgress.combinedTrace.clear();
-        sTraceConfig.saving = false;
+    if (sTraceProgress.onlineCombiner) {
+        sTraceProgress.onlineCombiner->appendAddon(data, size);
         return;
     }
-
-    std::ifstream guestFile(guestFilename, std::ios::binary | std::ios::ate);
-    std::ifstream::pos_type end = guestFile.tellg();
-    guestFile.seekg(0, std::ios::beg);
-    sTraceProgress.guestTrace.resize(end);
-    guestFile.read(sTraceProgress.guestTrace.data(), end);
-    guestFile.close();
-
-    sTraceProgress.combinedTrace =
-        constructCombinedTrace(sTraceProgress.guestTrace, sTraceProgress.hostTrace, sTraceConfig.guestTimeDiff, sTraceConfig.addTraces);
-
-    std::ofstream hostFile(hostFilename, std::ios::out | std::ios::binary);
-    hostFile.write(sTraceProgress.hostTrace.data(), sTraceProgress.hostTrace.size());
-    hostFile.close();
-    sTraceProgress.hostTrace.clear();
-    sTraceProgress.guestTrace.clear();
-
-    std::ofstream combinedFile(combinedFilename, std::ios::out | std::ios::binary);
-    combinedFile.write(sTraceProgress.combinedTrace.data(), sTraceProgress.combinedTrace.size());
-    combinedFile.close();
-    sTraceProgress.combinedTrace.clear();
-
-    fprintf(stderr, "%s: Wrote host trace (%s)\n", __func__, hostFilename);
-    fprintf(stderr, "%s: Wrote combined trace (%s)\n", __func__, combinedFilename);
-
-    sTraceConfig.saving = false;
+    sTraceProgress.guestTrace.append(data, size);
 }
 
-VPERFETTO_EXPORT void disableTracing() {
-    if (sTracingSession) {
-        sTraceConfig.tracingDisabled = true;
-
-        // Don't disable again if we are saving.
-        if (sTraceConfig.saving) return;
-        sTraceConfig.saving = true;
+VPERFETTO_EXPORT void finishGuestTrace() {
+    {
+        std::lock_guard<std::mutex> lock(sTraceProgress.guestTraceLock);
+        sTraceProgress.guestTraceFinished = true;
+    }
+    sGuestTraceWaiter.notifyReady(nullptr);
+}
 
-        sTracingSession->StopBlocking();
-        sTraceProgress.hostTrace = sTracingSession->ReadTraceBlocking();
+VPERFETTO_EXPORT bool snapshotTrace(const char* hostFilename, const char* guestFilename, const char* combinedFilename) {
+    if (!sTracingSession || sTraceConfig.tracingDisabled || !sTraceConfig.flightRecorderKb) {
+        fprintf(stderr, "%s: error: snapshots need tracing on in flight recorder mode\n", __func__);
+        return false;
+    }
 
-        fprintf(stderr, "%s: Tracing ended================================================================================\n", __func__);
-        fprintf(stderr, "%s: Saving trace to disk. Configuration:\n", __func__);
-        fprintf(stderr, "%s: host filename: %s\n", __func__, sTraceConfig.hostFilename);
-        fprintf(stderr, "%s: guest filename: %s\n", __func__, sTraceConfig.guestFilename);
-        fprintf(stderr, "%s: combined filename: %s\n", __func__, sTraceConfig.combinedFilename);
-
-        sTracingSession.reset();
-
-        if (!sTraceConfig.guestFilename || !sTraceConfig.combinedFilename) {
-            fprintf(stderr, "%s: skipping guest combined trace, "
-                            "either guest file name (%p) not specified or "
-                            "combined file name (%p) not specified\n", __func__,
-                    sTraceConfig.guestFilename,
-                    sTraceConfig.combinedFilename);
-            fprintf(stderr, "%s: saving only host trace\n", __func__);
-            const char* hostFilename = sTraceConfig.hostFilename;
-            {
-                std::ofstream hostFile(sTraceConfig.hostFilename, std::ios::out | std::ios::binary);
-                hostFile.write(sTraceProgress.hostTrace.data(), sTraceProgress.hostTrace.size());
-            }
-            fprintf(stderr, "%s: saving only host trace (done)\n", __func__);
-            sTraceConfig.saving = false;
-            return;
+    fprintf(stderr, "%s: Saving host trace snapshot (%s)...\n", __func__, hostFilename);
+    // Hands this thread's pending events over to the service; other threads'
+    // get there as their chunks fill up.
+    ::perfetto::TrackEvent::Flush();
+    // Reading takes the data out of the buffer; it is kept for later
+    // snapshots instead. Threads start over so that what they write from now
+    // on resolves without what was read.
+    std::vector<char> hostTrace = retainHostTraceRead(sTracingSession->ReadTraceBlocking());
+    sIncrementalStateGeneration.fetch_add(1, std::memory_order_relaxed);
+    {
+        std::ofstream hostFile(hostFilename, std::ios::out | std::ios::binary);
+        hostFile.write(hostTrace.data(), hostTrace.size());
+        if (!hostFile) {
+            fprintf(stderr, "%s: error: could not write host trace snapshot (%s)\n", __func__, hostFilename);
+            return false;
         }
+    }
 
-        std::thread saveThread(asyncTraceSaveFunc);
-        saveThread.detach();
+    if (guestFilename && combinedFilename) {
+        MappedTraceFile guestFile(guestFilename);
+        if (!guestFile.valid()) {
+            fprintf(stderr, "%s: warning: could not read guest trace (%s), combined trace has host only\n", __func__, guestFilename);
+        }
+        std::ofstream combinedFile(combinedFilename, std::ios::out | std::ios::binary);
+        ScannedTrace guestTrace(guestFile.bytes());
+        ScannedTrace hostSnapshot(traceBytes(hostTrace));
+        if (!writeCombinedTrace(guestTrace, hostSnapshot,
+                                sTraceConfig.guestTimeDiff, sTraceConfig.addTraces, false, 1, combinedFile)) {
+            fprintf(stderr, "%s: warning: combined trace (%s) may be incomplete\n", __func__, combinedFilename);
+        }
+        fprintf(stderr, "%s: Wrote combined trace (%s)\n", __func__, combinedFilename);
     }
+    return true;
 }
 
 VPERFETTO_EXPORT void beginTrace(const char* eventName) {
+    clearIncrementalStateIfStale();
     TRACE_EVENT_BEGIN("gfx", ::perfetto::StaticString{eventName});
 }
 
+// The SDK interns event names itself (per trace writer, by pointer), so there
+// is nothing to do up front.
+VPERFETTO_EXPORT uint32_t internStaticEventName(const char*) {
+    return 0;
+}
+
+VPERFETTO_EXPORT void beginStaticTrace(const StaticEventName& eventName) {
+    clearIncrementalStateIfStale();
+    TRACE_EVENT_BEGIN("gfx", ::perfetto::StaticString{eventName.name()});
+}
+
 VPERFETTO_EXPORT void endTrace() {
+    clearIncrementalStateIfStale();
     TRACE_EVENT_END("gfx");
 }
 
 VPERFETTO_EXPORT void traceCounter(const char* name, int64_t value) {
-    // TODO: What this really needs until its supported in the official sdk:
-    // a. a static global to track uuids and names for counters
-    // b. track objects generated dynamically
-    // c. setting the descriptor of these track objects
-    // if (CC_LIKELY(sTraceConfig.tracingDisabled)) return;
-    // TRACE_COUNTER("gfx", ::perfetto::StaticString{name}, value);
+    if (CC_LIKELY(sTraceConfig.tracingDisabled)) return;
+    clearIncrementalStateIfStale();
+    VPERFETTO_COUNTER_EVENT("gfx", getCounterTrack(name), value);
+}
+
+VPERFETTO_EXPORT uint64_t internStaticCounterName(const char* name) {
+    return getCounterTrackId(name);
+}
+
+VPERFETTO_EXPORT void traceStaticCounter(const StaticCounterName& counterName, int64_t value) {
+    if (CC_LIKELY(sTraceConfig.tracingDisabled)) return;
+    clearIncrementalStateIfStale();
+    VPERFETTO_COUNTER_EVENT("gfx", ::perfetto::Track(counterName.trackId()), value);
 }
 
 VPERFETTO_EXPORT void setGuestTime(uint64_t t) {
@@ -868,88 +685,47 @@ VPERFETTO_EXPORT void sleepUs(unsigned interval) {
 VPERFETTO_EXPORT void waitSavingDone() {
     fprintf(stderr, "%s: waiting for trace saving to be done...\n", __func__);
     while (sTraceConfig.saving) {
-        sleepUs(1000000);
+        sleepUs(10000);
     }
     fprintf(stderr, "%s: waiting for trace saving to be done...(done)\n", __func__);
 }
 
-uint64_t getTraceStartTime(const std::vector<char>& trace) {
-    ::perfetto::protos::Trace pbtrace;
-    std::string traceStr(trace.begin(), trace.end());
-    if (!pbtrace.ParseFromString(traceStr)) {
-        fprintf(stderr, "%s: error: could not parse host trace. return 0\n", __func__);
-        return 0;
-    }
-
-    for (int i = 0; i < pbtrace.packet_size(); ++i) {
-        auto* packet = pbtrace.mutable_packet(i);
-        if (packet->has_timestamp()) {
-            fprintf(stderr, "%s: first packet with timestamp %llu, using this as corresponding boot time\n", __func__, packet->timestamp());
-            return packet->timestamp();
-        }
+uint64_t getTraceStartTime(ScannedTrace& trace) {
+    const TraceSummary& summary = trace.summary();
+    if (summary.hasTimestamp) {
+        fprintf(stderr, "%s: first packet with timestamp %llu, using this as corresponding boot time\n", __func__,
+                (unsigned long long)summary.firstTimestamp);
+        return summary.firstTimestamp;
     }
 
     fprintf(stderr, "%s: did not find any timestamps in trace, return 0\n", __func__);
     return 0;
 }
 
-static int getCpuClockIndex(const ::perfetto::protos::ClockSnapshot& snapshot)
-{
-    for (int i = 0; i < snapshot.clocks_size(); i++) {
-        const auto& clock = snapshot.clocks(i);
-
-        if (clock.clock_id() == 64 && !clock.has_is_incremental() && !clock.has_unit_multiplier_ns())
-            return i;
-    }
-
-    return -1;
-}
-
-static bool getTraceCpuTimeSync(const std::vector<char>& trace, TraceCpuTimeSync* retCpuTime,
+static bool getTraceCpuTimeSync(ScannedTrace& trace, TraceCpuTimeSync* retCpuTime,
                                 uint32_t needed_clock) {
-    ::perfetto::protos::Trace pbtrace;
-    std::string traceStr(trace.begin(), trace.end());
-    if (!pbtrace.ParseFromString(traceStr)) {
-        fprintf(stderr, "%s: error: could not parse host trace. return 0\n", __func__);
-        return false;
-    }
+    uint32_t boottime_clockid = static_cast<uint32_t>(::perfetto::protos::pbzero::BuiltinClock::BUILTIN_CLOCK_BOOTTIME);
+    uint32_t monotonic_clockid = static_cast<uint32_t>(::perfetto::protos::pbzero::BuiltinClock::BUILTIN_CLOCK_MONOTONIC);
 
     TraceCpuTimeSync first = {0};
     TraceCpuTimeSync last = {0};
-    for (int i = 0; i < pbtrace.packet_size(); ++i) {
+    for (const TraceClockSyncPoint& point : trace.summary().clockSyncPoints) {
         TraceCpuTimeSync found = {0};
-        auto* packet = pbtrace.mutable_packet(i);
-        if (packet->has_clock_snapshot() && packet->clock_snapshot().clocks_size() == 2) {
+        if (point.hasSnapshot) {
             fprintf(stderr, "%s: found cpu clock_snapshot\n", __func__);
-            auto snapshot = packet->clock_snapshot();
-            int cpuClock, regClock;
-
-            cpuClock = getCpuClockIndex(snapshot);
-            if (cpuClock < 0)
-                continue;
-
-            regClock = (cpuClock == 0) ? 1 : 0;
-            found.clockId = snapshot.clocks(regClock).clock_id();
-            found.clockTime = snapshot.clocks(regClock).timestamp();
-            found.cpuTime = snapshot.clocks(cpuClock).timestamp();
+            found.clockId = point.snapshotClockId;
+            found.clockTime = point.snapshotClockTime;
+            found.cpuTime = point.snapshotCpuTime;
         }
-        uint32_t boottime_clockid = static_cast<uint32_t>(::perfetto::protos::pbzero::BuiltinClock::BUILTIN_CLOCK_BOOTTIME);
-        uint32_t monotonic_clockid = static_cast<uint32_t>(::perfetto::protos::pbzero::BuiltinClock::BUILTIN_CLOCK_MONOTONIC);
-        if (packet->has_track_event() && packet->track_event().debug_annotations_size() > 0) {
-            for (int d = 0; d < packet->track_event().debug_annotations_size(); ++d) {
-                const auto& data = packet->track_event().debug_annotations(d);
-                if (data.name() == "clock_sync_boottime" &&
-                    (needed_clock == 0 || needed_clock == boottime_clockid)) {
-                    found.clockId = boottime_clockid;
-                    found.clockTime = data.uint_value();
-                } else if (data.name() == "clock_sync_monotonic" &&
-                    needed_clock == monotonic_clockid) {
-                    found.clockId = monotonic_clockid;
-                    found.clockTime = data.uint_value();
-                } else if (data.name() == "clock_sync_cputime") {
-                    found.cpuTime = data.uint_value();
-                }
-            }
+        if (point.hasBoottime && (needed_clock == 0 || needed_clock == boottime_clockid)) {
+            found.clockId = boottime_clockid;
+            found.clockTime = point.boottime;
+        } else if (point.hasMonotonic && needed_clock == monotonic_clockid) {
+            found.clockId = monotonic_clockid;
+            found.clockTime = point.monotonic;
+        }
+        if (point.hasCpuTime) {
+            found.cpuTime = point.cpuTime;
         }
         if (found.hasData()) {
             if (!last.hasData() || found.cpuTime > last.cpuTime) {
@@ -975,7 +751,7 @@ static bool getTraceCpuTimeSync(const std::vector<char>& trace, TraceCpuTimeSync
 }
 
 static int64_t deriveGuestTimeDiffWithGuestAbsoluteTime(
-    const std::vector<char>& hostTrace, uint64_t guestBootTimeNs) {
+    ScannedTrace& hostTrace, uint64_t guestBootTimeNs) {
 
     fprintf(stderr, "%s: Deriving guest time diff from host trace and guest abs time of %llu ns\n", __func__,
             (unsigned long long)guestBootTimeNs);
@@ -989,8 +765,8 @@ static int64_t deriveGuestTimeDiffWithGuestAbsoluteTime(
 }
 
 static int64_t deriveGuestTimeDiff(
-    const std::vector<char>& guestTrace,
-    const std::vector<char>& hostTrace,
+    ScannedTrace& guestTrace,
+    ScannedTrace& hostTrace,
     int64_t tscOffset) {
 
     fprintf(stderr, "%s: Deriving guest time diff from guest and host traces\n", __func__);
@@ -1040,22 +816,20 @@ static int64_t deriveGuestTimeDiff(
 }
 
 VPERFETTO_EXPORT void combineTraces(const TraceCombineConfig* config) {
-    std::vector<char> guestTrace;
-    std::vector<char> hostTrace;
-
-    std::ifstream guestFile(config->guestFile, std::ios::binary | std::ios::ate);
-    std::ifstream::pos_type end = guestFile.tellg();
-    guestFile.seekg(0, std::ios::beg);
-    guestTrace.resize(end);
-    guestFile.read(guestTrace.data(), end);
-    guestFile.close();
+    // Both inputs are mapped rather than read, so combining never holds more
+    // than the packet being rewritten on the heap.
+    MappedTraceFile guestFile(config->guestFile);
+    MappedTraceFile hostFile(config->hostFile);
+    if (!guestFile.valid() || !hostFile.valid()) {
+        fprintf(stderr, "%s: error: could not read guest (%s) or host (%s) trace\n", __func__,
+                config->guestFile, config->hostFile);
+        return;
+    }
 
-    std::ifstream hostFile(config->hostFile, std::ios::binary | std::ios::ate);
-    end = hostFile.tellg();
-    hostFile.seekg(0, std::ios::beg);
-    hostTrace.resize(end);
-    hostFile.read(hostTrace.data(), end);
-    hostFile.close();
+    // Each trace is scanned at most once, and only if the time diff or the
+    // combiner need it; both share the results.
+    ScannedTrace guestTrace(guestFile.bytes());
+    ScannedTrace hostTrace(hostFile.bytes());
 
     int64_t guestTimeDiff;
     if (config->useGuestAbsoluteTime) {
@@ -1066,15 +840,19 @@ VPERFETTO_EXPORT void combineTraces(const TraceCombineConfig* config) {
         guestTimeDiff = deriveGuestTimeDiff(guestTrace, hostTrace, config->guestTscOffset);
     }
 
-    std::vector<char> combinedTrace;
+    std::ofstream combinedFile(config->combinedFile, std::ios::out | std::ios::binary);
+    bool combined;
     if (config->mergeGuestIntoHost)
-        combinedTrace = constructCombinedTrace(hostTrace, guestTrace, -guestTimeDiff, config->addTraces);
+        combined = writeCombinedTrace(hostTrace, guestTrace, -guestTimeDiff, config->addTraces,
+                                      config->useClockSnapshots, config->jobs, combinedFile);
     else
-        combinedTrace = constructCombinedTrace(guestTrace, hostTrace, guestTimeDiff, config->addTraces);
-
-    std::ofstream combinedFile(config->combinedFile, std::ios::out | std::ios::binary);
-    combinedFile.write(combinedTrace.data(), combinedTrace.size());
+        combined = writeCombinedTrace(guestTrace, hostTrace, guestTimeDiff, config->addTraces,
+                                      config->useClockSnapshots, config->jobs, combinedFile);
     combinedFile.close();
+
+    if (!combined) {
+        fprintf(stderr, "%s: warning: combined trace (%s) may be incomplete\n", __func__, config->combinedFile);
+    }
 }
 
 } // namespace vperfetto
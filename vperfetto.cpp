@@ -12,29 +12,53 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 #include "vperfetto.h"
+#include "vperfetto-cpu-clock.h"
+#include "vperfetto-guest-trace-waiter.h"
+#include "vperfetto-packet-writer.h"
 
+#include "perfetto-min/protos/perfetto/common/trace_stats.pbzero.h"
+#include "perfetto-min/protos/perfetto/trace/clock_snapshot.pbzero.h"
+#include "perfetto-min/protos/perfetto/trace/trace.pbzero.h"
 #include "perfetto-min/protos/perfetto/trace/trace_packet.pbzero.h"
+#include "perfetto-min/protos/perfetto/trace/trace_packet_defaults.pbzero.h"
 #include "perfetto-min/protos/perfetto/trace/track_event/counter_descriptor.pbzero.h"
 #include "perfetto-min/protos/perfetto/trace/track_event/track_descriptor.pbzero.h"
 #include "perfetto-min/protos/perfetto/trace/track_event/track_event.pbzero.h"
 #include "perfetto-min/protos/perfetto/trace/interned_data/interned_data.pbzero.h"
 
 #include "perfetto/base/time.h"
+#include "perfetto/ext/base/hash.h"
+#include "perfetto/ext/base/paged_memory.h"
 
 #include "perfetto/protozero/message_handle.h"
 #include "perfetto/protozero/proto_utils.h"
 #include "perfetto/protozero/root_message.h"
+#include "perfetto/protozero/scattered_heap_buffer.h"
 #include "perfetto/protozero/scattered_stream_writer.h"
 
+#include <algorithm>
 #include <atomic>
+#include <cerrno>
 #include <chrono>
+#include <climits>
+#include <condition_variable>
 #include <cstdlib>
+#include <deque>
 #include <fstream>
+#include <memory>
 #include <thread>
 #include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
 #include <unordered_map>
 #include <unordered_set>
 #include <sstream>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 #include "vperfetto-util.h"
 
@@ -56,57 +80,477 @@ static VirtualDeviceTraceConfig sTraceConfig = {
     .guestStartTime = 0,
     .guestTimeDiff = 0,
     .perThreadStorageMb = 1,
-    .addTraces = false;
+    .addTraces = false,
+    .chunkPoolPrefaultChunks = 4,
 };
 
-#define TRACE_STACK_DEPTH_MAX 16
+VPERFETTO_DATA_EXPORT std::atomic<bool> gTracingEnabled(false);
+
+// Bumped by enableTracing(). Each thread compares it against the session its
+// TraceContext last wrote to and starts over when they differ, so the saver
+// never has to touch another thread's state.
+static std::atomic<uint64_t> sTracingSessionId(0);
+
+// Trusted packet sequence ids, one for each thread that traces in a session.
+// Reset by enableTracing().
+static std::atomic<uint32_t> sNextSequenceId(1);
+
+// Bumped when the flight recorder drops chunks. What threads interned or
+// described may have been in them, so each thread emits it again when it
+// sees this change.
+static std::atomic<uint32_t> sIncrementalStateGeneration(0);
+
+// Slice and counter events of this session that were left out of the trace:
+// ends without a begin, and both ends of slices nested past
+// TraceContext::kMaxSliceStackDepth, which sSliceStackOverflows counts. Only
+// touched on those paths; see TraceStorage::encodeTraceStats().
+static std::atomic<uint64_t> sDroppedEvents(0);
+static std::atomic<uint64_t> sSliceStackOverflows(0);
+
+// Runs while a session traces with rawCpuClock; enableTracing() takes its
+// first calibration point and the host writer measures the rates.
+static CpuClock sCpuClock;
+
+// Tells the save thread when the guest trace is there to combine.
+static GuestTraceWaiter sGuestTraceWaiter;
+
+// The guest trace, when it comes through pushGuestTraceChunk() rather than a
+// file. Combining here is concatenation, so it is only held until then.
+static std::mutex sGuestTraceLock;
+static std::vector<char> sGuestTrace;
+static bool sGuestTraceFinished = false;
+
+static inline uint64_t hashString(const char* str, size_t len) {
+    ::perfetto::base::Hash hash;
+    hash.Update(str, len);
+    return hash.digest();
+}
+
+// Interning ids of event names and categories, shared by all threads and kept
+// for the life of the process. Strings are keyed on their contents, so a name
+// built on the fly gets the same iid every time and on every thread, and
+// StaticEventName iids work on any sequence. Threads only come here for
+// strings they haven't used yet (see TraceContext::internEvent()); which iids
+// a sequence has emitted is up to its TraceContext.
+// The ids are global rather than per sequence on purpose: a StaticEventName is
+// interned once, before any thread uses it, so it has no sequence to take an
+// id from, and per-sequence tables would hold a copy of every name per thread.
+// Iids only have to be unique within a sequence, so sharing them costs nothing
+// in the trace.
+class InternedStrings {
+public:
+    uint32_t intern(const char* str, size_t len, uint64_t hash) {
+        {
+            std::shared_lock<std::shared_mutex> lock(mLock);
+            uint32_t iid = findLocked(str, len, hash);
+            if (iid) return iid;
+        }
+
+        std::unique_lock<std::shared_mutex> lock(mLock);
+        uint32_t iid = findLocked(str, len, hash);
+        if (iid) return iid;
+        iid = mNextIid++;
+        mIids.emplace(hash, Entry{ std::string(str, len), iid });
+        return iid;
+    }
+
+    uint32_t nextIid() {
+        std::shared_lock<std::shared_mutex> lock(mLock);
+        return mNextIid;
+    }
+
+private:
+    struct Entry {
+        std::string str;
+        uint32_t iid;
+    };
+
+    uint32_t findLocked(const char* str, size_t len, uint64_t hash) const {
+        auto range = mIids.equal_range(hash);
+        for (auto it = range.first; it != range.second; ++it) {
+            const std::string& candidate = it->second.str;
+            if (candidate.size() == len && !memcmp(candidate.data(), str, len)) {
+                return it->second.iid;
+            }
+        }
+        return 0;
+    }
+
+    std::shared_mutex mLock;
+    std::unordered_multimap<uint64_t, Entry> mIids;
+    uint32_t mNextIid = 1;
+};
+
+static InternedStrings sInternedStrings;
+
+static uint32_t internStaticString(const char* str) {
+    size_t len = strlen(str);
+    return sInternedStrings.intern(str, len, hashString(str, len));
+}
 
 class TraceContext;
 
+// A piece of a thread's trace. The chunk states follow SharedMemoryABI's: the
+// owning thread takes a chunk kChunkBeingWritten, fills it and marks it
+// kChunkComplete when it moves on to the next one.
+struct TraceChunk {
+    enum State : uint32_t {
+        kChunkFree = 0,
+        kChunkBeingWritten = 1,
+        kChunkComplete = 2,
+    };
+
+    ::perfetto::base::PagedMemory memory;
+    uint8_t* data = nullptr;
+    size_t size = 0;
+    uint64_t sessionId = 0;
+    // Order in which chunks were handed out, across all threads.
+    uint64_t serial = 0;
+    // Bytes of whole packets at the start of |data|, published by the owning
+    // thread after each packet so the saver never sees half a packet.
+    std::atomic<size_t> committed{0};
+    std::atomic<uint32_t> state{kChunkFree};
+    std::atomic<TraceChunk*> next{nullptr};
+    // Saver only: how much of |committed| is already saved.
+    size_t saved = 0;
+};
+
+// Chunks are recycled through this pool instead of being malloc'ed for every
+// buffer and freed once written. The memory is PagedMemory that gets faulted
+// in when tracing is enabled, so tracing threads don't take page faults when
+// they move on to a new chunk.
+class TraceChunkPool {
+public:
+    ~TraceChunkPool() {
+        for (TraceChunk* chunk : mFreeChunks) {
+            delete chunk;
+        }
+    }
+
+    // Grows the pool to at least |count| free chunks of |size| bytes and
+    // faults them in.
+    void prefault(size_t count, size_t size) {
+        std::lock_guard<std::mutex> lock(mLock);
+        dropFreeChunksNotOfSizeLocked(size);
+        while (mFreeChunks.size() < count) {
+            mFreeChunks.push_back(allocateChunkLocked(size));
+        }
+    }
+
+    // Returns a chunk of |size| bytes that is not in any queue. Called by
+    // tracing threads once per chunk, not per event.
+    TraceChunk* acquire(size_t size) {
+        std::lock_guard<std::mutex> lock(mLock);
+        TraceChunk* chunk = nullptr;
+        while (!mFreeChunks.empty() && !chunk) {
+            chunk = mFreeChunks.back();
+            mFreeChunks.pop_back();
+            if (chunk->size != size) {
+                deleteChunkLocked(chunk);
+                chunk = nullptr;
+            }
+        }
+        if (!chunk) {
+            chunk = allocateChunkLocked(size);
+        }
+
+        ++mChunksInUse;
+        mHighWaterMark = std::max(mHighWaterMark, mChunksInUse);
+
+        chunk->sessionId = 0;
+        chunk->serial = ++mSerial;
+        chunk->committed.store(0, std::memory_order_relaxed);
+        chunk->state.store(TraceChunk::kChunkFree, std::memory_order_relaxed);
+        chunk->next.store(nullptr, std::memory_order_relaxed);
+        chunk->saved = 0;
+        return chunk;
+    }
+
+    void release(TraceChunk* chunk) {
+        std::lock_guard<std::mutex> lock(mLock);
+        chunk->state.store(TraceChunk::kChunkFree, std::memory_order_relaxed);
+        mFreeChunks.push_back(chunk);
+        --mChunksInUse;
+    }
+
+    // Gives free chunks beyond |count| back to the system.
+    void trim(size_t count) {
+        std::lock_guard<std::mutex> lock(mLock);
+        while (mFreeChunks.size() > count) {
+            deleteChunkLocked(mFreeChunks.back());
+            mFreeChunks.pop_back();
+        }
+    }
+
+    // Chunks currently allocated, free or in use.
+    uint32_t size() {
+        std::lock_guard<std::mutex> lock(mLock);
+        return mChunksAllocated;
+    }
+
+    // Chunks currently in queues.
+    uint32_t chunksInUse() {
+        std::lock_guard<std::mutex> lock(mLock);
+        return mChunksInUse;
+    }
+
+    // Most chunks in use at once since the process started.
+    uint32_t highWaterMark() {
+        std::lock_guard<std::mutex> lock(mLock);
+        return mHighWaterMark;
+    }
+
+private:
+    TraceChunk* allocateChunkLocked(size_t size) {
+        TraceChunk* chunk = new TraceChunk;
+        chunk->memory = ::perfetto::base::PagedMemory::Allocate(size);
+        chunk->data = (uint8_t*)chunk->memory.Get();
+        chunk->size = size;
+        // Touch every page now rather than on the tracing thread.
+        static const size_t kPageSize = 4096;
+        for (size_t i = 0; i < size; i += kPageSize) {
+            ((volatile uint8_t*)chunk->data)[i] = 0;
+        }
+        ++mChunksAllocated;
+        return chunk;
+    }
+
+    void deleteChunkLocked(TraceChunk* chunk) {
+        delete chunk;
+        --mChunksAllocated;
+    }
+
+    void dropFreeChunksNotOfSizeLocked(size_t size) {
+        auto it = std::remove_if(mFreeChunks.begin(), mFreeChunks.end(), [this, size](TraceChunk* chunk) {
+            if (chunk->size == size) return false;
+            deleteChunkLocked(chunk);
+            return true;
+        });
+        mFreeChunks.erase(it, mFreeChunks.end());
+    }
+
+    std::mutex mLock;
+    std::vector<TraceChunk*> mFreeChunks;
+    uint32_t mChunksAllocated = 0;
+    uint32_t mChunksInUse = 0;
+    uint32_t mHighWaterMark = 0;
+    uint64_t mSerial = 0;
+};
+
+static TraceChunkPool sTraceChunkPool;
+
+// The chunks of one thread, oldest first. This is a single-producer,
+// single-consumer queue: the owning thread appends and fills chunks at the
+// tail without taking any lock, and the saver (TraceStorage's host writer, or
+// disableTracing() once that has stopped) reads committed bytes from the head
+// and frees the chunks the owning thread is done with.
+class TraceChunkQueue {
+public:
+    ~TraceChunkQueue() {
+        TraceChunk* chunk = mHead.load(std::memory_order_acquire);
+        while (chunk) {
+            TraceChunk* next = chunk->next.load(std::memory_order_acquire);
+            freeChunk(chunk);
+            chunk = next;
+        }
+    }
+
+    // Owning thread only. Completes the current tail, if any, and appends a
+    // new chunk of |size| bytes to write to.
+    TraceChunk* appendChunk(size_t size, uint64_t sessionId) {
+        TraceChunk* chunk = sTraceChunkPool.acquire(size);
+        chunk->sessionId = sessionId;
+        chunk->state.store(TraceChunk::kChunkBeingWritten, std::memory_order_relaxed);
+
+        if (mTail) {
+            completeChunk(mTail);
+            mTail->next.store(chunk, std::memory_order_release);
+        } else {
+            mHead.store(chunk, std::memory_order_release);
+        }
+        mTail = chunk;
+        return chunk;
+    }
+
+    // Owning thread only.
+    void commit(TraceChunk* chunk, size_t bytes) {
+        chunk->committed.store(bytes, std::memory_order_release);
+    }
+
+    // Owning thread only.
+    void completeChunk(TraceChunk* chunk) {
+        chunk->state.store(TraceChunk::kChunkComplete, std::memory_order_release);
+    }
+
+    // Saver only. Calls |save(data, size)| with the bytes of
+    // |sessionId| committed since the last drain. Chunks from older sessions
+    // are skipped. With |completeOnly|, stops at the chunk the owning thread
+    // is still writing to.
+    template <typename SaveFunc>
+    void drain(uint64_t sessionId, bool completeOnly, SaveFunc save) {
+        for (TraceChunk* chunk = mHead.load(std::memory_order_acquire); chunk;
+             chunk = chunk->next.load(std::memory_order_acquire)) {
+            // The state is completed after the last commit, so loading it
+            // first makes |committed| final for complete chunks.
+            if (completeOnly &&
+                chunk->state.load(std::memory_order_acquire) != TraceChunk::kChunkComplete) {
+                break;
+            }
+            size_t committed = chunk->committed.load(std::memory_order_acquire);
+            if (chunk->sessionId == sessionId && committed > chunk->saved) {
+                save(chunk->data + chunk->saved, committed - chunk->saved);
+            }
+            chunk->saved = committed;
+        }
+    }
+
+    // Saver only. Like drain(), but leaves the bytes unsaved, so they are
+    // still there for the next caller.
+    template <typename SaveFunc>
+    void snapshot(uint64_t sessionId, SaveFunc save) const {
+        for (TraceChunk* chunk = mHead.load(std::memory_order_acquire); chunk;
+             chunk = chunk->next.load(std::memory_order_acquire)) {
+            size_t committed = chunk->committed.load(std::memory_order_acquire);
+            if (chunk->sessionId == sessionId && committed > chunk->saved) {
+                save(chunk->data + chunk->saved, committed - chunk->saved);
+            }
+        }
+    }
+
+    // Saver only. Calls |f(chunk)| for each complete chunk that has unsaved
+    // bytes, oldest first.
+    template <typename ChunkFunc>
+    void forEachUnsavedCompleteChunk(ChunkFunc f) {
+        for (TraceChunk* chunk = mHead.load(std::memory_order_acquire); chunk;
+             chunk = chunk->next.load(std::memory_order_acquire)) {
+            if (chunk->state.load(std::memory_order_acquire) != TraceChunk::kChunkComplete) break;
+            if (chunk->committed.load(std::memory_order_acquire) != chunk->saved) {
+                f(chunk);
+            }
+        }
+    }
+
+    // Saver only. Marks the bytes of |chunk| saved without writing them.
+    static void discard(TraceChunk* chunk) {
+        chunk->saved = chunk->committed.load(std::memory_order_acquire);
+    }
+
+    // Saver only. Whether every chunk is saved; for queues of exited threads,
+    // which can then go.
+    bool allSaved() const {
+        for (TraceChunk* chunk = mHead.load(std::memory_order_acquire); chunk;
+             chunk = chunk->next.load(std::memory_order_acquire)) {
+            if (chunk->committed.load(std::memory_order_acquire) != chunk->saved) return false;
+        }
+        return true;
+    }
+
+    // Saver only. Frees the saved chunks that the owning thread has moved
+    // past. The tail always stays, since the owning thread may still link a
+    // new chunk after it.
+    void releaseSaved() {
+        TraceChunk* chunk = mHead.load(std::memory_order_acquire);
+        while (chunk) {
+            TraceChunk* next = chunk->next.load(std::memory_order_acquire);
+            if (!next) break;
+            if (chunk->saved != chunk->committed.load(std::memory_order_acquire)) break;
+            mHead.store(next, std::memory_order_release);
+            freeChunk(chunk);
+            chunk = next;
+        }
+    }
+
+private:
+    static void freeChunk(TraceChunk* chunk) {
+        sTraceChunkPool.release(chunk);
+    }
+
+    std::atomic<TraceChunk*> mHead{nullptr};
+    TraceChunk* mTail = nullptr; // owning thread only
+};
+
 struct SavedTraceInfo {
-    uint8_t* data;
-    size_t allocSize;
+    const uint8_t* data;
     size_t written;
-    bool first;
 };
 
+// Owns the host trace file while tracing. A writer thread appends the chunks
+// threads have filled to the file as they complete and hands them back to the
+// pool, so the host trace takes a bounded amount of memory however long it
+// runs, and disableTracing() only has to write out the chunks threads are
+// still writing to.
+// In flight recorder mode the writer thread writes nothing; it frees the
+// oldest complete chunks instead whenever more than the budget is in use, and
+// the host file is written by snapshots and disableTracing().
 class TraceStorage {
 public:
+    ~TraceStorage() {
+        stopHostWriter();
+    }
+
     void add(TraceContext* context) {
         std::lock_guard<std::mutex> lock(mContextsLock);
         mContexts.insert(context);
     }
 
-    void remove(TraceContext* context) {
+    // When a thread exits, its chunks are kept until they are written.
+    void remove(TraceContext* context, std::unique_ptr<TraceChunkQueue> chunks) {
         std::lock_guard<std::mutex> lock(mContextsLock);
         mContexts.erase(context);
+        mExitedThreadChunks.push_back(std::move(chunks));
     }
 
     void onTracingEnabled() {
-        // do stuff
+        startHostWriter();
     }
 
     void onTracingDisabled() {
         saveTracesToDisk();
     }
 
-    // When a thread exited early before tracing was disabled
-    void saveTrace(const SavedTraceInfo& trace) {
-        std::lock_guard<std::mutex> lock(mContextsLock);
-        saveTraceLocked(trace);
-    }
+    // Flight recorder mode only.
+    bool snapshotToFile(const char* filename);
 
-private:
-    void saveTraceLocked(const SavedTraceInfo& trace) {
-        if (trace.data)
-            mSavedTraces.push_back(trace);
+    // Called by a tracing thread when it has filled a chunk. The writer also
+    // wakes up on its own, so a missed notification only delays it.
+    void onChunkCompleted() {
+        mWriterWakeup.notify_one();
     }
 
+private:
+    static constexpr int kHostWriterIntervalMs = 100;
+
+    void startHostWriter();
+    void stopHostWriter();
+    void hostWriterLoop(uint64_t sessionId);
+    void writeHostTrace(uint64_t sessionId, bool completeOnly);
+    void recycleOldestChunks();
+    std::vector<uint8_t> encodeTraceStats();
+    bool writeSnapshot(const char* filename, uint64_t sessionId);
     void saveTracesToDisk();
 
-    std::mutex mContextsLock; // protects |mContexts|
+    // Held by whoever saves (the writer thread, snapshots and
+    // disableTracing()), so chunks aren't freed while another one reads them.
+    // Taken before |mContextsLock|.
+    std::mutex mSaveLock;
+    std::mutex mContextsLock; // protects |mContexts| and |mExitedThreadChunks|
     std::unordered_set<TraceContext*> mContexts;
-    std::vector<SavedTraceInfo> mSavedTraces;
+    std::vector<std::unique_ptr<TraceChunkQueue>> mExitedThreadChunks;
+
+    // Only touched by the writer thread, or by the saver once the writer has
+    // been joined.
+    int mHostFd = -1;
+    bool mFlightRecorder = false;
+
+    // Flight recorder only: chunks, and their bytes, that the recycler dropped
+    // unsaved this session. Guarded by |mSaveLock|.
+    uint64_t mChunksOverwritten = 0;
+    uint64_t mBytesOverwritten = 0;
+
+    std::thread mWriterThread;
+    std::mutex mWriterLock; // protects |mStopWriter|
+    std::condition_variable mWriterWakeup;
+    bool mStopWriter = false;
 };
 
 static TraceStorage sTraceStorage;
@@ -114,35 +558,36 @@ static TraceStorage sTraceStorage;
 class TraceContext : public protozero::ScatteredStreamWriter::Delegate {
 public:
     TraceContext() :
+        mChunks(new TraceChunkQueue),
         mWriter(this) {
+            mSliceStack.reserve(kInitialSliceStackDepth);
             sTraceStorage.add(this);
         }
 
-    SavedTraceInfo save(bool partialReset = false) {
-        ScopedTracingLock lock(&mTracingLock);
-        return saveLocked(partialReset);
-    }
+    // Only the saver reads the chunks.
+    TraceChunkQueue* chunks() { return mChunks.get(); }
 
     virtual ~TraceContext() {
-        sTraceStorage.remove(this);
-        if (mTraceBuffer) {
-            sTraceStorage.saveTrace(save());
+        if (mChunk) {
+            mChunks->completeChunk(mChunk);
         }
+        sTraceStorage.remove(this, std::move(mChunks));
     }
 
     virtual protozero::ContiguousMemoryRange GetNewBuffer() {
         if (mWritingPacket) {
             mPacket.Finalize();
+            commitPacket();
         }
 
         finishAndRefresh();
 
         if (mWritingPacket) {
             beginPacket();
-            size_t writtenThisTime = size_t(((uintptr_t)mWriter.write_ptr()) - (uintptr_t)mTraceBuffer);
-            return protozero::ContiguousMemoryRange{mWriter.write_ptr(), mWriter.write_ptr() + (mTraceBufferSize - writtenThisTime) };
+            size_t writtenThisTime = writtenInChunk();
+            return protozero::ContiguousMemoryRange{mWriter.write_ptr(), mWriter.write_ptr() + (mChunk->size - writtenThisTime) };
         } else {
-            return protozero::ContiguousMemoryRange{mTraceBuffer, mTraceBuffer + mTraceBufferSize};
+            return protozero::ContiguousMemoryRange{mChunk->data, mChunk->data + mChunk->size};
         }
 
     }
@@ -154,74 +599,115 @@ public:
 #   define CC_LIKELY( exp )    (__builtin_expect( !!(exp), 1 ))
 #   define CC_UNLIKELY( exp )  (__builtin_expect( !!(exp), 0 ))
 #endif
-    static const uint32_t kSequenceId = 1;
+    // Event timestamps are deltas on this sequence-scoped clock. 64, the
+    // first sequence-scoped id, is what raw cpu clock snapshots use.
+    static const uint32_t kIncrementalClockId = 65;
+    // Open slices per thread that take no allocation, and the most there can
+    // be. Past that, slices are counted and left out, begin and end alike,
+    // so runaway nesting doesn't take all memory and pairs still match.
+    static const size_t kInitialSliceStackDepth = 16;
+    static const size_t kMaxSliceStackDepth = 4096;
     static constexpr char kTrackNamePrefix[] = "emu-";
     static constexpr char kCounterNamePrefix[] = "-count-";
     void beginTrace(const char* name) {
         if (CC_LIKELY(sTraceConfig.tracingDisabled)) return;
-        if (CC_UNLIKELY(mStackDepth == TRACE_STACK_DEPTH_MAX)) return;
+        ensureSession();
+        if (CC_UNLIKELY(!canOpenSlice())) return;
+
+        ensureThreadInfo();
+        writeBeginTrace(internEvent(name), name);
+    }
 
-        ScopedTracingLock lock(&mTracingLock);
+    // For names interned up front (StaticEventName): no lookup at all.
+    void beginTrace(uint32_t iid, const char* name) {
+        if (CC_LIKELY(sTraceConfig.tracingDisabled)) return;
+        ensureSession();
+        if (CC_UNLIKELY(!canOpenSlice())) return;
 
         ensureThreadInfo();
-        bool needEmitEventIntern = false;
-        mCurrentEventNameIid[mStackDepth] = internEvent(name, &needEmitEventIntern);
-        if (CC_UNLIKELY(needEmitEventIntern)) {
+        writeBeginTrace(iid, name);
+    }
+
+    void writeBeginTrace(uint32_t iid, const char* name) {
+        if (CC_UNLIKELY(needToEmitEventName(iid))) {
             beginPacket();
-            mPacket.set_trusted_packet_sequence_id(kSequenceId);
+            mPacket.set_trusted_packet_sequence_id(mSequenceId);
             mPacket.set_sequence_flags(2 /* incremental */);
             auto interned_data = mPacket.set_interned_data();
             auto eventname = interned_data->add_event_names();
-            eventname->set_iid(mCurrentEventNameIid[mStackDepth]);
+            eventname->set_iid(iid);
             eventname->set_name(name);
             endPacket();
         }
         // Finally do the actual thing
-        beginPacket();
-        mPacket.set_trusted_packet_sequence_id(kSequenceId);
-        mPacket.set_sequence_flags(2 /* incremental */);
-        mPacket.set_timestamp(getTimestamp());
-        auto trackevent = mPacket.set_track_event();
-        trackevent->set_track_uuid(mThreadId); // thread id
-        trackevent->add_category_iids(mCurrentCategoryIid[mStackDepth]);
-        trackevent->set_name_iid(mCurrentEventNameIid[mStackDepth]);
-        trackevent->set_type(::perfetto::protos::pbzero::TrackEvent::TYPE_SLICE_BEGIN);
-        endPacket();
-        ++mStackDepth;
+        uint8_t* packet = beginEventPacket();
+        endEventPacket(packet, writeSliceEventPacket(
+                packet, mEventPacketHeader, getTimestampDelta(),
+                mCategoryIid, iid,
+                ::perfetto::protos::pbzero::TrackEvent::TYPE_SLICE_BEGIN));
+        mSliceStack.push_back({ mCategoryIid, iid });
+    }
+
+    // Whether the next begin goes in the trace. If not, it is counted and so
+    // is its end, which is dropped to match.
+    bool canOpenSlice() {
+        if (CC_LIKELY(mSliceStack.size() < kMaxSliceStackDepth)) return true;
+        ++mOverflowedSlices;
+        sSliceStackOverflows.fetch_add(1, std::memory_order_relaxed);
+        sDroppedEvents.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    // Starts over with fresh per-thread state if tracing was restarted since
+    // this thread last wrote anything.
+    inline void ensureSession() __attribute__((always_inline)) {
+        uint64_t sessionId = sTracingSessionId.load(std::memory_order_relaxed);
+        if (CC_UNLIKELY(sessionId != mSessionId)) {
+            resetForSession(sessionId);
+        }
+        uint32_t generation = sIncrementalStateGeneration.load(std::memory_order_relaxed);
+        if (CC_UNLIKELY(generation != mIncrementalStateGeneration)) {
+            resetIncrementalState(generation);
+        }
     }
 
     inline void ensureThreadInfo() __attribute__((always_inline)) {
-        // Write trusted sequence id if this is the first packet.
-        if (CC_UNLIKELY(1 == __atomic_add_fetch(&sTraceConfig.packetsWritten, 1, __ATOMIC_SEQ_CST))) {
-            mFirst = true;
-            sTraceConfig.sequenceIdWritten = true;
-            beginPacket();
-            mPacket.set_trusted_packet_sequence_id(1);
-            mPacket.set_sequence_flags(1);
-            endPacket();
-        } else if (!CC_LIKELY(sTraceConfig.sequenceIdWritten)) { // Not the first packet, but some other thread is writing the sequence id at the moment, wait for it.
-            while (!sTraceConfig.sequenceIdWritten);
+        if (CC_UNLIKELY(mNeedToSetThreadId)) {
+            mThreadId = __atomic_add_fetch(&sTraceConfig.currentThreadId, 1, __ATOMIC_RELAXED);
+            mNeedToSetThreadId = false;
+            mNeedToDescribeThread = true;
+            // Each thread writes its own sequence, which startSequence() sets
+            // up, so no thread waits on another to start tracing and the
+            // chunks of different threads can be saved in any order.
+            mSequenceId = sNextSequenceId.fetch_add(1, std::memory_order_relaxed);
+            mEventPacketHeader = packetwriter::makeEventPacketHeader(mSequenceId);
+            fprintf(stderr, "%s: found thread id: %u\n", __func__, mThreadId);
+        }
+        if (CC_UNLIKELY(mNeedToStartSequence)) {
+            startSequence();
+        }
+        if (CC_UNLIKELY(mUseCpuClock)) {
+            ensureCpuClock();
         }
         // TODO: Allow changing category
         static const char kCategory[] = "gfxstream";
-        bool needEmitCategoryIntern = false;
-        mCurrentCategoryIid[mStackDepth] = internCategory(kCategory, &needEmitCategoryIntern);
-        if (CC_UNLIKELY(needEmitCategoryIntern)) {
+        static const uint32_t kCategoryIid = internStaticString(kCategory);
+        mCategoryIid = kCategoryIid;
+        if (CC_UNLIKELY(mNeedToEmitCategory)) {
+            mNeedToEmitCategory = false;
             beginPacket();
-            mPacket.set_trusted_packet_sequence_id(kSequenceId);
+            mPacket.set_trusted_packet_sequence_id(mSequenceId);
             mPacket.set_sequence_flags(2 /* incremental */);
             auto interned_data = mPacket.set_interned_data();
             auto category = interned_data->add_event_categories();
-            category->set_iid(mCurrentCategoryIid[mStackDepth]);
+            category->set_iid(mCategoryIid);
             category->set_name(kCategory);
             endPacket();
         }
-        if (CC_UNLIKELY(mNeedToSetThreadId)) {
-            mThreadId = __atomic_add_fetch(&sTraceConfig.currentThreadId, 1, __ATOMIC_RELAXED);
-            mNeedToSetThreadId = false;
-            fprintf(stderr, "%s: found thread id: %u\n", __func__, mThreadId);
+        if (CC_UNLIKELY(mNeedToDescribeThread)) {
+            mNeedToDescribeThread = false;
             beginPacket();
-            mPacket.set_trusted_packet_sequence_id(kSequenceId);
+            mPacket.set_trusted_packet_sequence_id(mSequenceId);
             mPacket.set_sequence_flags(2 /* incremental */);
             auto desc = mPacket.set_track_descriptor();
             desc->set_uuid(mThreadId);
@@ -231,37 +717,50 @@ public:
     }
     void endTrace() {
         if (CC_LIKELY(sTraceConfig.tracingDisabled)) return;
-        if (CC_UNLIKELY(mStackDepth == TRACE_STACK_DEPTH_MAX)) return;
-        if (CC_UNLIKELY(mStackDepth == 0)) return;
-        --mStackDepth;
-
-        ScopedTracingLock lock(&mTracingLock);
+        ensureSession();
+        if (CC_UNLIKELY(mOverflowedSlices || mSliceStack.empty())) {
+            // The end of a slice left out past the max depth, or of none.
+            if (mOverflowedSlices) --mOverflowedSlices;
+            sDroppedEvents.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        OpenSlice slice = mSliceStack.back();
+        mSliceStack.pop_back();
+        // The flight recorder may have dropped the sequence's start since the
+        // slice began.
+        if (CC_UNLIKELY(mNeedToStartSequence)) {
+            startSequence();
+        }
+        if (CC_UNLIKELY(mUseCpuClock)) {
+            ensureCpuClock();
+        }
 
         // Finally do the actual thing
-        beginPacket();
-        mPacket.set_trusted_packet_sequence_id(kSequenceId);
-        mPacket.set_sequence_flags(2 /* incremental */);
-        mPacket.set_timestamp(getTimestamp());
-        auto trackevent = mPacket.set_track_event();
-        trackevent->add_category_iids(mCurrentCategoryIid[mStackDepth]);
-        trackevent->set_track_uuid(mThreadId); // thread id
-        trackevent->set_name_iid(mCurrentEventNameIid[mStackDepth]);
-        trackevent->set_type(::perfetto::protos::pbzero::TrackEvent::TYPE_SLICE_END);
-        endPacket();
+        uint8_t* packet = beginEventPacket();
+        endEventPacket(packet, writeSliceEventPacket(
+                packet, mEventPacketHeader, getTimestampDelta(),
+                slice.categoryIid, slice.nameIid,
+                ::perfetto::protos::pbzero::TrackEvent::TYPE_SLICE_END));
     }
 
     void traceCounter(const char* name, int64_t val) {
         if (CC_LIKELY(sTraceConfig.tracingDisabled)) return;
-
-        ScopedTracingLock lock(&mTracingLock);
+        ensureSession();
 
         ensureThreadInfo();
         bool first;
         uint32_t counterId;
         uint64_t counterTrackUuid = getOrCreateCounterTrackUuid(name, &counterId, &first);
+        bool needDescriptor = first;
+        if (CC_UNLIKELY(!mUndescribedCounters.empty())) {
+            needDescriptor |= mUndescribedCounters.erase(name) > 0;
+        }
         if (CC_UNLIKELY(first)) {
             fprintf(stderr, "%s: thread id: %u has a counter: %u. uuid: 0x%llx\n", __func__, mThreadId, counterId, (unsigned long long)(counterTrackUuid));
+        }
+        if (CC_UNLIKELY(needDescriptor)) {
             beginPacket();
+            mPacket.set_trusted_packet_sequence_id(mSequenceId);
             auto desc = mPacket.set_track_descriptor();
             desc->set_uuid(counterTrackUuid);
             desc->set_name(getTrackNameFromThreadIdAndCounterName(mThreadId, name));
@@ -269,122 +768,126 @@ public:
             endPacket();
         }
         // Do the actual counter track event
-        beginPacket();
-        mPacket.set_trusted_packet_sequence_id(kSequenceId);
-        mPacket.set_sequence_flags(2 /* incremental */);
-        mPacket.set_timestamp(getTimestamp());
-        auto trackevent = mPacket.set_track_event();
-        trackevent->set_track_uuid(counterTrackUuid);
-        trackevent->set_type(::perfetto::protos::pbzero::TrackEvent::TYPE_COUNTER);
-        trackevent->set_counter_value(val);
-        endPacket();
-    }
-
-    void waitFinish() {
-        ScopedTracingLock lock(&mTracingLock);
+        uint8_t* packet = beginEventPacket();
+        endEventPacket(packet, writeCounterEventPacket(
+                packet, mEventPacketHeader, getTimestampDelta(), counterTrackUuid,
+                ::perfetto::protos::pbzero::TrackEvent::TYPE_COUNTER, val));
     }
 
 private:
-    class ScopedTracingLock {
-    public:
-        ScopedTracingLock(std::atomic_flag* flag) : mFlag(flag) {
-            while (mFlag->test_and_set(std::memory_order_acquire)) {
-                // spin
-            }
-        }
-
-        ~ScopedTracingLock() {
-            mFlag->clear(std::memory_order_release);
+    void resetForSession(uint64_t sessionId) {
+        // Whatever is left of the last session was saved when it ended.
+        if (mChunk) {
+            mChunks->completeChunk(mChunk);
+            mChunk = nullptr;
+            // So that the next packet sees no space and allocates a chunk.
+            mWriter.Reset(protozero::ContiguousMemoryRange{nullptr, nullptr});
         }
-    private:
-        std::atomic_flag* mFlag;
-    };
-
-    SavedTraceInfo saveLocked(bool partialReset) {
-        // Invalidates mTraceBuffer, transfers ownership of it.
-        SavedTraceInfo info = {
-            mTraceBuffer,
-            mTraceBufferSize,
-            size_t(((uintptr_t)mWriter.write_ptr()) - (uintptr_t)mTraceBuffer),
-            mFirst,
-        };
-
-        resetLocked(partialReset);
-
-        return info;
-    }
-
-    void resetLocked(bool partialReset) {
-        mTraceBuffer = nullptr;
-        mTraceBufferSize = 0;
-        mFirst = false;
-
-        if (partialReset) return;
+        mSessionId = sessionId;
 
+        mIncrementalStateGeneration = sIncrementalStateGeneration.load(std::memory_order_relaxed);
         mNeedToSetThreadId = true;
+        mNeedToDescribeThread = false;
         mThreadId = 0;
+        mSequenceId = 0;
         mNeedToConfigureGuestTime = true;
         mCurrentCounterId = 1;
         mTimeDiff = 0;
-        mStackDepth = 0;
-        mEventCategoryInterningIds.clear();
-        mEventNameInterningIds.clear();
+        mUseCpuClock = sCpuClock.running();
+        mCpuClockGeneration = 0;
+        mCpuClock = CpuClockCalibration();
+        mSliceStack.clear();
+        mOverflowedSlices = 0;
+        forgetEmittedInternedData();
         mCounterNameToTrackUuids.clear();
+        mUndescribedCounters.clear();
         mPacket.Reset(&mWriter);
     }
 
+    // The flight recorder dropped chunks that may have held what this thread
+    // interned or described; emit it again before it is next used. Slices
+    // still open keep their old iids, which their ends don't need.
+    void resetIncrementalState(uint32_t generation) {
+        mIncrementalStateGeneration = generation;
+        forgetEmittedInternedData();
+        mNeedToDescribeThread = !mNeedToSetThreadId;
+        for (const auto& it : mCounterNameToTrackUuids) {
+            mUndescribedCounters.insert(it.first);
+        }
+    }
+
     void finishAndRefresh() {
-        if (mTraceBuffer) {
-            sTraceStorage.saveTrace(saveLocked(true /* partial reset */));
+        // Completes the current chunk, if any.
+        bool completedChunk = mChunk != nullptr;
+        allocChunk();
+        if (completedChunk) {
+            sTraceStorage.onChunkCompleted();
         }
-        allocTraceBuffer();
     };
 
-    void allocTraceBuffer() {
-        // Freed after ownership is transferred to Trace Storage
-        mTraceBufferSize = sTraceConfig.perThreadStorageMb * 1048576;
-        mTraceBuffer = (uint8_t*)malloc(mTraceBufferSize);
-        mWriter.Reset(protozero::ContiguousMemoryRange{mTraceBuffer, mTraceBuffer + mTraceBufferSize});
+    void allocChunk() {
+        // Freed by the host writer once it has been written out.
+        mChunk = mChunks->appendChunk(sTraceConfig.perThreadStorageMb * 1048576, mSessionId);
+        mWriter.Reset(protozero::ContiguousMemoryRange{mChunk->data, mChunk->data + mChunk->size});
+    }
+
+    size_t writtenInChunk() const {
+        return size_t(((uintptr_t)mWriter.write_ptr()) - (uintptr_t)mChunk->data);
+    }
+
+    // Makes the packets written so far visible to the saver.
+    void commitPacket() {
+        mChunks->commit(mChunk, writtenInChunk());
     }
 
     inline uint64_t getTimestamp() {
-        uint64_t t = bootTimeNs();
+        uint64_t t = CC_UNLIKELY(mCpuClock.nsPerTickFixed) ?
+            mCpuClock.toBootTimeNs(readCpuTicks()) : bootTimeNs();
         t += sTraceConfig.guestTimeDiff;
         return t;
     }
 
-    template <typename T>
-    static inline uint8_t* writeVarInt(T value, uint8_t* target) {
-        // If value is <= 0 we must first sign extend to int64_t (see [1]).
-        // Finally we always cast to an unsigned value to to avoid arithmetic
-        // (sign expanding) shifts in the while loop.
-        // [1]: "If you use int32 or int64 as the type for a negative number, the
-        // resulting varint is always ten bytes long".
-        // - developers.google.com/protocol-buffers/docs/encoding
-        // So for each input type we do the following casts:
-        // uintX_t -> uintX_t -> uintX_t
-        // int8_t  -> int64_t -> uint64_t
-        // int16_t -> int64_t -> uint64_t
-        // int32_t -> int64_t -> uint64_t
-        // int64_t -> int64_t -> uint64_t
-        using MaybeExtendedType =
-            typename std::conditional<std::is_unsigned<T>::value, T, int64_t>::type;
-        using UnsignedType = typename std::make_unsigned<MaybeExtendedType>::type;
+    // Picks up the latest calibration of sCpuClock, and puts the one in use
+    // on the sequence as a BOOTTIME / raw cpu clock snapshot. Both are only
+    // needed every second or so, and after the sequence starts over. Until
+    // the session's first rate is published, timestamps are BOOTTIME and
+    // there is no snapshot to write.
+    void ensureCpuClock() {
+        uint32_t generation = sCpuClock.generation();
+        if (CC_LIKELY(generation == mCpuClockGeneration && !mNeedToEmitCpuClockSnapshot)) return;
+        if (generation != mCpuClockGeneration) {
+            mCpuClockGeneration = generation;
+            mCpuClock = sCpuClock.calibration(generation);
+        }
+        if (!mCpuClock.nsPerTickFixed) return;
+        mNeedToEmitCpuClockSnapshot = false;
 
-        MaybeExtendedType extended_value = static_cast<MaybeExtendedType>(value);
-        UnsignedType unsigned_value = static_cast<UnsignedType>(extended_value);
+        beginPacket();
+        mPacket.set_trusted_packet_sequence_id(mSequenceId);
+        mPacket.set_sequence_flags(2 /* incremental */);
+        auto snapshot = mPacket.set_clock_snapshot();
+        auto boottime = snapshot->add_clocks();
+        boottime->set_clock_id(6 /* BUILTIN_CLOCK_BOOTTIME */);
+        boottime->set_timestamp(mCpuClock.bootTimeNs + sTraceConfig.guestTimeDiff);
+        auto cpuClock = snapshot->add_clocks();
+        cpuClock->set_clock_id(CpuClock::kClockId);
+        cpuClock->set_timestamp(mCpuClock.ticks);
+        endPacket();
+    }
 
-        while (unsigned_value >= 0x80) {
-            *target++ = static_cast<uint8_t>(unsigned_value) | 0x80;
-            unsigned_value >>= 7;
-        }
-        *target = static_cast<uint8_t>(unsigned_value);
-        return target + 1;
+    // Time since the last event on the sequence, for kIncrementalClockId.
+    inline uint64_t getTimestampDelta() {
+        uint64_t t = getTimestamp();
+        // Never negative, even if the guest time diff moves the clock back.
+        if (CC_UNLIKELY(t < mLastTimestamp)) t = mLastTimestamp;
+        uint64_t delta = t - mLastTimestamp;
+        mLastTimestamp = t;
+        return delta;
     }
 
     void beginPacket() {
-        if (CC_UNLIKELY(mTraceBuffer == nullptr)) {
-            allocTraceBuffer();
+        if (CC_UNLIKELY(mChunk == nullptr)) {
+            allocChunk();
         }
 
         // Make sure there's enough space for the preamble and size field, and to hold a track event.
@@ -411,34 +914,89 @@ private:
     void endPacket() {
         mWritingPacket = false;
         mPacket.Finalize();
+        commitPacket();
     }
 
-    uint32_t internCategory(const char* str, bool* firstTime) {
-        auto it = mEventCategoryInterningIds.find(str);
-        if (it != mEventCategoryInterningIds.end()) {
-            *firstTime = false;
-            return it->second;
+    // Slice and counter events skip protozero (see vperfetto-packet-writer.h):
+    // one check for room, then the encoder writes straight into the chunk.
+    uint8_t* beginEventPacket() {
+        // No chunk yet means no space either.
+        if (CC_UNLIKELY(mWriter.bytes_available() < packetwriter::kMaxEventPacketSize)) {
+            finishAndRefresh();
         }
-        uint32_t res = sTraceConfig.currentInterningId;
-        mEventCategoryInterningIds[str] = res;
-        __atomic_add_fetch(&sTraceConfig.currentInterningId, 1, __ATOMIC_RELAXED);
-        *firstTime = true;
-        return res;
+        return mWriter.write_ptr();
     }
 
-    uint32_t internEvent(const char* str, bool* firstTime) {
-        auto it = mEventNameInterningIds.find(str);
-        if (it != mEventNameInterningIds.end()) {
-            *firstTime = false;
+    void endEventPacket(uint8_t* packet, uint8_t* end) {
+        mWriter.ReserveBytesUnsafe(size_t(end - packet));
+        commitPacket();
+    }
+
+    // Event names this thread has seen are cached by contents, so only new
+    // ones go to the shared table.
+    uint32_t internEvent(const char* str) {
+        std::string_view name(str);
+        auto it = mEventNameIids.find(name);
+        if (CC_LIKELY(it != mEventNameIids.end())) {
             return it->second;
         }
-        uint32_t res = sTraceConfig.currentInterningId;
-        mEventNameInterningIds[str] = res;
-        __atomic_add_fetch(&sTraceConfig.currentInterningId, 1, __ATOMIC_RELAXED);
-        *firstTime = true;
+        uint32_t res = sInternedStrings.intern(name.data(), name.size(), hashString(name.data(), name.size()));
+        // Elements of a deque stay put, so the keys can point into them.
+        mEventNames.emplace_back(name);
+        mEventNameIids.emplace(mEventNames.back(), res);
         return res;
     }
 
+    // Whether this thread has yet to emit the interned data for event name
+    // |iid| in this session. Marks it emitted.
+    bool needToEmitEventName(uint32_t iid) {
+        if (CC_UNLIKELY(iid >= mEmittedEventNames.size())) {
+            mEmittedEventNames.resize(iid + 1, 0);
+        }
+        if (CC_LIKELY(mEmittedEventNames[iid] == mEmittedStamp)) {
+            return false;
+        }
+        mEmittedEventNames[iid] = mEmittedStamp;
+        return true;
+    }
+
+    // Whatever was emitted on the sequence so far is to be treated as gone,
+    // and the sequence started over.
+    void forgetEmittedInternedData() {
+        ++mEmittedStamp;
+        mNeedToEmitCategory = true;
+        mNeedToStartSequence = true;
+    }
+
+    // Clears the sequence's incremental state and sets its defaults: events
+    // go on this thread's track, and their timestamps are deltas on
+    // kIncrementalClockId, which starts out at the current BOOTTIME.
+    void startSequence() {
+        mNeedToStartSequence = false;
+        if (mUseCpuClock) {
+            mCpuClockGeneration = sCpuClock.generation();
+            mCpuClock = sCpuClock.calibration(mCpuClockGeneration);
+            mNeedToEmitCpuClockSnapshot = true;
+        }
+        mLastTimestamp = getTimestamp();
+
+        beginPacket();
+        mPacket.set_trusted_packet_sequence_id(mSequenceId);
+        mPacket.set_sequence_flags(1 /* incremental state cleared */);
+        auto defaults = mPacket.set_trace_packet_defaults();
+        defaults->set_timestamp_clock_id(kIncrementalClockId);
+        defaults->set_track_event_defaults()->set_track_uuid(mThreadId);
+        auto snapshot = mPacket.set_clock_snapshot();
+        auto boottime = snapshot->add_clocks();
+        boottime->set_clock_id(6 /* BUILTIN_CLOCK_BOOTTIME */);
+        boottime->set_timestamp(mLastTimestamp);
+        auto incremental = snapshot->add_clocks();
+        incremental->set_clock_id(kIncrementalClockId);
+        incremental->set_timestamp(mLastTimestamp);
+        incremental->set_is_incremental(true);
+        endPacket();
+    }
+
     static std::string getTrackNameFromThreadId(uint32_t threadId) {
         std::stringstream ss;
         ss << kTrackNamePrefix << threadId;
@@ -470,87 +1028,320 @@ private:
         return res;
     }
 
-    uint8_t* mTraceBuffer = nullptr;
-    size_t mTraceBufferSize = 0;
-    bool mFirst = false;
+    std::unique_ptr<TraceChunkQueue> mChunks;
+    TraceChunk* mChunk = nullptr;
+    uint64_t mSessionId = 0;
+    uint32_t mIncrementalStateGeneration = 0;
     bool mWritingPacket = false;
     bool mNeedToSetThreadId = true;
+    bool mNeedToDescribeThread = false;
     uint32_t mThreadId = 0;
+    uint32_t mSequenceId = 0;
+    bool mNeedToStartSequence = true;
+    uint64_t mLastTimestamp = 0;
+    packetwriter::EventPacketHeader mEventPacketHeader;
     bool mNeedToConfigureGuestTime = true;
     uint32_t mCurrentCounterId = 1;
     uint64_t mTimeDiff = 0;
-    std::atomic_flag mTracingLock;
-    uint32_t mStackDepth = 0;
-    uint32_t mCurrentCategoryIid[TRACE_STACK_DEPTH_MAX];
-    uint32_t mCurrentEventNameIid[TRACE_STACK_DEPTH_MAX];
+    // Whether this session's timestamps come from sCpuClock, and the
+    // calibration they are converted with, if it has a rate yet.
+    bool mUseCpuClock = false;
+    uint32_t mCpuClockGeneration = 0;
+    CpuClockCalibration mCpuClock;
+    bool mNeedToEmitCpuClockSnapshot = false;
+    // A slice begun on this thread and not ended yet.
+    struct OpenSlice {
+        uint32_t categoryIid;
+        uint32_t nameIid;
+    };
+    // Innermost last. The capacity is kept, so it only ever grows.
+    std::vector<OpenSlice> mSliceStack;
+    // How many of the innermost open slices are past kMaxSliceStackDepth.
+    uint32_t mOverflowedSlices = 0;
+    // What new slices are in.
+    uint32_t mCategoryIid = 0;
     protozero::RootMessage<::perfetto::protos::pbzero::TracePacket> mPacket;
     protozero::ScatteredStreamWriter mWriter;
-    std::unordered_map<const char*, uint32_t> mEventCategoryInterningIds;
-    std::unordered_map<const char*, uint32_t> mEventNameInterningIds;
+    // Event name -> iid, kept across sessions like the iids themselves. The
+    // keys point into |mEventNames|, as the caller's string may not last.
+    std::deque<std::string> mEventNames;
+    std::unordered_map<std::string_view, uint32_t> mEventNameIids;
+    // Per iid, the value of |mEmittedStamp| when its interned data was last
+    // emitted; bumping the stamp forgets them all at once.
+    std::vector<uint32_t> mEmittedEventNames;
+    uint32_t mEmittedStamp = 1;
+    bool mNeedToEmitCategory = true;
     std::unordered_map<const char*, uint64_t> mCounterNameToTrackUuids;
+    std::unordered_set<const char*> mUndescribedCounters;
 };
 
 void asyncTraceSaveFunc() {
     fprintf(stderr, "%s: Saving combined trace async...\n", __func__);
 
-    static const int kWaitSecondsPerIteration = 1;
-    static const int kMaxIters = 20;
-    static const int kMinItersForGuestFileSize = 2;
-
     const char* hostFilename = sTraceConfig.hostFilename;
-    const char* guestFilename = sTraceConfig.guestFilename;
     const char* combinedFilename = sTraceConfig.combinedFilename;
 
-    std::streampos currGuestSize = 0;
-    int numGoodGuestFileSizeIters = 0;
-    bool good = false;
+    fprintf(stderr, "%s: Waiting for guest trace (%s)...\n", __func__,
+            sTraceConfig.guestFilename ? sTraceConfig.guestFilename : "streamed");
+    std::string guestPath;
+    if (!sGuestTraceWaiter.wait(sTraceConfig.guestFilename, sTraceConfig.guestTraceTimeoutMs, &guestPath)) {
+        fprintf(stderr, "%s: Timed out when waiting for guest trace, skipping combined trace saving.\n", __func__);
+        sTraceConfig.saving = false;
+        return;
+    }
 
-    for (int i = 0; i < kMaxIters; ++i) {
-        fprintf(stderr, "%s: Waiting for 1 second...\n", __func__);
-        std::this_thread::sleep_for(std::chrono::seconds(kWaitSecondsPerIteration));
-        fprintf(stderr, "%s: Querying file size of guest trace...\n", __func__);
-        std::ifstream guestFile(guestFilename, std::ios::in | std::ios::binary | std::ios::ate);
-        std::streampos size = guestFile.tellg();
+    std::ifstream hostFile(hostFilename, std::ios_base::binary);
+    std::ofstream combinedFile(combinedFilename, std::ios::out | std::ios_base::binary);
 
-        if (!size) {
-            fprintf(stderr, "%s: No size, try again\n", __func__);
-            continue;
+    {
+        std::lock_guard<std::mutex> lock(sGuestTraceLock);
+        if (sGuestTraceFinished) {
+            combinedFile.write(sGuestTrace.data(), sGuestTrace.size());
+            std::vector<char>().swap(sGuestTrace);
+        } else {
+            std::ifstream guestFile(guestPath, std::ios_base::binary);
+            combinedFile << guestFile.rdbuf();
         }
+    }
+    combinedFile << hostFile.rdbuf();
+
+    combinedFile.close();
+    hostFile.close();
 
-        if (size != currGuestSize) {
-            fprintf(stderr, "%s: Sized changed (%llu to %llu), try again\n", __func__,
-                    (unsigned long long)currGuestSize, (unsigned long long)size);
-            currGuestSize = size;
-            continue;
+    fprintf(stderr, "%s: Wrote combined trace (%s)\n", __func__, combinedFilename);
+    sTraceConfig.saving = false;
+}
+
+// Writes |count| buffers to |fd|, picking up after short writes.
+static bool writeAllv(int fd, struct iovec* iov, size_t count) {
+    while (count) {
+        ssize_t written = writev(fd, iov, (int)std::min<size_t>(count, IOV_MAX));
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        size_t left = (size_t)written;
+        while (count && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (left) {
+            iov->iov_base = (uint8_t*)iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+    return true;
+}
+
+void TraceStorage::startHostWriter() {
+    mFlightRecorder = sTraceConfig.flightRecorderKb != 0;
+    if (mFlightRecorder) {
+        fprintf(stderr, "%s: flight recorder mode, keeping the last %u KiB of host trace\n", __func__,
+                sTraceConfig.flightRecorderKb);
+    } else {
+        mHostFd = open(sTraceConfig.hostFilename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (mHostFd < 0) {
+            fprintf(stderr, "%s: error: could not open host trace file %s (errno %d), host trace will be dropped\n", __func__,
+                    sTraceConfig.hostFilename, errno);
         }
+    }
+
+    mChunksOverwritten = 0;
+    mBytesOverwritten = 0;
+    mStopWriter = false;
+    mWriterThread = std::thread(&TraceStorage::hostWriterLoop, this,
+                                sTracingSessionId.load(std::memory_order_relaxed));
+}
 
-        ++numGoodGuestFileSizeIters;
+void TraceStorage::stopHostWriter() {
+    if (!mWriterThread.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(mWriterLock);
+        mStopWriter = true;
+    }
+    mWriterWakeup.notify_one();
+    mWriterThread.join();
+}
 
-        if (numGoodGuestFileSizeIters == kMinItersForGuestFileSize) {
-            fprintf(stderr, "%s: size is stable, continue saving\n", __func__);
-            good = true;
-            break;
+void TraceStorage::hostWriterLoop(uint64_t sessionId) {
+    std::unique_lock<std::mutex> lock(mWriterLock);
+    while (!mStopWriter) {
+        mWriterWakeup.wait_for(lock, std::chrono::milliseconds(kHostWriterIntervalMs));
+        lock.unlock();
+        sCpuClock.recalibrateIfDue();
+        if (mFlightRecorder) {
+            recycleOldestChunks();
+        } else {
+            writeHostTrace(sessionId, true /* completeOnly */);
         }
+        lock.lock();
     }
+}
 
-    if (!good) {
-        fprintf(stderr, "%s: Timed out when waiting for guest file to stabilize, skipping combined trace saving.\n", __func__);
-        sTraceConfig.saving = false;
-        return;
+// Appends what threads have committed since the last call to the host trace
+// and frees the chunks that are done with. Threads keep tracing meanwhile;
+// |mContextsLock| is only held to find their chunks, not while writing.
+void TraceStorage::writeHostTrace(uint64_t sessionId, bool completeOnly) {
+    // Every thread's packets are on its own sequence and each queue is in
+    // order, so how the queues interleave in the file doesn't matter.
+    std::lock_guard<std::mutex> saveLock(mSaveLock);
+
+    std::vector<SavedTraceInfo> savedTraces;
+    auto collect = [&savedTraces](const uint8_t* data, size_t size) {
+        savedTraces.push_back({ data, size });
+    };
+
+    // Exited threads won't write any more; their chunks go once written.
+    std::vector<std::unique_ptr<TraceChunkQueue>> exitedThreadChunks;
+    {
+        std::lock_guard<std::mutex> lock(mContextsLock);
+        for (auto context: mContexts) {
+            context->chunks()->drain(sessionId, completeOnly, collect);
+        }
+        exitedThreadChunks.swap(mExitedThreadChunks);
+    }
+    for (const auto& chunks : exitedThreadChunks) {
+        chunks->drain(sessionId, false /* completeOnly */, collect);
     }
 
-    std::ifstream hostFile(hostFilename, std::ios_base::binary);
-    std::ifstream guestFile(guestFilename, std::ios_base::binary);
-    std::ofstream combinedFile(combinedFilename, std::ios::out | std::ios_base::binary);
+    std::vector<struct iovec> iov;
+    iov.reserve(savedTraces.size() + 1);
+    for (const auto& info : savedTraces) {
+        iov.push_back({ (void*)info.data, info.written });
+    }
+    // Only the last write of a session takes incomplete chunks; the file
+    // ends with the session's stats.
+    std::vector<uint8_t> stats;
+    if (!completeOnly) {
+        stats = encodeTraceStats();
+        iov.push_back({ stats.data(), stats.size() });
+    }
 
-    combinedFile << guestFile.rdbuf() << hostFile.rdbuf();
+    if (mHostFd >= 0 && !writeAllv(mHostFd, iov.data(), iov.size())) {
+        fprintf(stderr, "%s: error: failed to write host trace (errno %d), host trace will be dropped\n", __func__, errno);
+        close(mHostFd);
+        mHostFd = -1;
+    }
 
-    combinedFile.close();
-    guestFile.close();
-    hostFile.close();
+    {
+        std::lock_guard<std::mutex> lock(mContextsLock);
+        for (auto context: mContexts) {
+            context->chunks()->releaseSaved();
+        }
+    }
+}
 
-    fprintf(stderr, "%s: Wrote combined trace (%s)\n", __func__, combinedFilename);
-    sTraceConfig.saving = false;
+// Flight recorder only. Frees the oldest complete chunks until no more than
+// the budget is in use. Chunks threads are still writing to can't be taken, so
+// with less than a chunk per thread the budget is exceeded.
+void TraceStorage::recycleOldestChunks() {
+    size_t chunkSize = sTraceConfig.perThreadStorageMb * 1048576;
+    uint32_t budget = std::max<uint32_t>(1, (uint64_t)sTraceConfig.flightRecorderKb * 1024 / chunkSize);
+    uint32_t inUse = sTraceChunkPool.chunksInUse();
+    if (inUse <= budget) return;
+
+    std::lock_guard<std::mutex> saveLock(mSaveLock);
+    std::lock_guard<std::mutex> lock(mContextsLock);
+
+    std::vector<TraceChunk*> completeChunks;
+    auto collect = [&completeChunks](TraceChunk* chunk) { completeChunks.push_back(chunk); };
+    for (auto context: mContexts) {
+        context->chunks()->forEachUnsavedCompleteChunk(collect);
+    }
+    for (const auto& chunks : mExitedThreadChunks) {
+        chunks->forEachUnsavedCompleteChunk(collect);
+    }
+    if (completeChunks.empty()) return;
+
+    // Each queue's chunks are oldest first, so dropping the oldest overall
+    // only ever drops from the heads of the queues.
+    std::sort(completeChunks.begin(), completeChunks.end(),
+              [](const TraceChunk* a, const TraceChunk* b) { return a->serial < b->serial; });
+    size_t dropCount = std::min<size_t>(inUse - budget, completeChunks.size());
+    for (size_t i = 0; i < dropCount; ++i) {
+        mBytesOverwritten += completeChunks[i]->committed.load(std::memory_order_acquire) - completeChunks[i]->saved;
+        TraceChunkQueue::discard(completeChunks[i]);
+    }
+    mChunksOverwritten += dropCount;
+    sIncrementalStateGeneration.fetch_add(1, std::memory_order_relaxed);
+
+    for (auto context: mContexts) {
+        context->chunks()->releaseSaved();
+    }
+    auto it = std::remove_if(mExitedThreadChunks.begin(), mExitedThreadChunks.end(),
+                             [](const std::unique_ptr<TraceChunkQueue>& chunks) { return chunks->allSaved(); });
+    mExitedThreadChunks.erase(it, mExitedThreadChunks.end());
+}
+
+// A trace of one packet with this session's TraceStats so far, so that a lossy
+// trace says so: events left out by the slice stacks count as trace writer
+// packet loss, and chunks the flight recorder dropped as overwritten.
+std::vector<uint8_t> TraceStorage::encodeTraceStats() {
+    uint64_t droppedEvents = sDroppedEvents.load(std::memory_order_relaxed);
+    uint64_t sliceStackOverflows = sSliceStackOverflows.load(std::memory_order_relaxed);
+    if (droppedEvents || mChunksOverwritten) {
+        fprintf(stderr, "%s: warning: trace is lossy: %llu events dropped (%llu slices past max depth), "
+                        "%llu chunks overwritten\n", __func__,
+                (unsigned long long)droppedEvents, (unsigned long long)sliceStackOverflows,
+                (unsigned long long)mChunksOverwritten);
+    }
+
+    protozero::HeapBuffered<::perfetto::protos::pbzero::Trace> trace;
+    auto bufferStats = trace->add_packet()->set_trace_stats()->add_buffer_stats();
+    bufferStats->set_trace_writer_packet_loss(droppedEvents);
+    bufferStats->set_chunks_overwritten(mChunksOverwritten);
+    bufferStats->set_bytes_overwritten(mBytesOverwritten);
+    return trace.SerializeAsArray();
+}
+
+// Flight recorder only. Writes what threads have committed and the recycler
+// has not dropped to |filename|, leaving it all in place.
+bool TraceStorage::writeSnapshot(const char* filename, uint64_t sessionId) {
+    std::lock_guard<std::mutex> saveLock(mSaveLock);
+
+    std::vector<SavedTraceInfo> savedTraces;
+    auto collect = [&savedTraces](const uint8_t* data, size_t size) {
+        savedTraces.push_back({ data, size });
+    };
+    {
+        // Only the saver frees chunks, so they stay valid without
+        // |mContextsLock| once collected.
+        std::lock_guard<std::mutex> lock(mContextsLock);
+        for (auto context: mContexts) {
+            context->chunks()->snapshot(sessionId, collect);
+        }
+        for (const auto& chunks : mExitedThreadChunks) {
+            chunks->snapshot(sessionId, collect);
+        }
+    }
+
+    // Threads whose sequence start was dropped emit it again on their next
+    // event (see resetIncrementalState()); until then, trace processor
+    // skips what they wrote.
+    std::vector<struct iovec> iov;
+    iov.reserve(savedTraces.size() + 1);
+    for (const auto& info : savedTraces) {
+        iov.push_back({ (void*)info.data, info.written });
+    }
+    std::vector<uint8_t> stats = encodeTraceStats();
+    iov.push_back({ stats.data(), stats.size() });
+
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "%s: error: could not open %s (errno %d)\n", __func__, filename, errno);
+        return false;
+    }
+    bool written = writeAllv(fd, iov.data(), iov.size());
+    if (!written) {
+        fprintf(stderr, "%s: error: failed to write %s (errno %d)\n", __func__, filename, errno);
+    }
+    close(fd);
+    return written;
+}
+
+bool TraceStorage::snapshotToFile(const char* filename) {
+    return writeSnapshot(filename, sTracingSessionId.load(std::memory_order_relaxed));
 }
 
 void TraceStorage::saveTracesToDisk() {
@@ -562,40 +1353,30 @@ void TraceStorage::saveTracesToDisk() {
 
     fprintf(stderr, "%s: Saving host trace first...\n", __func__);
 
-    std::lock_guard<std::mutex> lock(mContextsLock);
-
-    for (auto context: mContexts) {
-        saveTraceLocked(context->save());
-    };
-
-    std::ofstream hostOut;
-    hostOut.open(sTraceConfig.hostFilename, std::ios::out | std::ios::binary);
-
-    for (const auto& info : mSavedTraces) {
-        if (info.first) {
-            hostOut.write((const char*)(info.data), info.written);
-        }
+    // Complete chunks are already on disk; only the ones threads are still
+    // writing to are left. In flight recorder mode, the host file is a
+    // snapshot of the ring, and the ring is then emptied without writing it
+    // again.
+    stopHostWriter();
+    uint64_t sessionId = sTracingSessionId.load(std::memory_order_relaxed);
+    if (mFlightRecorder) {
+        writeSnapshot(sTraceConfig.hostFilename, sessionId);
     }
-
-    for (const auto& info : mSavedTraces) {
-        if (!info.first) {
-            hostOut.write((const char*)(info.data), info.written);
-        }
-        free(info.data);
+    writeHostTrace(sessionId, false /* completeOnly */);
+    if (mHostFd >= 0) {
+        close(mHostFd);
+        mHostFd = -1;
     }
 
-    hostOut.close();
-
-    mSavedTraces.clear();
+    // Keep what the next session will prefault anyway; let the rest go.
+    sTraceChunkPool.trim(sTraceConfig.chunkPoolPrefaultChunks);
 
     fprintf(stderr, "%s: Saving host trace first...(done)\n", __func__);
 
-    if (!sTraceConfig.guestFilename || !sTraceConfig.combinedFilename) {
+    // Without a guest file name, the guest trace is to be streamed in.
+    if (!sTraceConfig.combinedFilename) {
         fprintf(stderr, "%s: skipping guest combined trace, "
-                        "either guest file name (%p) not specified or "
-                        "combined file name (%p) not specified\n", __func__,
-                sTraceConfig.guestFilename,
-                sTraceConfig.combinedFilename);
+                        "combined file name not specified\n", __func__);
         sTraceConfig.saving = false;
         return;
     }
@@ -611,7 +1392,13 @@ VPERFETTO_EXPORT void setTraceConfig(std::function<void(VirtualDeviceTraceConfig
 }
 
 VPERFETTO_EXPORT VirtualDeviceTraceConfig queryTraceConfig() {
-    return sTraceConfig;
+    VirtualDeviceTraceConfig config = sTraceConfig;
+    config.currentInterningId = sInternedStrings.nextIid();
+    config.chunkPoolSize = sTraceChunkPool.size();
+    config.chunkPoolHighWaterMark = sTraceChunkPool.highWaterMark();
+    config.droppedEvents = sDroppedEvents.load(std::memory_order_relaxed);
+    config.sliceStackOverflows = sSliceStackOverflows.load(std::memory_order_relaxed);
+    return config;
 }
 
 VPERFETTO_EXPORT void initialize(const bool** tracingDisabledPtr) {
@@ -657,13 +1444,33 @@ VPERFETTO_EXPORT void enableTracing() {
     fprintf(stderr, "%s: combined filename: %s (possibly set via $VPERFETTO_COMBINED_FILE)\n", __func__, sTraceConfig.combinedFilename);
     fprintf(stderr, "%s: guest time diff to add to host time: %lld\n", __func__, (long long)sTraceConfig.guestTimeDiff);
 
-    sTraceConfig.packetsWritten = 0;
-    sTraceConfig.sequenceIdWritten = 0;
-    sTraceConfig.currentInterningId = 1;
     sTraceConfig.currentThreadId = 1;
+    sNextSequenceId.store(1, std::memory_order_relaxed);
+    sDroppedEvents.store(0, std::memory_order_relaxed);
+    sSliceStackOverflows.store(0, std::memory_order_relaxed);
+    sGuestTraceWaiter.reset();
+    {
+        std::lock_guard<std::mutex> lock(sGuestTraceLock);
+        std::vector<char>().swap(sGuestTrace);
+        sGuestTraceFinished = false;
+    }
+
+    sTraceChunkPool.prefault(sTraceConfig.chunkPoolPrefaultChunks,
+                             sTraceConfig.perThreadStorageMb * 1048576);
 
+    if (sTraceConfig.rawCpuClock) {
+        if (hasCpuTicks()) {
+            sCpuClock.start();
+            fprintf(stderr, "%s: timestamps from the raw cpu clock\n", __func__);
+        } else {
+            fprintf(stderr, "%s: warning: no raw cpu clock on this architecture, using BOOTTIME\n", __func__);
+        }
+    }
+
+    sTracingSessionId.fetch_add(1, std::memory_order_relaxed);
     sTraceStorage.onTracingEnabled();
     sTraceConfig.tracingDisabled = 0;
+    gTracingEnabled.store(true, std::memory_order_relaxed);
 }
 
 VPERFETTO_EXPORT void disableTracing() {
@@ -672,25 +1479,101 @@ VPERFETTO_EXPORT void disableTracing() {
 
     uint32_t tracingWasDisabled = sTraceConfig.tracingDisabled;
     sTraceConfig.tracingDisabled = 1;
+    gTracingEnabled.store(false, std::memory_order_relaxed);
 
     if (!tracingWasDisabled) {
-        // Set saving on
-        sTraceConfig.saving = false;
+        // Set saving on; saving the host trace, or combining it after, turns it off.
+        sTraceConfig.saving = true;
         sTraceStorage.onTracingDisabled();
+        sCpuClock.stop();
     }
 
-    sTraceConfig.packetsWritten = 0;
-    sTraceConfig.sequenceIdWritten = 0;
-    sTraceConfig.currentInterningId = 1;
     sTraceConfig.currentThreadId = 1;
     sTraceConfig.guestTimeDiff = 0;
 }
 
+// There is no session to start; tracing is on when this returns.
+VPERFETTO_EXPORT void enableTracingAsync(std::function<void()> onStarted) {
+    uint32_t tracingWasDisabled = sTraceConfig.tracingDisabled;
+    enableTracing();
+    if (tracingWasDisabled && !sTraceConfig.tracingDisabled && onStarted) onStarted();
+}
+
+// Threads stop tracing right away; writing out the chunks they still hold is
+// left to a thread of its own.
+VPERFETTO_EXPORT void disableTracingAsync(std::function<void()> onSaved) {
+    if (!sTraceConfig.hostFilename || sTraceConfig.tracingDisabled) return;
+
+    sTraceConfig.tracingDisabled = 1;
+    gTracingEnabled.store(false, std::memory_order_relaxed);
+    sTraceConfig.saving = true;
+    std::thread saveThread([onSaved]() {
+        sTraceStorage.onTracingDisabled();
+        sCpuClock.stop();
+        waitSavingDone();
+        if (onSaved) onSaved();
+    });
+    saveThread.detach();
+
+    sTraceConfig.currentThreadId = 1;
+    sTraceConfig.guestTimeDiff = 0;
+}
+
+VPERFETTO_EXPORT void notifyGuestTraceReady(const char* guestFilename) {
+    sGuestTraceWaiter.notifyReady(guestFilename);
+}
+
+VPERFETTO_EXPORT void pushGuestTraceChunk(const void* data, size_t size) {
+    std::lock_guard<std::mutex> lock(sGuestTraceLock);
+    if (sGuestTraceFinished) {
+        fprintf(stderr, "%s: warning: guest trace already finished, dropping %zu bytes\n", __func__, size);
+        return;
+    }
+    const char* bytes = static_cast<const char*>(data);
+    sGuestTrace.insert(sGuestTrace.end(), bytes, bytes + size);
+}
+
+VPERFETTO_EXPORT void finishGuestTrace() {
+    {
+        std::lock_guard<std::mutex> lock(sGuestTraceLock);
+        sGuestTraceFinished = true;
+    }
+    sGuestTraceWaiter.notifyReady(nullptr);
+}
+
+VPERFETTO_EXPORT bool snapshotTrace(const char* hostFilename, const char* guestFilename, const char* combinedFilename) {
+    if (sTraceConfig.tracingDisabled || !sTraceConfig.flightRecorderKb) {
+        fprintf(stderr, "%s: error: snapshots need tracing on in flight recorder mode\n", __func__);
+        return false;
+    }
+
+    fprintf(stderr, "%s: Saving host trace snapshot (%s)...\n", __func__, hostFilename);
+    if (!sTraceStorage.snapshotToFile(hostFilename)) return false;
+
+    if (guestFilename && combinedFilename) {
+        std::ifstream hostFile(hostFilename, std::ios_base::binary);
+        std::ifstream guestFile(guestFilename, std::ios_base::binary);
+        std::ofstream combinedFile(combinedFilename, std::ios::out | std::ios_base::binary);
+        combinedFile << guestFile.rdbuf() << hostFile.rdbuf();
+        fprintf(stderr, "%s: Wrote combined trace (%s)\n", __func__, combinedFilename);
+    }
+    return true;
+}
+
 VPERFETTO_EXPORT void beginTrace(const char* name) {
     if (CC_LIKELY(sTraceConfig.tracingDisabled)) return;
     sThreadLocalTraceContext.beginTrace(name);
 }
 
+VPERFETTO_EXPORT uint32_t internStaticEventName(const char* name) {
+    return internStaticString(name);
+}
+
+VPERFETTO_EXPORT void beginStaticTrace(const StaticEventName& name) {
+    if (CC_LIKELY(sTraceConfig.tracingDisabled)) return;
+    sThreadLocalTraceContext.beginTrace(name.iid(), name.name());
+}
+
 VPERFETTO_EXPORT void endTrace() {
     if (CC_LIKELY(sTraceConfig.tracingDisabled)) return;
     sThreadLocalTraceContext.endTrace();
@@ -701,6 +1584,17 @@ VPERFETTO_EXPORT void traceCounter(const char* name, int64_t val) {
     sThreadLocalTraceContext.traceCounter(name, val);
 }
 
+// Counter tracks are per thread here (see TraceContext::traceCounter()), so
+// there is no track to resolve up front.
+VPERFETTO_EXPORT uint64_t internStaticCounterName(const char*) {
+    return 0;
+}
+
+VPERFETTO_EXPORT void traceStaticCounter(const StaticCounterName& counterName, int64_t val) {
+    if (CC_LIKELY(sTraceConfig.tracingDisabled)) return;
+    sThreadLocalTraceContext.traceCounter(counterName.name(), val);
+}
+
 VPERFETTO_EXPORT void setGuestTime(uint64_t t) {
     vperfetto::setTraceConfig([t](vperfetto::VirtualDeviceTraceConfig& config) {
         // can only be set before tracing
@@ -723,7 +1617,7 @@ VPERFETTO_EXPORT void sleepUs(unsigned interval) {
 
 VPERFETTO_EXPORT void waitSavingDone() {
     while (sTraceConfig.saving) {
-        sleepUs(1000000);
+        sleepUs(10000);
     }
 }
 
@@ -11,7 +11,9 @@
 // WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
 // See the License for the specific language governing permissions and
 // limitations under the License.
+#include <atomic>
 #include <functional>
+#include <cstddef>
 #include <cstdint>
 
 // Convenient declspec dllexport macro for android-emu-shared on Windows
@@ -23,13 +25,27 @@
     #endif // !_MSC_VER
 #endif // !VPERFETTO_EXPORT
 
+// For data, which unlike functions has to be imported explicitly on the consumer side on
+// MSVC. The library's own sources are built with VPERFETTO_BUILDING defined.
+#ifndef VPERFETTO_DATA_EXPORT
+    #ifdef _MSC_VER
+        #ifdef VPERFETTO_BUILDING
+            #define VPERFETTO_DATA_EXPORT __declspec(dllexport)
+        #else // VPERFETTO_BUILDING
+            #define VPERFETTO_DATA_EXPORT __declspec(dllimport)
+        #endif // !VPERFETTO_BUILDING
+    #else // _MSC_VER
+        #define VPERFETTO_DATA_EXPORT __attribute__((visibility("default")))
+    #endif // !_MSC_VER
+#endif // !VPERFETTO_DATA_EXPORT
+
 namespace vperfetto {
 
 struct VirtualDeviceTraceConfig {
     bool initialized;
     bool tracingDisabled;
-    uint32_t packetsWritten;
-    bool sequenceIdWritten;
+    uint32_t packetsWritten;     // Unused since threads write their own sequences. Deprecated.
+    bool sequenceIdWritten;      // Unused since threads write their own sequences. Deprecated.
     uint32_t currentInterningId;
     uint32_t currentThreadId;
     const char* hostFilename;
@@ -41,6 +57,53 @@ struct VirtualDeviceTraceConfig {
     uint32_t perThreadStorageMb;
     bool saving;
     bool addTraces;
+
+    // How long, in ms, disableTracing() waits for the guest trace to arrive
+    // before giving up on the combined trace. 0 waits 20 seconds. See
+    // notifyGuestTraceReady().
+    uint32_t guestTraceTimeoutMs;
+
+    // SDK build only. With a combinedFilename and the guest trace streamed in
+    // through pushGuestTraceChunk(), guest packets are moved into host time
+    // and written to the combined trace as they arrive, from enableTracing()
+    // on. Once the guest trace is finished, disableTracing() only has the host
+    // trace left to append. Unlike the default, the result is in host time.
+    bool onlineCombine;
+
+    // SDK build only. When non-zero, the tracing service writes the host trace into hostFilename
+    // about this often while tracing, so disableTracing() neither holds nor copies the whole trace
+    // in memory; combining maps the file instead. Ignored in flight recorder mode.
+    uint32_t hostFileWritePeriodMs;
+
+    // Flight recorder mode. When non-zero, host tracing keeps only about the
+    // last |flightRecorderKb| KiB in memory, overwriting the oldest data, and
+    // nothing reaches the host file until snapshotTrace() or disableTracing().
+    // 0 records the whole session.
+    uint32_t flightRecorderKb;
+
+    // Non-SDK build only. Per-thread trace chunks (perThreadStorageMb each)
+    // come from a pool; this many are allocated and faulted in up front when
+    // tracing is enabled and kept around between sessions.
+    uint32_t chunkPoolPrefaultChunks;
+    // Filled in by queryTraceConfig(): chunks currently allocated by the pool
+    // and the most that were ever in use at once.
+    uint32_t chunkPoolSize;
+    uint32_t chunkPoolHighWaterMark;
+
+    // Non-SDK build only, filled in by queryTraceConfig() for the current or
+    // last session. Events left out of the trace: ends without a begin, and
+    // both ends of slices nested too deep, which |sliceStackOverflows| counts.
+    // The trace's stats packet has them too.
+    uint64_t droppedEvents;
+    uint64_t sliceStackOverflows;
+
+    // Non-SDK build only. Stamps events from the CPU's counter (TSC or
+    // cntvct_el0) instead of reading BOOTTIME each time. The counter is
+    // calibrated against BOOTTIME about once a second and events are still
+    // written in BOOTTIME ns; each thread's sequence gets snapshots of the
+    // two clocks, which combining uses for CPU time sync with the guest.
+    // Ignored where there is no such counter.
+    bool rawCpuClock;
 };
 
 // Workflow:
@@ -77,13 +140,130 @@ VPERFETTO_EXPORT void enableTracing();
 // After waiting for a while, the guest/host traces are post processed and catted together into VPERFETTO_COMBINED_FILE.
 VPERFETTO_EXPORT void disableTracing();
 
+// enableTracing()/disableTracing() for threads that can't wait on them, like a VMM's virtio-gpu
+// command thread: they return right away. In the SDK build the session starts and stops on the
+// tracing service's thread, and after stopping, a thread of its own reads out and saves the traces.
+// |onStarted| is called once the session is running; |onSaved| once saving is done, as
+// waitSavingDone() would return. Neither is called if the call did nothing, e.g. tracing was already
+// on. The non-SDK build has no session to wait for and only saves on another thread.
+VPERFETTO_EXPORT void enableTracingAsync(std::function<void()> onStarted = nullptr);
+VPERFETTO_EXPORT void disableTracingAsync(std::function<void()> onSaved = nullptr);
+
+// The guest trace is complete, at |guestFilename| if given (otherwise the configured one), so the
+// combined trace can be written now. Without this, combining waits for the guest file to be closed
+// or renamed into place (Linux), or for its size to stop changing, up to guestTraceTimeoutMs. Can be
+// called before disableTracing().
+VPERFETTO_EXPORT void notifyGuestTraceReady(const char* guestFilename = nullptr);
+
+// The guest trace as it arrives (over vsock, say) instead of through a file: push its bytes in
+// order, then finish. Leave guestFilename unset and set combinedFilename; the combined trace is
+// written once finishGuestTrace() is called, without the guest trace going through a file. In
+// the SDK build the guest packets are scanned as they come in, so only the host trace is left to
+// go over then. Can start before disableTracing().
+VPERFETTO_EXPORT void pushGuestTraceChunk(const void* data, size_t size);
+VPERFETTO_EXPORT void finishGuestTrace();
+
+// Flight recorder mode only: writes the host trace currently held in memory to
+// |hostFilename| without stopping tracing. If |guestFilename| and
+// |combinedFilename| are given, the (complete) guest trace is combined with
+// it into |combinedFilename| as disableTracing() would. Returns false if
+// tracing is not on in flight recorder mode or the host trace could not be
+// written.
+// Snapshots leave the recorded events in place, so the next snapshot and the
+// host trace disableTracing() writes show them again until newer events push
+// them out. In the SDK build, only events that threads have handed over to the
+// tracing service are included.
+VPERFETTO_EXPORT bool snapshotTrace(const char* hostFilename,
+                                    const char* guestFilename = nullptr,
+                                    const char* combinedFilename = nullptr);
+
 // Start/end a particular track event on the host. By default, every such event is in the 'gfx' category.
 VPERFETTO_EXPORT void beginTrace(const char* eventName);
 VPERFETTO_EXPORT void endTrace();
 
-// Record a counter. This currently doesn't work with the -sdk.cpp implementation. TODO(lfy): add it
+// True from when enableTracing() has started tracing until disableTracing() stops it. Read inline by
+// the calls below, so instrumentation left in with tracing off costs a load and a predictable branch
+// instead of a call into the library.
+extern VPERFETTO_DATA_EXPORT std::atomic<bool> gTracingEnabled;
+
+inline bool tracingEnabled() {
+    return gTracingEnabled.load(std::memory_order_relaxed);
+}
+
+inline void beginTraceIfEnabled(const char* eventName) {
+    if (tracingEnabled()) beginTrace(eventName);
+}
+
+inline void endTraceIfEnabled() {
+    if (tracingEnabled()) endTrace();
+}
+
+// An event name interned once, up front. Tracing with it skips the per-call name lookup that
+// beginTrace(const char*) does. Use through VPERFETTO_SCOPED_TRACE/VPERFETTO_BEGIN_TRACE, which keep
+// one in a function-local static.
+VPERFETTO_EXPORT uint32_t internStaticEventName(const char* eventName);
+
+class StaticEventName {
+public:
+    explicit StaticEventName(const char* eventName) :
+        mName(eventName), mIid(internStaticEventName(eventName)) { }
+
+    const char* name() const { return mName; }
+    uint32_t iid() const { return mIid; }
+
+private:
+    const char* mName;
+    uint32_t mIid;
+};
+
+VPERFETTO_EXPORT void beginStaticTrace(const StaticEventName& eventName);
+
+// Ends the event on scope exit, if tracing was on to begin it.
+class ScopedTrace {
+public:
+    explicit ScopedTrace(const StaticEventName& eventName) : mBegun(tracingEnabled()) {
+        if (mBegun) beginStaticTrace(eventName);
+    }
+    ~ScopedTrace() {
+        if (mBegun) endTrace();
+    }
+
+    ScopedTrace(const ScopedTrace&) = delete;
+    ScopedTrace& operator=(const ScopedTrace&) = delete;
+
+private:
+    bool mBegun;
+};
+
+// Record a counter. Each counter name gets its own track. The SDK build keys the tracks on the
+// name's contents; the non-SDK build keys them on the pointer, so there names are expected to be
+// string literals.
 VPERFETTO_EXPORT void traceCounter(const char* name, int64_t value);
 
+inline void traceCounterIfEnabled(const char* name, int64_t value) {
+    if (tracingEnabled()) traceCounter(name, value);
+}
+
+// A counter name whose track is looked up once, up front. In the SDK build, tracing with it skips the
+// per-sample track lookup that traceCounter() does. Use through VPERFETTO_TRACE_COUNTER, which keeps
+// one in a function-local static.
+VPERFETTO_EXPORT uint64_t internStaticCounterName(const char* name);
+
+class StaticCounterName {
+public:
+    explicit StaticCounterName(const char* name) :
+        mName(name), mTrackId(internStaticCounterName(name)) { }
+
+    const char* name() const { return mName; }
+    uint64_t trackId() const { return mTrackId; }
+
+private:
+    const char* mName;
+    uint64_t mTrackId;
+};
+
+VPERFETTO_EXPORT void traceStaticCounter(const StaticCounterName& counterName, int64_t value);
+
 // Miscellanous APIs that are useful but fall outside the standard workflow
 // Obtains BOOTTIME nanoseconds the way perfetto sdk calculates it.
 VPERFETTO_EXPORT uint64_t bootTimeNs();
@@ -117,6 +297,15 @@ struct TraceCombineConfig {
 
     // Simply display the two separate traces in one trace. Do not modify them in any way.
     bool addTraces;
+
+    // Leave the BOOTTIME timestamps of the trace being merged in as they are (ftrace aside) and add
+    // a clock snapshot per sequence that puts them on the other trace's time base, which trace
+    // processor applies when loading the trace. Saves rewriting every track event's timestamp.
+    bool useClockSnapshots = false;
+
+    // Number of threads rewriting the packets of the trace being merged in.
+    // 0 uses one per hardware thread.
+    uint32_t jobs = 1;
 };
 
 // Reads config.guestFile
@@ -125,3 +314,30 @@ struct TraceCombineConfig {
 void combineTraces(const TraceCombineConfig* config);
 
 } // namespace vperfetto
+
+#define VPERFETTO_CONCAT_IMPL(a, b) a##b
+#define VPERFETTO_CONCAT(a, b) VPERFETTO_CONCAT_IMPL(a, b)
+
+// Traces the rest of the enclosing scope as event |eventName|, which must be a string literal.
+#define VPERFETTO_SCOPED_TRACE(eventName) \
+    static const ::vperfetto::StaticEventName VPERFETTO_CONCAT(vperfettoEventName, __LINE__)(eventName); \
+    ::vperfetto::ScopedTrace VPERFETTO_CONCAT(vperfettoScopedTrace, __LINE__)(VPERFETTO_CONCAT(vperfettoEventName, __LINE__))
+
+// traceCounter() for a string literal, its track looked up on first use while tracing.
+#define VPERFETTO_TRACE_COUNTER(name, value) \
+    do { \
+        if (::vperfetto::tracingEnabled()) { \
+            static const ::vperfetto::StaticCounterName vperfettoCounterName(name); \
+            ::vperfetto::traceStaticCounter(vperfettoCounterName, value); \
+        } \
+    } while (0)
+
+// beginTrace() for a string literal, interned on first use while tracing; pair with
+// endTraceIfEnabled().
+#define VPERFETTO_BEGIN_TRACE(eventName) \
+    do { \
+        if (::vperfetto::tracingEnabled()) { \
+            static const ::vperfetto::StaticEventName vperfettoEventName(eventName); \
+            ::vperfetto::beginStaticTrace(vperfettoEventName); \
+        } \
+    } while (0)
@@ -0,0 +1,201 @@
+// Copyright 2020 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "vperfetto.h"
+
+#ifdef VPERFETTO_BENCHMARK_PACKET_ENCODERS
+#include "vperfetto-cpu-clock.h"
+#include "vperfetto-packet-writer.h"
+#include "perfetto-min/protos/perfetto/trace/trace_packet.pbzero.h"
+#include "perfetto-min/protos/perfetto/trace/track_event/track_event.pbzero.h"
+#include "perfetto/protozero/proto_utils.h"
+#include "perfetto/protozero/root_message.h"
+#include "perfetto/protozero/scattered_stream_writer.h"
+#endif
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+
+// Per-call cost of the host tracing entry points while a session is recording.
+// Non-SDK builds also time encoding a slice packet with protozero against the
+// encoders in vperfetto-packet-writer.h, and reading BOOTTIME against the
+// rawCpuClock conversion.
+//
+// Usage: vperfetto_benchmark [iterations]
+
+namespace {
+
+template <typename Body>
+double nsPerCall(uint32_t iterations, Body body) {
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < iterations; ++i) {
+        body(i);
+    }
+    auto end = std::chrono::steady_clock::now();
+    return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / iterations;
+}
+
+void report(const char* name, double ns) {
+    fprintf(stderr, "%-32s %8.1f ns\n", name, ns);
+}
+
+#ifdef VPERFETTO_BENCHMARK_PACKET_ENCODERS
+
+// Packets go round a fixed buffer; both encoders start over when it is nearly
+// full, as they would at the end of a chunk.
+static uint8_t sPacketBuffer[1 << 20];
+
+class RewindingDelegate : public protozero::ScatteredStreamWriter::Delegate {
+public:
+    protozero::ContiguousMemoryRange GetNewBuffer() override {
+        return protozero::ContiguousMemoryRange{sPacketBuffer, sPacketBuffer + sizeof(sPacketBuffer)};
+    }
+};
+
+void reportPacketEncoders(uint32_t iterations) {
+    using ::perfetto::protos::pbzero::TrackEvent;
+
+    RewindingDelegate delegate;
+    protozero::ScatteredStreamWriter writer(&delegate);
+    writer.Reset(delegate.GetNewBuffer());
+    protozero::RootMessage<::perfetto::protos::pbzero::TracePacket> packet;
+
+    // What TraceContext did for every slice before the direct encoder.
+    double protozeroNs = nsPerCall(iterations, [&](uint32_t i) {
+        if (writer.bytes_available() < 256) {
+            writer.Reset(delegate.GetNewBuffer());
+        }
+        packet.Reset(&writer);
+        constexpr uint32_t tag = protozero::proto_utils::MakeTagLengthDelimited(1 /* trace packet id */);
+        uint8_t tagScratch[10];
+        auto scratchNext = vperfetto::writeVarInt(tag, tagScratch);
+        writer.WriteBytes(tagScratch, scratchNext - tagScratch);
+        uint8_t* header = writer.ReserveBytes(4);
+        memset(header, 0, 4);
+        packet.set_size_field(header);
+        packet.set_trusted_packet_sequence_id(1);
+        packet.set_sequence_flags(2);
+        packet.set_timestamp(1000000000ULL + i);
+        auto trackevent = packet.set_track_event();
+        trackevent->set_track_uuid(2);
+        trackevent->add_category_iids(1);
+        trackevent->set_name_iid(3);
+        trackevent->set_type(TrackEvent::TYPE_SLICE_BEGIN);
+        packet.Finalize();
+    });
+
+    // The direct encoder leaves the track to the sequence's defaults and
+    // writes a timestamp delta.
+    auto header = vperfetto::packetwriter::makeEventPacketHeader(2);
+    uint8_t* p = sPacketBuffer;
+    uint8_t* end = sPacketBuffer + sizeof(sPacketBuffer);
+    double directNs = nsPerCall(iterations, [&](uint32_t i) {
+        if ((size_t)(end - p) < vperfetto::packetwriter::kMaxEventPacketSize) {
+            p = sPacketBuffer;
+        }
+        p = vperfetto::writeSliceEventPacket(p, header, 1000 + (i & 0xff), 1, 3, TrackEvent::TYPE_SLICE_BEGIN);
+    });
+
+    report("slice packet, protozero", protozeroNs);
+    report("slice packet, direct encoder", directNs);
+}
+
+// The two timestamp sources of TraceContext::getTimestamp().
+void reportTimestampSources(uint32_t iterations) {
+    if (!vperfetto::hasCpuTicks()) return;
+    vperfetto::CpuClock clock;
+    clock.start();
+    vperfetto::CpuClockCalibration calibration = clock.calibration(clock.generation());
+
+    volatile uint64_t sink = 0;
+    double bootTimeNs = nsPerCall(iterations, [&](uint32_t) {
+        sink = vperfetto::bootTimeNs();
+    });
+    double cpuClockNs = nsPerCall(iterations, [&](uint32_t) {
+        sink = calibration.toBootTimeNs(vperfetto::readCpuTicks());
+    });
+    (void)sink;
+
+    report("timestamp, BOOTTIME", bootTimeNs);
+    report("timestamp, raw cpu clock", cpuClockNs);
+}
+
+#endif // VPERFETTO_BENCHMARK_PACKET_ENCODERS
+
+} // namespace
+
+int main(int argc, char** argv) {
+    uint32_t iterations = argc > 1 ? (uint32_t)atoi(argv[1]) : 1000000;
+
+    static char hostFileName[L_tmpnam];
+    if (!std::tmpnam(hostFileName)) {
+        fprintf(stderr, "%s: could not generate trace file name\n", __func__);
+        return 1;
+    }
+
+    vperfetto::initialize();
+    vperfetto::setTraceConfig([](vperfetto::VirtualDeviceTraceConfig& config) {
+        config.hostFilename = hostFileName;
+        config.guestFilename = nullptr;
+        config.combinedFilename = nullptr;
+    });
+
+    // Disabled first, then the same calls with a session recording.
+    double disabledBegin = nsPerCall(iterations, [](uint32_t) {
+        vperfetto::beginTrace("benchmark slice");
+        vperfetto::endTrace();
+    });
+    double disabledCounter = nsPerCall(iterations, [](uint32_t i) {
+        vperfetto::traceCounter("benchmark counter", i);
+    });
+
+    vperfetto::enableTracing();
+    // Warm up the per-thread state (interning, counter track cache).
+    vperfetto::beginTrace("benchmark slice");
+    vperfetto::endTrace();
+    vperfetto::traceCounter("benchmark counter", 0);
+
+    double beginEnd = nsPerCall(iterations, [](uint32_t) {
+        vperfetto::beginTrace("benchmark slice");
+        vperfetto::endTrace();
+    });
+    double scoped = nsPerCall(iterations, [](uint32_t) {
+        VPERFETTO_SCOPED_TRACE("benchmark slice");
+    });
+    double counter = nsPerCall(iterations, [](uint32_t i) {
+        vperfetto::traceCounter("benchmark counter", i);
+    });
+    double staticCounter = nsPerCall(iterations, [](uint32_t i) {
+        VPERFETTO_TRACE_COUNTER("benchmark counter", i);
+    });
+    vperfetto::disableTracing();
+    vperfetto::waitSavingDone();
+
+    fprintf(stderr, "%u iterations, per call:\n", iterations);
+    report("beginTrace+endTrace (disabled)", disabledBegin);
+    report("traceCounter (disabled)", disabledCounter);
+    report("beginTrace+endTrace", beginEnd);
+    report("beginTrace (half of the pair)", beginEnd / 2);
+    report("VPERFETTO_SCOPED_TRACE", scoped);
+    report("traceCounter", counter);
+    report("VPERFETTO_TRACE_COUNTER", staticCounter);
+#ifdef VPERFETTO_BENCHMARK_PACKET_ENCODERS
+    reportPacketEncoders(iterations);
+    reportTimestampSources(iterations);
+#endif
+
+    std::filesystem::remove(std::filesystem::path(hostFileName));
+    return 0;
+}
@@ -7,6 +7,9 @@
 #include <string.h>
 #include <stdlib.h>
 
+// More threads than this rewriting packets would only fight over the output.
+static const uint32_t kMaxJobs = 256;
+
 static bool sValidFilename(const char* fn) {
     if (!fn) {
         fprintf(stderr, "ERROR: Invalid filename (is null)\n");
@@ -43,7 +46,9 @@ int main(int argc, char** argv) {
         fprintf(stderr, "%s: error: invalid usage of vperfetto_merge. Usage: vperfetto_merge <guestTraceFile> <hostTraceFile> <combinedTraceFile>"
             " [<guestClockBootTimeNsWhenHostTracingStarted>]"
             " [--guest-tsc-offset <guest tsc-offset, ie: host file /sys/kernel/debug/kvm/4678-27/vcpu0/tsc-offset>]"
-            " [--merge-guest-into-host]\n", __func__);
+            " [--merge-guest-into-host]"
+            " [--clock-snapshots]"
+            " [--jobs <number of threads rewriting packets, 0 for one per hardware thread>]\n", __func__);
         return 1;
     }
 
@@ -67,6 +72,7 @@ int main(int argc, char** argv) {
     config.guestTscOffset = 0;
     config.mergeGuestIntoHost = false;
     config.addTraces = false;
+    config.jobs = 1;
 
     for (int i = 4; i < argc; ++i) {
         auto arg = std::string(argv[i]);
@@ -88,8 +94,30 @@ int main(int argc, char** argv) {
             }
         } else if (arg == "--merge-guest-into-host") {
             config.mergeGuestIntoHost = true;
+        } else if (arg == "--clock-snapshots") {
+            config.useClockSnapshots = true;
         } else if (arg == "--add-traces") {
             config.addTraces = true;
+        } else if (arg == "--jobs") {
+            if (++i >= argc) {
+                fprintf(stderr, "ERROR: missing value after --jobs\n");
+                return 1;
+            }
+
+            // Read signed, so that a negative count is rejected instead of
+            // wrapping around to billions of threads.
+            int64_t jobs;
+            std::istringstream ss(argv[i]);
+            if (!(ss >> jobs) || !ss.eof()) {
+                fprintf(stderr, "ERROR: Failed to parse jobs. Provided: [%s]\n", argv[i]);
+                return 1;
+            } else if (jobs < 0 || jobs > kMaxJobs) {
+                fprintf(stderr, "ERROR: jobs must be between 0 and %u. Provided: [%s]\n", kMaxJobs, argv[i]);
+                return 1;
+            } else {
+                fprintf(stderr, "using %u jobs (0: one per hardware thread)\n", (uint32_t)jobs);
+                config.jobs = (uint32_t)jobs;
+            }
         } else {
             // User specified guest boottime
             uint64_t guestClockBootTimeNs;
@@ -32,8 +32,12 @@
 #include <unistd.h>
 #endif
 
+#include <atomic>
 #include <cstdio>
 #include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
 
 static void runTrace(const vperfetto_min_config* config, uint32_t iterations) {
     vperfetto_min_startTracing(config);
@@ -46,6 +50,7 @@ static void runTrace(const vperfetto_min_config* config, uint32_t iterations) {
         vperfetto_min_endTrackEvent();
         vperfetto_min_beginTrackEvent_OpenGL("test OpenGL event");
         vperfetto_min_endTrackEvent_OpenGL();
+        vperfetto_min_traceCounter("test counter", i);
     }
     vperfetto_min_endTracing();
 }
@@ -75,3 +80,156 @@ TEST(VperfettoMin, Basic) {
 
     // std::filesystem::remove(std::filesystem::path(trace1FileName));
 }
+
+TEST(VperfettoMin, DynamicEventNames) {
+    static char traceFileName[L_tmpnam];
+
+    if (!std::tmpnam(traceFileName)) {
+        FAIL() << "Could not generate trace file name";
+        return;
+    }
+
+    vperfetto_min_config config = {
+        sOnTracingStateChange,
+        VPERFETTO_INIT_FLAG_USE_INPROCESS_BACKEND,
+        traceFileName,
+    };
+    vperfetto_min_startTracing(&config);
+    // Names built in the same buffer each time; each is interned once.
+    char name[64];
+    for (uint32_t i = 0; i < 100; ++i) {
+        for (uint32_t j = 0; j < 4; ++j) {
+            snprintf(name, sizeof(name), "dynamic event name %u", j);
+            vperfetto_min_beginTrackEvent_OpenGL(name);
+            vperfetto_min_endTrackEvent_OpenGL();
+        }
+    }
+    vperfetto_min_endTracing();
+
+    std::ifstream traceFile(traceFileName, std::ios::binary);
+    std::string trace((std::istreambuf_iterator<char>(traceFile)), std::istreambuf_iterator<char>());
+    for (uint32_t j = 0; j < 4; ++j) {
+        snprintf(name, sizeof(name), "dynamic event name %u", j);
+        size_t first = trace.find(name);
+        EXPECT_NE(first, std::string::npos);
+        EXPECT_EQ(trace.find(name, first + 1), std::string::npos);
+    }
+
+    std::filesystem::remove(std::filesystem::path(traceFileName));
+}
+
+static std::atomic<int> sAsyncStateChanges(0);
+
+static void sOnAsyncTracingStateChange(bool enabled) {
+    // Started, then saved.
+    if (enabled == (sAsyncStateChanges == 0)) ++sAsyncStateChanges;
+}
+
+// Tests of one trace file. Each starts with tracing off, whatever the test
+// before it left on.
+class VperfettoMinTrace : public ::testing::Test {
+protected:
+    void SetUp() override {
+        stopTracing();
+        ASSERT_FALSE(vperfetto_min_categoryEnabled(VPERFETTO_MIN_CATEGORY_gfx));
+        ASSERT_TRUE(std::tmpnam(mTraceFileName)) << "Could not generate trace file name";
+        sAsyncStateChanges = 0;
+    }
+
+    void TearDown() override {
+        stopTracing();
+        std::filesystem::remove(std::filesystem::path(mTraceFileName));
+    }
+
+    static void stopTracing() {
+        if (vperfetto_min_categoryEnabled(VPERFETTO_MIN_CATEGORY_gfx)) vperfetto_min_endTracing();
+    }
+
+    vperfetto_min_config makeConfig(on_tracing_state_change_t onTracingStateChange) const {
+        vperfetto_min_config config = {
+            onTracingStateChange,
+            VPERFETTO_INIT_FLAG_USE_INPROCESS_BACKEND,
+            mTraceFileName,
+        };
+        return config;
+    }
+
+    // Names are interned, so each one that was traced is in the file once.
+    std::string readTrace() const {
+        std::ifstream traceFile(mTraceFileName, std::ios::binary);
+        return std::string((std::istreambuf_iterator<char>(traceFile)), std::istreambuf_iterator<char>());
+    }
+
+    char mTraceFileName[L_tmpnam];
+};
+
+TEST_F(VperfettoMinTrace, WriteIntoFile) {
+    vperfetto_min_config config = makeConfig(sOnTracingStateChange);
+    config.file_write_period_ms = 100;
+    vperfetto_min_startTracing(&config);
+    for (uint32_t i = 0; i < 400; ++i) {
+        vperfetto_min_beginTrackEvent("test trace 1");
+        vperfetto_min_endTrackEvent();
+    }
+    // The service writes the file while tracing, not only at the end.
+    usleep(3 * config.file_write_period_ms * 1000);
+    EXPECT_NE(readTrace().find("test trace 1"), std::string::npos);
+    vperfetto_min_endTracing();
+
+    EXPECT_NE(readTrace().find("test trace 1"), std::string::npos);
+}
+
+TEST_F(VperfettoMinTrace, AsyncStartEnd) {
+    vperfetto_min_config config = makeConfig(sOnAsyncTracingStateChange);
+    auto waitFor = [](int stateChanges) {
+        for (int i = 0; i < 500 && sAsyncStateChanges < stateChanges; ++i) usleep(10000);
+        return sAsyncStateChanges == stateChanges;
+    };
+
+    vperfetto_min_startTracingAsync(&config);
+    ASSERT_TRUE(waitFor(1));
+    for (uint32_t i = 0; i < 100; ++i) {
+        vperfetto_min_beginTrackEvent("test trace 1");
+        vperfetto_min_endTrackEvent();
+    }
+    vperfetto_min_endTracingAsync();
+    ASSERT_TRUE(waitFor(2));
+
+    EXPECT_NE(readTrace().find("test trace 1"), std::string::npos);
+}
+
+TEST_F(VperfettoMinTrace, InlineCategoryCheck) {
+    vperfetto_min_config config = makeConfig(sOnTracingStateChange);
+
+    // Off, the macros don't evaluate their arguments, so they don't make the
+    // calls either.
+    uint32_t evaluations = 0;
+    EXPECT_FALSE(vperfetto_min_categoryEnabled(VPERFETTO_MIN_CATEGORY_gfx));
+    VPERFETTO_MIN_BEGIN_TRACK_EVENT((++evaluations, "test trace off"));
+    VPERFETTO_MIN_BEGIN_TRACK_EVENT_IN(Vulkan, (++evaluations, "test trace off"));
+    VPERFETTO_MIN_TRACE_COUNTER((++evaluations, "test counter off"), 0);
+    VPERFETTO_MIN_END_TRACK_EVENT_IN(Vulkan);
+    VPERFETTO_MIN_END_TRACK_EVENT();
+    EXPECT_EQ(evaluations, 0u);
+
+    vperfetto_min_startTracing(&config);
+    EXPECT_TRUE(vperfetto_min_categoryEnabled(VPERFETTO_MIN_CATEGORY_gfx));
+    EXPECT_TRUE(vperfetto_min_categoryEnabled(VPERFETTO_MIN_CATEGORY_Vulkan));
+    for (uint32_t i = 0; i < 100; ++i) {
+        VPERFETTO_MIN_BEGIN_TRACK_EVENT((++evaluations, "test trace 1"));
+        VPERFETTO_MIN_BEGIN_TRACK_EVENT_IN(Vulkan, "test trace 2");
+        VPERFETTO_MIN_TRACE_COUNTER("test counter", i);
+        VPERFETTO_MIN_END_TRACK_EVENT_IN(Vulkan);
+        VPERFETTO_MIN_END_TRACK_EVENT();
+    }
+    vperfetto_min_endTracing();
+    EXPECT_FALSE(vperfetto_min_categoryEnabled(VPERFETTO_MIN_CATEGORY_gfx));
+    EXPECT_EQ(evaluations, 100u);
+
+    std::string trace = readTrace();
+    EXPECT_NE(trace.find("test trace 1"), std::string::npos);
+    EXPECT_NE(trace.find("test trace 2"), std::string::npos);
+    EXPECT_NE(trace.find("test counter"), std::string::npos);
+    EXPECT_EQ(trace.find("test trace off"), std::string::npos);
+    EXPECT_EQ(trace.find("test counter off"), std::string::npos);
+}
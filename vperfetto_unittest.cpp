@@ -13,6 +13,22 @@
 // limitations under the License.
 #include "vperfetto.h"
 
+#ifdef VPERFETTO_TEST_NON_SDK
+#include "perfetto-min/protos/perfetto/common/trace_stats.pbzero.h"
+#include "perfetto-min/protos/perfetto/trace/clock_snapshot.pbzero.h"
+#include "perfetto-min/protos/perfetto/trace/interned_data/interned_data.pbzero.h"
+#include "perfetto-min/protos/perfetto/trace/trace.pbzero.h"
+#include "perfetto-min/protos/perfetto/trace/trace_packet.pbzero.h"
+#include "perfetto-min/protos/perfetto/trace/trace_packet_defaults.pbzero.h"
+#include "perfetto-min/protos/perfetto/trace/track_event/process_descriptor.pbzero.h"
+#include "perfetto-min/protos/perfetto/trace/track_event/thread_descriptor.pbzero.h"
+#include "perfetto-min/protos/perfetto/trace/track_event/track_descriptor.pbzero.h"
+#include "perfetto-min/protos/perfetto/trace/track_event/track_event.pbzero.h"
+#else
+#include "perfetto.h"
+#include "vperfetto-combiner.h"
+#endif
+
 #include <gtest/gtest.h>
 
 #ifdef _WIN32
@@ -32,8 +48,19 @@
 #include <unistd.h>
 #endif
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdio>
 #include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
 
 namespace vperfetto {
 
@@ -50,11 +77,152 @@ static void runTrace(uint32_t iterations) {
         endTrace();
         beginTrace("test trace 2");
         endTrace();
+        {
+            VPERFETTO_SCOPED_TRACE("test trace 3");
+        }
     }
     disableTracing();
     waitSavingDone();
 }
 
+static std::vector<char> readTrace(const char* filename) {
+    std::ifstream file(filename, std::ios::binary);
+    return std::vector<char>((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+}
+
+// Whether every named track event in |trace| has its name interned earlier on
+// its sequence, since the sequence's incremental state was last cleared.
+// |namedEvents| counts the named slice begins (the non-SDK build names the
+// ends as well).
+static bool eventNamesResolve(const std::vector<char>& trace, size_t offset, uint32_t* namedEvents) {
+    namespace pbzero = ::perfetto::protos::pbzero;
+    std::map<uint32_t, std::set<uint64_t>> internedNames;
+    pbzero::Trace::Decoder traceDecoder(reinterpret_cast<const uint8_t*>(trace.data()) + offset,
+                                        trace.size() - offset);
+    for (auto it = traceDecoder.packet(); it; ++it) {
+        pbzero::TracePacket::Decoder packet(*it);
+        auto& names = internedNames[packet.trusted_packet_sequence_id()];
+        if (packet.sequence_flags() & pbzero::TracePacket::SEQ_INCREMENTAL_STATE_CLEARED) names.clear();
+        if (packet.has_interned_data()) {
+            pbzero::InternedData::Decoder internedData(packet.interned_data());
+            for (auto name = internedData.event_names(); name; ++name) {
+                names.insert(pbzero::EventName::Decoder(*name).iid());
+            }
+        }
+        if (!packet.has_track_event()) continue;
+        pbzero::TrackEvent::Decoder event(packet.track_event());
+        if (!event.has_name_iid()) continue;
+        if (!names.count(event.name_iid())) return false;
+        if (event.type() == pbzero::TrackEvent::TYPE_SLICE_BEGIN) ++*namedEvents;
+    }
+    return true;
+}
+
+// The number of slice begins in |trace| per event name. |ends| is set to the
+// number of slice ends.
+static std::map<std::string, uint32_t> countSlices(const std::vector<char>& trace, uint32_t* ends) {
+    namespace pbzero = ::perfetto::protos::pbzero;
+    std::map<uint32_t, std::map<uint64_t, std::string>> internedNames;
+    std::map<std::string, uint32_t> begins;
+    *ends = 0;
+    pbzero::Trace::Decoder traceDecoder(reinterpret_cast<const uint8_t*>(trace.data()), trace.size());
+    for (auto it = traceDecoder.packet(); it; ++it) {
+        pbzero::TracePacket::Decoder packet(*it);
+        auto& names = internedNames[packet.trusted_packet_sequence_id()];
+        if (packet.sequence_flags() & pbzero::TracePacket::SEQ_INCREMENTAL_STATE_CLEARED) names.clear();
+        if (packet.has_interned_data()) {
+            pbzero::InternedData::Decoder internedData(packet.interned_data());
+            for (auto name = internedData.event_names(); name; ++name) {
+                pbzero::EventName::Decoder eventName(*name);
+                names[eventName.iid()] = eventName.name().ToStdString();
+            }
+        }
+        if (!packet.has_track_event()) continue;
+        pbzero::TrackEvent::Decoder event(packet.track_event());
+        if (event.type() == pbzero::TrackEvent::TYPE_SLICE_BEGIN) {
+            ++begins[names[event.name_iid()]];
+        } else if (event.type() == pbzero::TrackEvent::TYPE_SLICE_END) {
+            ++*ends;
+        }
+    }
+    return begins;
+}
+
+// The values of the counter events in |trace|, in order.
+static std::vector<int64_t> getCounterValues(const std::vector<char>& trace) {
+    namespace pbzero = ::perfetto::protos::pbzero;
+    std::vector<int64_t> values;
+    pbzero::Trace::Decoder traceDecoder(reinterpret_cast<const uint8_t*>(trace.data()), trace.size());
+    for (auto it = traceDecoder.packet(); it; ++it) {
+        pbzero::TracePacket::Decoder packet(*it);
+        if (!packet.has_track_event()) continue;
+        pbzero::TrackEvent::Decoder event(packet.track_event());
+        if (event.type() == pbzero::TrackEvent::TYPE_COUNTER) values.push_back(event.counter_value());
+    }
+    return values;
+}
+
+#ifndef VPERFETTO_TEST_NON_SDK
+
+// Helpers for the SDK build's combining tests.
+
+// The timestamps of the track events in |trace| from |offset| on, and how many
+// of its clock snapshots have |clockId|.
+static std::vector<uint64_t> getTrackEventTimestamps(const std::vector<char>& trace, size_t offset,
+                                                     uint32_t clockId, uint32_t* clockSnapshots) {
+    namespace pbzero = ::perfetto::protos::pbzero;
+    std::vector<uint64_t> timestamps;
+    pbzero::Trace::Decoder traceDecoder(reinterpret_cast<const uint8_t*>(trace.data()) + offset,
+                                        trace.size() - offset);
+    for (auto it = traceDecoder.packet(); it; ++it) {
+        pbzero::TracePacket::Decoder packet(*it);
+        if (packet.has_track_event()) timestamps.push_back(packet.timestamp());
+        if (!packet.has_clock_snapshot()) continue;
+        pbzero::ClockSnapshot::Decoder snapshot(packet.clock_snapshot());
+        for (auto clock = snapshot.clocks(); clock; ++clock) {
+            if (pbzero::ClockSnapshot::Clock::Decoder(*clock).clock_id() == clockId) ++*clockSnapshots;
+        }
+    }
+    return timestamps;
+}
+
+// The ids that combining moves the addon trace's packets to: sequence ids,
+// pids and tids of the process and thread tracks, and track uuids.
+struct TraceIds {
+    std::set<uint32_t> sequenceIds;
+    std::set<uint64_t> pidTids;
+    std::set<uint64_t> uuids;
+};
+
+static TraceIds getTraceIds(const std::vector<char>& trace, size_t offset) {
+    namespace pbzero = ::perfetto::protos::pbzero;
+    TraceIds ids;
+    pbzero::Trace::Decoder traceDecoder(reinterpret_cast<const uint8_t*>(trace.data()) + offset,
+                                        trace.size() - offset);
+    for (auto it = traceDecoder.packet(); it; ++it) {
+        pbzero::TracePacket::Decoder packet(*it);
+        if (packet.has_trusted_packet_sequence_id()) ids.sequenceIds.insert(packet.trusted_packet_sequence_id());
+        if (packet.has_track_event()) {
+            pbzero::TrackEvent::Decoder event(packet.track_event());
+            if (event.has_track_uuid()) ids.uuids.insert(event.track_uuid());
+        }
+        if (!packet.has_track_descriptor()) continue;
+        pbzero::TrackDescriptor::Decoder track(packet.track_descriptor());
+        if (track.has_uuid()) ids.uuids.insert(track.uuid());
+        if (track.has_process()) {
+            ids.pidTids.insert(pbzero::ProcessDescriptor::Decoder(track.process()).pid());
+        }
+        if (track.has_thread()) {
+            pbzero::ThreadDescriptor::Decoder thread(track.thread());
+            ids.pidTids.insert(thread.pid());
+            ids.pidTids.insert(thread.tid());
+        }
+    }
+    return ids;
+}
+
+#endif // !VPERFETTO_TEST_NON_SDK
+
 TEST(PerfettoTracingOnly, Basic) {
     const bool* tracingDisabledPtr;
     initialize(&tracingDisabledPtr);
@@ -105,4 +273,1126 @@ TEST(PerfettoTracingOnly, Basic) {
     std::filesystem::remove(std::filesystem::path(trace2FileName));
 }
 
+TEST(PerfettoTracingOnly, StaticEventNames) {
+    static char hostFileName[L_tmpnam];
+
+    if (!std::tmpnam(hostFileName)) {
+        FAIL() << "Could not generate trace file name";
+        return;
+    }
+
+    setTraceConfig([](VirtualDeviceTraceConfig& config) {
+        config.hostFilename = hostFileName;
+        config.guestFilename = nullptr;
+        config.combinedFilename = nullptr;
+    });
+
+    // The same call sites on two threads, so on two sequences.
+    auto traceStaticNames = [] {
+        for (uint32_t i = 0; i < 3; ++i) {
+            VPERFETTO_SCOPED_TRACE("static name a");
+            VPERFETTO_BEGIN_TRACE("static name b");
+            endTraceIfEnabled();
+        }
+    };
+    enableTracing();
+    traceStaticNames();
+    std::thread(traceStaticNames).join();
+    disableTracing();
+    waitSavingDone();
+
+    // Each sequence interns each name once, and its slice begins' name_iids
+    // map back to the names in the order they were traced.
+    namespace pbzero = ::perfetto::protos::pbzero;
+    std::map<uint32_t, std::map<uint64_t, std::string>> namesByIid;
+    std::map<uint32_t, std::map<std::string, uint32_t>> entriesByName;
+    std::map<uint32_t, std::vector<std::string>> tracedNames;
+    std::vector<char> trace = readTrace(hostFileName);
+    pbzero::Trace::Decoder traceDecoder(reinterpret_cast<const uint8_t*>(trace.data()), trace.size());
+    for (auto it = traceDecoder.packet(); it; ++it) {
+        pbzero::TracePacket::Decoder packet(*it);
+        uint32_t sequenceId = packet.trusted_packet_sequence_id();
+        if (packet.has_interned_data()) {
+            pbzero::InternedData::Decoder internedData(packet.interned_data());
+            for (auto name = internedData.event_names(); name; ++name) {
+                pbzero::EventName::Decoder eventName(*name);
+                namesByIid[sequenceId][eventName.iid()] = eventName.name().ToStdString();
+                ++entriesByName[sequenceId][eventName.name().ToStdString()];
+            }
+        }
+        if (!packet.has_track_event()) continue;
+        pbzero::TrackEvent::Decoder event(packet.track_event());
+        if (event.type() != pbzero::TrackEvent::TYPE_SLICE_BEGIN) continue;
+        ASSERT_TRUE(namesByIid[sequenceId].count(event.name_iid()));
+        tracedNames[sequenceId].push_back(namesByIid[sequenceId][event.name_iid()]);
+    }
+
+    const std::vector<std::string> expectedNames = {
+        "static name a", "static name b",
+        "static name a", "static name b",
+        "static name a", "static name b",
+    };
+    ASSERT_EQ(tracedNames.size(), 2u);
+    for (const auto& sequence : tracedNames) {
+        EXPECT_EQ(sequence.second, expectedNames);
+        EXPECT_EQ(entriesByName[sequence.first]["static name a"], 1u);
+        EXPECT_EQ(entriesByName[sequence.first]["static name b"], 1u);
+    }
+
+    std::filesystem::remove(std::filesystem::path(hostFileName));
+}
+
+#ifndef VPERFETTO_TEST_NON_SDK
+
+// Combining is SDK build only.
+
+// Tests that combine a host trace with a guest trace. SetUp() records the
+// guest trace; the test body traces the host.
+class PerfettoGuestTrace : public ::testing::Test {
+protected:
+    static constexpr int64_t kGuestTimeDiffNs = 1000000000;
+
+    void SetUp() override {
+        ASSERT_TRUE(std::tmpnam(mGuestFileName) &&
+                    std::tmpnam(mHostFileName) &&
+                    std::tmpnam(mCombinedFileName)) << "Could not generate trace file names";
+
+        const char* guestFileName = mGuestFileName;
+        setTraceConfig([guestFileName](VirtualDeviceTraceConfig& config) {
+            config.hostFilename = guestFileName;
+            config.guestFilename = nullptr;
+            config.combinedFilename = nullptr;
+            config.guestTimeDiff = kGuestTimeDiffNs;
+        });
+        runTrace(100);
+
+        mGuestTrace = readTrace(mGuestFileName);
+        ASSERT_GT(mGuestTrace.size(), 0u);
+    }
+
+    void TearDown() override {
+        setTraceConfig([](VirtualDeviceTraceConfig& config) {
+            config.hostFilename = "vmm.trace";
+            config.guestFilename = nullptr;
+            config.combinedFilename = nullptr;
+            config.guestTimeDiff = 0;
+            config.guestTraceTimeoutMs = 0;
+            config.onlineCombine = false;
+            config.hostFileWritePeriodMs = 0;
+        });
+
+        std::filesystem::remove(std::filesystem::path(mCombinedFileName));
+        std::filesystem::remove(std::filesystem::path(mGuestFileName));
+        std::filesystem::remove(std::filesystem::path(mHostFileName));
+    }
+
+    // The combined trace is the guest trace as is, then the host's track
+    // events moved onto the guest's time base.
+    void expectHostAfterGuest() {
+        std::vector<char> combinedTrace = readTrace(mCombinedFileName);
+        ASSERT_GT(combinedTrace.size(), mGuestTrace.size());
+        EXPECT_TRUE(std::equal(mGuestTrace.begin(), mGuestTrace.end(), combinedTrace.begin()));
+
+        uint32_t clockSnapshots = 0;
+        std::vector<uint64_t> hostTimestamps =
+            getTrackEventTimestamps(readTrace(mHostFileName), 0, 0, &clockSnapshots);
+        std::vector<uint64_t> addonTimestamps =
+            getTrackEventTimestamps(combinedTrace, mGuestTrace.size(), 0, &clockSnapshots);
+        ASSERT_FALSE(hostTimestamps.empty());
+        ASSERT_EQ(addonTimestamps.size(), hostTimestamps.size());
+        for (size_t i = 0; i < hostTimestamps.size(); ++i) {
+            EXPECT_EQ(addonTimestamps[i], hostTimestamps[i] + kGuestTimeDiffNs);
+        }
+    }
+
+    // onlineCombine: the guest's track events moved onto the host's time
+    // base, then the host trace as is.
+    void expectGuestBeforeHost() {
+        std::vector<char> combinedTrace = readTrace(mCombinedFileName);
+        std::vector<char> hostTrace = readTrace(mHostFileName);
+        ASSERT_GT(hostTrace.size(), 0u);
+        ASSERT_GT(combinedTrace.size(), hostTrace.size());
+        size_t addonSize = combinedTrace.size() - hostTrace.size();
+        EXPECT_TRUE(std::equal(hostTrace.begin(), hostTrace.end(), combinedTrace.begin() + addonSize));
+
+        uint32_t clockSnapshots = 0;
+        std::vector<uint64_t> guestTimestamps = getTrackEventTimestamps(mGuestTrace, 0, 0, &clockSnapshots);
+        std::vector<uint64_t> addonTimestamps = getTrackEventTimestamps(
+            std::vector<char>(combinedTrace.begin(), combinedTrace.begin() + addonSize), 0, 0, &clockSnapshots);
+        ASSERT_FALSE(guestTimestamps.empty());
+        ASSERT_EQ(addonTimestamps.size(), guestTimestamps.size());
+        for (size_t i = 0; i < guestTimestamps.size(); ++i) {
+            EXPECT_EQ(addonTimestamps[i], guestTimestamps[i] - kGuestTimeDiffNs);
+        }
+    }
+
+    char mGuestFileName[L_tmpnam];
+    char mHostFileName[L_tmpnam];
+    char mCombinedFileName[L_tmpnam];
+    std::vector<char> mGuestTrace;
+};
+
+TEST_F(PerfettoGuestTrace, CombineTraces) {
+    const char* hostFileName = mHostFileName;
+    setTraceConfig([hostFileName](VirtualDeviceTraceConfig& config) {
+        config.hostFilename = hostFileName;
+    });
+    runTrace(100);
+
+    TraceCombineConfig config;
+    config.guestFile = mGuestFileName;
+    config.hostFile = mHostFileName;
+    config.combinedFile = mCombinedFileName;
+    config.useGuestTimeDiff = true;
+    config.guestClockTimeDiffNs = kGuestTimeDiffNs;
+    config.addTraces = false;
+    combineTraces(&config);
+
+    // The guest trace is copied as is, and the host trace follows it with
+    // rewritten packets: its timestamps on the guest's time base...
+    expectHostAfterGuest();
+
+    // ...and its ids moved out of the guest's way, uuids by a random mask, so
+    // they only have to stay clear of the guest's.
+    std::vector<char> combinedTrace = readTrace(mCombinedFileName);
+    TraceIds guestIds = getTraceIds(mGuestTrace, 0);
+    TraceIds hostIds = getTraceIds(readTrace(mHostFileName), 0);
+    TraceIds addonIds = getTraceIds(combinedTrace, mGuestTrace.size());
+    ASSERT_FALSE(guestIds.sequenceIds.empty());
+    ASSERT_FALSE(guestIds.pidTids.empty());
+    ASSERT_FALSE(guestIds.uuids.empty());
+    EXPECT_EQ(addonIds.sequenceIds.size(), hostIds.sequenceIds.size());
+    EXPECT_GT(*addonIds.sequenceIds.begin(), *guestIds.sequenceIds.rbegin());
+    EXPECT_EQ(addonIds.pidTids.size(), hostIds.pidTids.size());
+    EXPECT_GT(*addonIds.pidTids.begin(), *guestIds.pidTids.rbegin());
+    EXPECT_EQ(addonIds.uuids.size(), hostIds.uuids.size());
+    for (uint64_t uuid : addonIds.uuids) EXPECT_EQ(guestIds.uuids.count(uuid), 0u);
+}
+
+TEST_F(PerfettoGuestTrace, CombineTracesWithClockSnapshots) {
+    const char* hostFileName = mHostFileName;
+    setTraceConfig([hostFileName](VirtualDeviceTraceConfig& config) {
+        config.hostFilename = hostFileName;
+    });
+    runTrace(100);
+
+    TraceCombineConfig config;
+    config.guestFile = mGuestFileName;
+    config.hostFile = mHostFileName;
+    config.combinedFile = mCombinedFileName;
+    config.useGuestTimeDiff = true;
+    config.guestClockTimeDiffNs = kGuestTimeDiffNs;
+    config.addTraces = false;
+    config.useClockSnapshots = true;
+    combineTraces(&config);
+
+    // The host's track events keep their timestamps; its sequences get
+    // snapshots of the clock they were moved to instead.
+    static const uint32_t kAddonBoottimeClockId = 127;
+    std::vector<char> combinedTrace = readTrace(mCombinedFileName);
+    ASSERT_GT(combinedTrace.size(), mGuestTrace.size());
+    EXPECT_TRUE(std::equal(mGuestTrace.begin(), mGuestTrace.end(), combinedTrace.begin()));
+    uint32_t hostSnapshots = 0;
+    uint32_t combinedSnapshots = 0;
+    std::vector<uint64_t> hostTimestamps =
+        getTrackEventTimestamps(readTrace(mHostFileName), 0, kAddonBoottimeClockId, &hostSnapshots);
+    std::vector<uint64_t> combinedTimestamps =
+        getTrackEventTimestamps(combinedTrace, mGuestTrace.size(), kAddonBoottimeClockId, &combinedSnapshots);
+    EXPECT_FALSE(hostTimestamps.empty());
+    EXPECT_EQ(hostTimestamps, combinedTimestamps);
+    EXPECT_EQ(hostSnapshots, 0u);
+    EXPECT_GT(combinedSnapshots, 0u);
+}
+
+TEST_F(PerfettoGuestTrace, CombineTracesOnJobs) {
+    const char* hostFileName = mHostFileName;
+    setTraceConfig([hostFileName](VirtualDeviceTraceConfig& config) {
+        config.hostFilename = hostFileName;
+    });
+    runTrace(100);
+
+    // Chunks small enough for the host trace to be cut into many, so that
+    // some jobs have several and, with more jobs than chunks, some have none.
+    static const size_t kJobChunkSize = 1024;
+    std::vector<char> hostTrace = readTrace(mHostFileName);
+    ASSERT_GT(hostTrace.size(), 8 * kJobChunkSize);
+
+    auto combine = [this, &hostTrace](unsigned jobs) {
+        ScannedTrace guest(::protozero::ConstBytes{
+            reinterpret_cast<const uint8_t*>(mGuestTrace.data()), mGuestTrace.size() });
+        ScannedTrace host(::protozero::ConstBytes{
+            reinterpret_cast<const uint8_t*>(hostTrace.data()), hostTrace.size() });
+        std::ostringstream out;
+        EXPECT_TRUE(writeCombinedTrace(guest, host, kGuestTimeDiffNs, false /* addTraces */,
+                                       false /* clockSnapshotTimeDiff */, jobs, out, kJobChunkSize));
+        return out.str();
+    };
+
+    std::string singleJob = combine(1);
+    EXPECT_GT(singleJob.size(), mGuestTrace.size());
+    // The same packets, byte for byte, every run and on any number of jobs.
+    EXPECT_EQ(combine(1), singleJob);
+    EXPECT_EQ(combine(4), singleJob);
+    EXPECT_EQ(combine(1000), singleJob);
+}
+
+TEST_F(PerfettoGuestTrace, StreamHostTraceToFile) {
+    // The service writes the host trace; combining reads it back from disk.
+    const char* hostFileName = mHostFileName;
+    const char* guestFileName = mGuestFileName;
+    const char* combinedFileName = mCombinedFileName;
+    setTraceConfig([=](VirtualDeviceTraceConfig& config) {
+        config.hostFilename = hostFileName;
+        config.guestFilename = guestFileName;
+        config.combinedFilename = combinedFileName;
+        config.hostFileWritePeriodMs = 100;
+    });
+    enableTracing();
+    for (uint32_t i = 0; i < 100; ++i) {
+        beginTrace("test trace 1");
+        endTrace();
+    }
+    // The file fills up while tracing, not only once tracing stops.
+    sleepUs(3 * 100 * 1000);
+    EXPECT_GT(std::filesystem::file_size(mHostFileName), 0u);
+    disableTracing();
+    waitSavingDone();
+
+    expectHostAfterGuest();
+}
+
+#endif // !VPERFETTO_TEST_NON_SDK
+
+// Tests of one host trace. Each starts with tracing off, whatever the test
+// before it left on.
+class PerfettoHostTrace : public ::testing::Test {
+protected:
+    void SetUp() override {
+        stopTracing();
+        ASSERT_FALSE(tracingEnabled());
+        ASSERT_TRUE(std::tmpnam(mHostFileName)) << "Could not generate trace file name";
+
+        const char* hostFileName = mHostFileName;
+        setTraceConfig([hostFileName](VirtualDeviceTraceConfig& config) {
+            config.hostFilename = hostFileName;
+            config.guestFilename = nullptr;
+            config.combinedFilename = nullptr;
+        });
+    }
+
+    void TearDown() override {
+        stopTracing();
+        setTraceConfig([](VirtualDeviceTraceConfig& config) {
+            config.hostFilename = "vmm.trace";
+        });
+
+        std::filesystem::remove(std::filesystem::path(mHostFileName));
+    }
+
+    static void stopTracing() {
+        if (!queryTraceConfig().tracingDisabled) disableTracing();
+        waitSavingDone();
+    }
+
+    char mHostFileName[L_tmpnam];
+};
+
+TEST_F(PerfettoHostTrace, AsyncEnableDisable) {
+    static std::atomic<bool> started;
+    static std::atomic<bool> saved;
+    started = false;
+    saved = false;
+    auto waitFor = [](std::atomic<bool>& done) {
+        for (int i = 0; i < 500 && !done; ++i) sleepUs(10000);
+        return done.load();
+    };
+
+    enableTracingAsync([]() { started = true; });
+    ASSERT_TRUE(waitFor(started));
+    for (uint32_t i = 0; i < 100; ++i) {
+        beginTrace("test trace 1");
+        endTrace();
+    }
+    disableTracingAsync([]() { saved = true; });
+    ASSERT_TRUE(waitFor(saved));
+    EXPECT_FALSE(queryTraceConfig().saving);
+
+    uint32_t ends = 0;
+    std::map<std::string, uint32_t> begins = countSlices(readTrace(mHostFileName), &ends);
+    EXPECT_EQ(begins["test trace 1"], 100u);
+    EXPECT_EQ(ends, 100u);
+}
+
+TEST_F(PerfettoHostTrace, InlineEnabledCheck) {
+    // Off, the gated macros don't evaluate their arguments.
+    uint32_t evaluations = 0;
+    VPERFETTO_BEGIN_TRACE((++evaluations, "test trace off"));
+    VPERFETTO_TRACE_COUNTER("test counter", (++evaluations, -1));
+    endTraceIfEnabled();
+    EXPECT_EQ(evaluations, 0u);
+
+    enableTracing();
+    EXPECT_TRUE(tracingEnabled());
+    for (uint32_t i = 0; i < 100; ++i) {
+        VPERFETTO_SCOPED_TRACE("test trace 1");
+        beginTraceIfEnabled("test trace 2");
+        endTraceIfEnabled();
+        VPERFETTO_BEGIN_TRACE("test trace 3");
+        endTraceIfEnabled();
+        VPERFETTO_TRACE_COUNTER("test counter", (++evaluations, (int64_t)i));
+        traceCounterIfEnabled("test counter", i);
+    }
+    EXPECT_EQ(evaluations, 100u);
+
+    // With the session still recording but the enabled word off, nothing
+    // reaches the library, which would record it.
+    evaluations = 0;
+    gTracingEnabled.store(false, std::memory_order_relaxed);
+    beginTraceIfEnabled("test trace off");
+    endTraceIfEnabled();
+    VPERFETTO_BEGIN_TRACE((++evaluations, "test trace off"));
+    endTraceIfEnabled();
+    VPERFETTO_TRACE_COUNTER("test counter", (++evaluations, -1));
+    traceCounterIfEnabled("test counter", -1);
+    gTracingEnabled.store(true, std::memory_order_relaxed);
+    EXPECT_EQ(evaluations, 0u);
+
+    disableTracing();
+    waitSavingDone();
+    EXPECT_FALSE(tracingEnabled());
+
+    std::vector<char> trace = readTrace(mHostFileName);
+    uint32_t ends = 0;
+    std::map<std::string, uint32_t> begins = countSlices(trace, &ends);
+    EXPECT_EQ(begins["test trace 1"], 100u);
+    EXPECT_EQ(begins["test trace 2"], 100u);
+    EXPECT_EQ(begins["test trace 3"], 100u);
+    EXPECT_EQ(begins.count("test trace off"), 0u);
+    EXPECT_EQ(ends, 300u);
+    std::vector<int64_t> values = getCounterValues(trace);
+    ASSERT_EQ(values.size(), 200u);
+    for (uint32_t i = 0; i < 100; ++i) {
+        EXPECT_EQ(values[2 * i], (int64_t)i);
+        EXPECT_EQ(values[2 * i + 1], (int64_t)i);
+    }
+}
+
+TEST(PerfettoTracingOnly, FlightRecorderSnapshot) {
+    static char hostFileName[L_tmpnam];
+    static char snapshotFileName[L_tmpnam];
+
+    if (!std::tmpnam(hostFileName) ||
+        !std::tmpnam(snapshotFileName)) {
+        FAIL() << "Could not generate trace file names";
+        return;
+    }
+
+    setTraceConfig([](VirtualDeviceTraceConfig& config) {
+        config.hostFilename = hostFileName;
+        config.guestFilename = nullptr;
+        config.combinedFilename = nullptr;
+        config.flightRecorderKb = 1024;
+    });
+
+    // Snapshots need a running session.
+    EXPECT_FALSE(snapshotTrace(snapshotFileName));
+
+    enableTracing();
+    for (uint32_t i = 0; i < 100; ++i) {
+        beginTrace("test trace 1");
+        endTrace();
+    }
+    EXPECT_TRUE(snapshotTrace(snapshotFileName));
+    EXPECT_FALSE(queryTraceConfig().tracingDisabled);
+    uint32_t namedEvents = 0;
+    EXPECT_TRUE(eventNamesResolve(readTrace(snapshotFileName), 0, &namedEvents));
+    EXPECT_EQ(namedEvents, 100u);
+
+    // Snapshots leave the events in place, so the second has those of the
+    // first as well.
+    for (uint32_t i = 0; i < 100; ++i) {
+        beginTrace("test trace 1");
+        endTrace();
+    }
+    EXPECT_TRUE(snapshotTrace(snapshotFileName));
+    namedEvents = 0;
+    EXPECT_TRUE(eventNamesResolve(readTrace(snapshotFileName), 0, &namedEvents));
+    EXPECT_EQ(namedEvents, 200u);
+
+    disableTracing();
+    waitSavingDone();
+
+    // And so does the host trace.
+    namedEvents = 0;
+    EXPECT_TRUE(eventNamesResolve(readTrace(hostFileName), 0, &namedEvents));
+    EXPECT_EQ(namedEvents, 200u);
+
+    setTraceConfig([](VirtualDeviceTraceConfig& config) {
+        config.flightRecorderKb = 0;
+    });
+
+    std::filesystem::remove(std::filesystem::path(snapshotFileName));
+    std::filesystem::remove(std::filesystem::path(hostFileName));
+}
+
+#ifndef VPERFETTO_TEST_NON_SDK
+
+// Combining is SDK build only.
+
+TEST_F(PerfettoGuestTrace, NotifyGuestTraceReady) {
+    // The guest trace is handed over under another name than configured.
+    const char* hostFileName = mHostFileName;
+    const char* combinedFileName = mCombinedFileName;
+    setTraceConfig([=](VirtualDeviceTraceConfig& config) {
+        config.hostFilename = hostFileName;
+        config.guestFilename = "nonexistent-guest.trace";
+        config.combinedFilename = combinedFileName;
+        config.guestTraceTimeoutMs = 60000;
+    });
+    enableTracing();
+    beginTrace("test trace 1");
+    endTrace();
+    notifyGuestTraceReady(mGuestFileName);
+    disableTracing();
+    waitSavingDone();
+
+    expectHostAfterGuest();
+}
+
+TEST_F(PerfettoGuestTrace, StreamGuestTrace) {
+    const char* hostFileName = mHostFileName;
+    const char* combinedFileName = mCombinedFileName;
+    setTraceConfig([=](VirtualDeviceTraceConfig& config) {
+        config.hostFilename = hostFileName;
+        config.combinedFilename = combinedFileName;
+    });
+    enableTracing();
+    beginTrace("test trace 1");
+    endTrace();
+    // Pieces that cut packets in two, as a socket would.
+    for (size_t offset = 0; offset < mGuestTrace.size(); offset += 1000) {
+        pushGuestTraceChunk(mGuestTrace.data() + offset,
+                            std::min<size_t>(1000, mGuestTrace.size() - offset));
+    }
+    finishGuestTrace();
+    disableTracing();
+    waitSavingDone();
+
+    expectHostAfterGuest();
+}
+
+TEST_F(PerfettoGuestTrace, OnlineCombine) {
+    const char* hostFileName = mHostFileName;
+    const char* combinedFileName = mCombinedFileName;
+    setTraceConfig([=](VirtualDeviceTraceConfig& config) {
+        config.hostFilename = hostFileName;
+        config.combinedFilename = combinedFileName;
+        config.onlineCombine = true;
+    });
+    enableTracing();
+    // The guest trace comes in while the host is still tracing.
+    for (size_t offset = 0; offset < mGuestTrace.size(); offset += 1000) {
+        beginTrace("test trace 1");
+        pushGuestTraceChunk(mGuestTrace.data() + offset,
+                            std::min<size_t>(1000, mGuestTrace.size() - offset));
+        endTrace();
+    }
+    finishGuestTrace();
+    disableTracing();
+    waitSavingDone();
+
+    expectGuestBeforeHost();
+}
+
+TEST(PerfettoTracingOnly, FlightRecorderSnapshotsStayWithinBudget) {
+    static char hostFileName[L_tmpnam];
+    static char snapshotFileName[L_tmpnam];
+
+    if (!std::tmpnam(hostFileName) ||
+        !std::tmpnam(snapshotFileName)) {
+        FAIL() << "Could not generate trace file names";
+        return;
+    }
+
+    static const uint32_t kFlightRecorderKb = 64;
+    setTraceConfig([](VirtualDeviceTraceConfig& config) {
+        config.hostFilename = hostFileName;
+        config.guestFilename = nullptr;
+        config.combinedFilename = nullptr;
+        config.flightRecorderKb = kFlightRecorderKb;
+    });
+
+    // Many times the budget, a snapshot at a time. What the snapshots read
+    // out of the service is kept only up to the budget, next to the buffer.
+    static const int64_t kRounds = 20;
+    enableTracing();
+    for (int64_t round = 0; round < kRounds; ++round) {
+        traceCounter("round", round);
+        for (uint32_t i = 0; i < 1000; ++i) {
+            beginTrace("test trace 1");
+            endTrace();
+        }
+        ASSERT_TRUE(snapshotTrace(snapshotFileName));
+        EXPECT_LE(std::filesystem::file_size(snapshotFileName), 2 * kFlightRecorderKb * 1024);
+    }
+    disableTracing();
+    waitSavingDone();
+
+    // The newest rounds are kept, the oldest are gone, and what is left
+    // decodes on its own.
+    for (const char* fileName : { snapshotFileName, hostFileName }) {
+        std::vector<char> trace = readTrace(fileName);
+        EXPECT_LE(trace.size(), 2 * kFlightRecorderKb * 1024);
+        std::vector<int64_t> rounds = getCounterValues(trace);
+        ASSERT_FALSE(rounds.empty());
+        EXPECT_GT(rounds.front(), 0);
+        EXPECT_EQ(rounds.back(), kRounds - 1);
+        uint32_t namedEvents = 0;
+        EXPECT_TRUE(eventNamesResolve(trace, 0, &namedEvents));
+        EXPECT_GT(namedEvents, 0u);
+    }
+
+    setTraceConfig([](VirtualDeviceTraceConfig& config) {
+        config.flightRecorderKb = 0;
+    });
+
+    std::filesystem::remove(std::filesystem::path(snapshotFileName));
+    std::filesystem::remove(std::filesystem::path(hostFileName));
+}
+
+TEST(PerfettoTracingOnly, CounterTracks) {
+    static char hostFileName[L_tmpnam];
+
+    if (!std::tmpnam(hostFileName)) {
+        FAIL() << "Could not generate trace file name";
+        return;
+    }
+
+    setTraceConfig([](VirtualDeviceTraceConfig& config) {
+        config.hostFilename = hostFileName;
+        config.guestFilename = nullptr;
+        config.combinedFilename = nullptr;
+    });
+
+    // The same name as a literal, built at runtime and through the macro's
+    // handle, and another name from another thread.
+    enableTracing();
+    traceCounter("test counter a", 1);
+    std::string builtName = std::string("test counter ") + "a";
+    traceCounter(builtName.c_str(), 2);
+    VPERFETTO_TRACE_COUNTER("test counter a", 3);
+    std::thread([] { traceCounter("test counter b", 10); }).join();
+    disableTracing();
+    waitSavingDone();
+
+    // One counter track per name; the SDK repeats a descriptor only after
+    // an incremental state clear, with the same uuid.
+    namespace pbzero = ::perfetto::protos::pbzero;
+    std::map<std::string, std::set<uint64_t>> trackUuids;
+    std::map<uint64_t, std::vector<int64_t>> values;
+    std::vector<char> trace = readTrace(hostFileName);
+    pbzero::Trace::Decoder traceDecoder(reinterpret_cast<const uint8_t*>(trace.data()), trace.size());
+    for (auto it = traceDecoder.packet(); it; ++it) {
+        pbzero::TracePacket::Decoder packet(*it);
+        if (packet.has_track_descriptor()) {
+            pbzero::TrackDescriptor::Decoder desc(packet.track_descriptor());
+            if (desc.has_counter()) trackUuids[desc.name().ToStdString()].insert(desc.uuid());
+        }
+        if (!packet.has_track_event()) continue;
+        pbzero::TrackEvent::Decoder event(packet.track_event());
+        if (event.type() == pbzero::TrackEvent::TYPE_COUNTER) {
+            values[event.track_uuid()].push_back(event.counter_value());
+        }
+    }
+
+    ASSERT_EQ(trackUuids.size(), 2u);
+    ASSERT_EQ(trackUuids["test counter a"].size(), 1u);
+    ASSERT_EQ(trackUuids["test counter b"].size(), 1u);
+    uint64_t uuidA = *trackUuids["test counter a"].begin();
+    uint64_t uuidB = *trackUuids["test counter b"].begin();
+    EXPECT_NE(uuidA, uuidB);
+    EXPECT_EQ(values.size(), 2u);
+    EXPECT_EQ(values[uuidA], (std::vector<int64_t>{ 1, 2, 3 }));
+    EXPECT_EQ(values[uuidB], (std::vector<int64_t>{ 10 }));
+
+    std::filesystem::remove(std::filesystem::path(hostFileName));
+}
+
+#else // !VPERFETTO_TEST_NON_SDK
+
+// The chunk queues and pool, and the host writer, are non-SDK build only.
+TEST(PerfettoTracingOnly, ChunksAcrossThreads) {
+    static char hostFileName[L_tmpnam];
+
+    if (!std::tmpnam(hostFileName)) {
+        FAIL() << "Could not generate trace file name";
+        return;
+    }
+
+    setTraceConfig([](VirtualDeviceTraceConfig& config) {
+        config.hostFilename = hostFileName;
+        config.guestFilename = nullptr;
+        config.combinedFilename = nullptr;
+        config.perThreadStorageMb = 1;
+    });
+
+    // Enough slices for each thread to go through several chunks, while the
+    // host writer saves and recycles the full ones.
+    static const uint32_t kThreads = 4;
+    static const uint32_t kSlicesPerThread = 100000;
+    std::atomic<uint32_t> threadsTracing(0);
+    enableTracing();
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < kThreads; ++i) {
+        threads.emplace_back([&threadsTracing] {
+            // All threads hold a chunk at once before going on.
+            beginTrace("test trace 1");
+            endTrace();
+            ++threadsTracing;
+            while (threadsTracing < kThreads) std::this_thread::yield();
+            for (uint32_t j = 1; j < kSlicesPerThread; ++j) {
+                beginTrace("test trace 1");
+                endTrace();
+            }
+        });
+    }
+    for (auto& thread : threads) thread.join();
+
+    VirtualDeviceTraceConfig config = queryTraceConfig();
+    EXPECT_GE(config.chunkPoolHighWaterMark, kThreads);
+    EXPECT_GE(config.chunkPoolSize, kThreads);
+
+    disableTracing();
+    waitSavingDone();
+
+    // Only what the next session prefaults is kept, and the chunk this thread
+    // may still hold from an earlier test.
+    config = queryTraceConfig();
+    EXPECT_LE(config.chunkPoolSize, config.chunkPoolPrefaultChunks + 1);
+
+    // Every packet parses, and each thread's sequence has all of its slices
+    // across more than one chunk's worth of bytes.
+    namespace pbzero = ::perfetto::protos::pbzero;
+    std::vector<char> trace = readTrace(hostFileName);
+    std::map<uint32_t, uint32_t> sliceBegins;
+    std::map<uint32_t, uint32_t> sliceEnds;
+    std::map<uint32_t, size_t> sequenceBytes;
+    pbzero::Trace::Decoder traceDecoder(reinterpret_cast<const uint8_t*>(trace.data()), trace.size());
+    for (auto it = traceDecoder.packet(); it; ++it) {
+        ::protozero::ProtoDecoder fields((*it).data, (*it).size);
+        while (fields.ReadField().valid()) { }
+        EXPECT_EQ(fields.bytes_left(), 0u);
+
+        pbzero::TracePacket::Decoder packet(*it);
+        uint32_t sequenceId = packet.trusted_packet_sequence_id();
+        sequenceBytes[sequenceId] += (*it).size;
+        if (!packet.has_track_event()) continue;
+        pbzero::TrackEvent::Decoder event(packet.track_event());
+        if (event.type() == pbzero::TrackEvent::TYPE_SLICE_BEGIN) ++sliceBegins[sequenceId];
+        if (event.type() == pbzero::TrackEvent::TYPE_SLICE_END) ++sliceEnds[sequenceId];
+    }
+    EXPECT_EQ(traceDecoder.bytes_left(), 0u);
+
+    ASSERT_EQ(sliceBegins.size(), kThreads);
+    for (const auto& it : sliceBegins) {
+        EXPECT_EQ(it.second, kSlicesPerThread);
+        EXPECT_EQ(sliceEnds[it.first], kSlicesPerThread);
+        EXPECT_GT(sequenceBytes[it.first], 1048576u);
+    }
+
+    std::filesystem::remove(std::filesystem::path(hostFileName));
+}
+
+
+TEST(PerfettoTracingOnly, FlightRecorderRecyclesOldestChunks) {
+    static char hostFileName[L_tmpnam];
+    static char snapshotFileName[L_tmpnam];
+
+    if (!std::tmpnam(hostFileName) ||
+        !std::tmpnam(snapshotFileName)) {
+        FAIL() << "Could not generate trace file names";
+        return;
+    }
+
+    // A budget of one chunk, and several chunks' worth of counter values.
+    setTraceConfig([](VirtualDeviceTraceConfig& config) {
+        config.hostFilename = hostFileName;
+        config.guestFilename = nullptr;
+        config.combinedFilename = nullptr;
+        config.perThreadStorageMb = 1;
+        config.flightRecorderKb = 1024;
+    });
+    static const int64_t kValues = 400000;
+    enableTracing();
+    for (int64_t i = 0; i < kValues; ++i) {
+        traceCounter("recycled counter", i);
+    }
+    // Long enough for the host writer to recycle the full chunks.
+    sleepUs(300 * 1000);
+    beginTrace("after recycling");
+    endTrace();
+    ASSERT_TRUE(snapshotTrace(snapshotFileName));
+    disableTracing();
+    waitSavingDone();
+
+    namespace pbzero = ::perfetto::protos::pbzero;
+    std::vector<char> snapshot = readTrace(snapshotFileName);
+
+    // The newest values are kept, without gaps; the oldest are gone.
+    std::vector<int64_t> values = getCounterValues(snapshot);
+    ASSERT_FALSE(values.empty());
+    EXPECT_GT(values.front(), 0);
+    EXPECT_EQ(values.back(), kValues - 1);
+    for (size_t i = 1; i < values.size(); ++i) {
+        ASSERT_EQ(values[i], values[i - 1] + 1);
+    }
+
+    // Dropping chunks bumped the generation, so the thread started its
+    // sequence over after the drop, and the event after it resolves.
+    bool clearedAfterCounters = false;
+    uint64_t chunksOverwritten = 0;
+    bool sawCounter = false;
+    pbzero::Trace::Decoder traceDecoder(reinterpret_cast<const uint8_t*>(snapshot.data()), snapshot.size());
+    for (auto it = traceDecoder.packet(); it; ++it) {
+        pbzero::TracePacket::Decoder packet(*it);
+        sawCounter |= packet.has_track_event();
+        if (sawCounter && (packet.sequence_flags() & pbzero::TracePacket::SEQ_INCREMENTAL_STATE_CLEARED)) {
+            clearedAfterCounters = true;
+        }
+        if (!packet.has_trace_stats()) continue;
+        pbzero::TraceStats::Decoder stats(packet.trace_stats());
+        for (auto bufferStats = stats.buffer_stats(); bufferStats; ++bufferStats) {
+            chunksOverwritten += pbzero::TraceStats::BufferStats::Decoder(*bufferStats).chunks_overwritten();
+        }
+    }
+    EXPECT_TRUE(clearedAfterCounters);
+    EXPECT_GT(chunksOverwritten, 0u);
+    uint32_t namedEvents = 0;
+    EXPECT_TRUE(eventNamesResolve(snapshot, 0, &namedEvents));
+    EXPECT_EQ(namedEvents, 1u);
+
+    setTraceConfig([](VirtualDeviceTraceConfig& config) {
+        config.flightRecorderKb = 0;
+    });
+
+    std::filesystem::remove(std::filesystem::path(snapshotFileName));
+    std::filesystem::remove(std::filesystem::path(hostFileName));
+}
+
+
+TEST(PerfettoTracingOnly, DynamicEventNamesInternedOnce) {
+    static char hostFileName[L_tmpnam];
+
+    if (!std::tmpnam(hostFileName)) {
+        FAIL() << "Could not generate trace file name";
+        return;
+    }
+
+    setTraceConfig([](VirtualDeviceTraceConfig& config) {
+        config.hostFilename = hostFileName;
+        config.guestFilename = nullptr;
+        config.combinedFilename = nullptr;
+    });
+
+    // The same name from two buffers, and different names from one reused
+    // buffer.
+    std::vector<std::string> expectedNames;
+    char first[32] = "dynamic name";
+    char second[32] = "dynamic name";
+    char reused[32];
+    enableTracing();
+    for (uint32_t i = 0; i < 10; ++i) {
+        for (const char* name : { first, second }) {
+            beginTrace(name);
+            endTrace();
+            expectedNames.push_back(name);
+        }
+        for (uint32_t j = 0; j < 4; ++j) {
+            snprintf(reused, sizeof(reused), "reused buffer name %u", j);
+            beginTrace(reused);
+            endTrace();
+            expectedNames.push_back(reused);
+        }
+    }
+    disableTracing();
+    waitSavingDone();
+
+    // Each distinct string is interned once, and every begin's name_iid
+    // maps back to the string it was traced with.
+    namespace pbzero = ::perfetto::protos::pbzero;
+    std::map<uint64_t, std::string> namesByIid;
+    std::map<std::string, uint32_t> entriesByName;
+    std::vector<std::string> tracedNames;
+    std::vector<char> trace = readTrace(hostFileName);
+    pbzero::Trace::Decoder traceDecoder(reinterpret_cast<const uint8_t*>(trace.data()), trace.size());
+    for (auto it = traceDecoder.packet(); it; ++it) {
+        pbzero::TracePacket::Decoder packet(*it);
+        if (packet.has_interned_data()) {
+            pbzero::InternedData::Decoder internedData(packet.interned_data());
+            for (auto name = internedData.event_names(); name; ++name) {
+                pbzero::EventName::Decoder eventName(*name);
+                namesByIid[eventName.iid()] = eventName.name().ToStdString();
+                ++entriesByName[eventName.name().ToStdString()];
+            }
+        }
+        if (!packet.has_track_event()) continue;
+        pbzero::TrackEvent::Decoder event(packet.track_event());
+        if (event.type() != pbzero::TrackEvent::TYPE_SLICE_BEGIN) continue;
+        ASSERT_TRUE(namesByIid.count(event.name_iid()));
+        tracedNames.push_back(namesByIid[event.name_iid()]);
+    }
+
+    EXPECT_EQ(entriesByName.size(), 5u);
+    for (const auto& entry : entriesByName) {
+        EXPECT_EQ(entry.second, 1u) << entry.first;
+    }
+    EXPECT_EQ(tracedNames, expectedNames);
+
+    std::filesystem::remove(std::filesystem::path(hostFileName));
+}
+
+
+TEST(PerfettoTracingOnly, TracePacketDefaults) {
+    static char hostFileName[L_tmpnam];
+
+    if (!std::tmpnam(hostFileName)) {
+        FAIL() << "Could not generate trace file name";
+        return;
+    }
+
+    setTraceConfig([](VirtualDeviceTraceConfig& config) {
+        config.hostFilename = hostFileName;
+        config.guestFilename = nullptr;
+        config.combinedFilename = nullptr;
+    });
+
+    uint64_t startNs = bootTimeNs();
+    enableTracing();
+    std::thread([] {
+        for (uint32_t i = 0; i < 10; ++i) {
+            beginTrace("test trace 1");
+            sleepUs(100);
+            endTrace();
+        }
+    }).join();
+    disableTracing();
+    waitSavingDone();
+    uint64_t endNs = bootTimeNs();
+
+    // The sequence starts with defaults: the thread's track, and timestamps
+    // on incremental clock 65, whose base the same packet's clock snapshot
+    // sets. The slice events after it carry neither a track nor a clock id,
+    // and their timestamps are deltas from the event before.
+    namespace pbzero = ::perfetto::protos::pbzero;
+    static const uint32_t kIncrementalClockId = 65;
+    std::map<uint32_t, uint64_t> lastTimestamps;
+    std::map<uint32_t, uint64_t> trackUuids;
+    uint32_t slices = 0;
+    std::vector<char> trace = readTrace(hostFileName);
+    pbzero::Trace::Decoder traceDecoder(reinterpret_cast<const uint8_t*>(trace.data()), trace.size());
+    for (auto it = traceDecoder.packet(); it; ++it) {
+        pbzero::TracePacket::Decoder packet(*it);
+        uint32_t sequenceId = packet.trusted_packet_sequence_id();
+        if (packet.has_trace_packet_defaults()) {
+            pbzero::TracePacketDefaults::Decoder defaults(packet.trace_packet_defaults());
+            EXPECT_EQ(defaults.timestamp_clock_id(), kIncrementalClockId);
+            ASSERT_TRUE(defaults.has_track_event_defaults());
+            pbzero::TrackEventDefaults::Decoder trackEventDefaults(defaults.track_event_defaults());
+            trackUuids[sequenceId] = trackEventDefaults.track_uuid();
+            ASSERT_TRUE(packet.has_clock_snapshot());
+            pbzero::ClockSnapshot::Decoder snapshot(packet.clock_snapshot());
+            for (auto clock = snapshot.clocks(); clock; ++clock) {
+                pbzero::ClockSnapshot::Clock::Decoder clockDecoder(*clock);
+                if (clockDecoder.clock_id() != kIncrementalClockId) continue;
+                EXPECT_TRUE(clockDecoder.is_incremental());
+                lastTimestamps[sequenceId] = clockDecoder.timestamp();
+            }
+            ASSERT_TRUE(lastTimestamps.count(sequenceId));
+            continue;
+        }
+        if (!packet.has_track_event()) continue;
+        pbzero::TrackEvent::Decoder event(packet.track_event());
+        if (event.type() != pbzero::TrackEvent::TYPE_SLICE_BEGIN &&
+            event.type() != pbzero::TrackEvent::TYPE_SLICE_END) continue;
+        ASSERT_TRUE(lastTimestamps.count(sequenceId));
+        EXPECT_FALSE(packet.has_timestamp_clock_id());
+        EXPECT_FALSE(event.has_track_uuid());
+        EXPECT_LT(packet.timestamp(), endNs - startNs);
+        uint64_t timestamp = lastTimestamps[sequenceId] + packet.timestamp();
+        EXPECT_GE(timestamp, startNs);
+        EXPECT_LE(timestamp, endNs);
+        lastTimestamps[sequenceId] = timestamp;
+        ++slices;
+    }
+    EXPECT_EQ(slices, 20u);
+    ASSERT_EQ(trackUuids.size(), 1u);
+    EXPECT_NE(trackUuids.begin()->second, 0u);
+
+    std::filesystem::remove(std::filesystem::path(hostFileName));
+}
+
+
+TEST(PerfettoTracingOnly, SliceStackOverflow) {
+    static char hostFileName[L_tmpnam];
+
+    if (!std::tmpnam(hostFileName)) {
+        FAIL() << "Could not generate trace file name";
+        return;
+    }
+
+    setTraceConfig([](VirtualDeviceTraceConfig& config) {
+        config.hostFilename = hostFileName;
+        config.guestFilename = nullptr;
+        config.combinedFilename = nullptr;
+    });
+
+    // Fill the slice stack (4096 deep), open slices past it, then close
+    // them, open one more after making room, and close everything.
+    static const uint32_t kMaxDepth = 4096;
+    static const uint32_t kOverflowed = 104;
+    enableTracing();
+    beginTrace("outer slice");
+    for (uint32_t i = 1; i < kMaxDepth; ++i) {
+        beginTrace("nested slice");
+    }
+    for (uint32_t i = 0; i < kOverflowed; ++i) {
+        beginTrace("overflowed slice");
+    }
+    for (uint32_t i = 0; i < kOverflowed; ++i) {
+        endTrace();
+    }
+    endTrace();
+    beginTrace("sibling slice");
+    endTrace();
+    for (uint32_t i = 1; i < kMaxDepth; ++i) {
+        endTrace();
+    }
+    disableTracing();
+    waitSavingDone();
+
+    // None of the overflowed slices is in the trace, ends included, and
+    // every end left closes the slice its begin opened.
+    namespace pbzero = ::perfetto::protos::pbzero;
+    std::map<uint64_t, std::string> namesByIid;
+    std::vector<std::string> openSlices;
+    uint32_t begins = 0;
+    uint32_t ends = 0;
+    uint32_t maxDepth = 0;
+    uint64_t packetLoss = 0;
+    std::vector<char> trace = readTrace(hostFileName);
+    pbzero::Trace::Decoder traceDecoder(reinterpret_cast<const uint8_t*>(trace.data()), trace.size());
+    for (auto it = traceDecoder.packet(); it; ++it) {
+        pbzero::TracePacket::Decoder packet(*it);
+        if (packet.has_interned_data()) {
+            pbzero::InternedData::Decoder internedData(packet.interned_data());
+            for (auto name = internedData.event_names(); name; ++name) {
+                pbzero::EventName::Decoder eventName(*name);
+                namesByIid[eventName.iid()] = eventName.name().ToStdString();
+            }
+        }
+        if (packet.has_trace_stats()) {
+            pbzero::TraceStats::Decoder stats(packet.trace_stats());
+            for (auto bufferStats = stats.buffer_stats(); bufferStats; ++bufferStats) {
+                packetLoss += pbzero::TraceStats::BufferStats::Decoder(*bufferStats).trace_writer_packet_loss();
+            }
+        }
+        if (!packet.has_track_event()) continue;
+        pbzero::TrackEvent::Decoder event(packet.track_event());
+        std::string name = namesByIid[event.name_iid()];
+        EXPECT_NE(name, "overflowed slice");
+        if (event.type() == pbzero::TrackEvent::TYPE_SLICE_BEGIN) {
+            openSlices.push_back(name);
+            maxDepth = std::max(maxDepth, (uint32_t)openSlices.size());
+            ++begins;
+        } else if (event.type() == pbzero::TrackEvent::TYPE_SLICE_END) {
+            ASSERT_FALSE(openSlices.empty());
+            EXPECT_EQ(name, openSlices.back());
+            openSlices.pop_back();
+            ++ends;
+        }
+    }
+    EXPECT_EQ(begins, kMaxDepth + 1);
+    EXPECT_EQ(ends, kMaxDepth + 1);
+    EXPECT_EQ(maxDepth, kMaxDepth);
+    EXPECT_TRUE(openSlices.empty());
+    EXPECT_EQ(packetLoss, 2 * kOverflowed);
+
+    std::filesystem::remove(std::filesystem::path(hostFileName));
+}
+
+
+TEST(PerfettoTracingOnly, RawCpuClockSnapshots) {
+#if !defined(__x86_64__) && !defined(__i386__) && !defined(__aarch64__)
+    GTEST_SKIP() << "No raw cpu clock on this architecture";
+#endif
+    static char hostFileName[L_tmpnam];
+
+    if (!std::tmpnam(hostFileName)) {
+        FAIL() << "Could not generate trace file name";
+        return;
+    }
+
+    setTraceConfig([](VirtualDeviceTraceConfig& config) {
+        config.hostFilename = hostFileName;
+        config.guestFilename = nullptr;
+        config.combinedFilename = nullptr;
+        config.rawCpuClock = true;
+    });
+
+    // Long enough for the host writer to recalibrate twice.
+    enableTracing();
+    uint64_t endNs = bootTimeNs() + 2500 * 1000000ULL;
+    while (bootTimeNs() < endNs) {
+        beginTrace("test trace 1");
+        endTrace();
+        sleepUs(20 * 1000);
+    }
+    disableTracing();
+    waitSavingDone();
+
+    // Each snapshot of the raw cpu clock (64) has BOOTTIME with it, and
+    // both move forward from one snapshot to the next.
+    namespace pbzero = ::perfetto::protos::pbzero;
+    static const uint32_t kRawCpuClockId = 64;
+    static const uint32_t kBootTimeClockId = 6;
+    std::vector<std::pair<uint64_t, uint64_t>> snapshots;
+    std::vector<char> trace = readTrace(hostFileName);
+    pbzero::Trace::Decoder traceDecoder(reinterpret_cast<const uint8_t*>(trace.data()), trace.size());
+    for (auto it = traceDecoder.packet(); it; ++it) {
+        pbzero::TracePacket::Decoder packet(*it);
+        if (!packet.has_clock_snapshot()) continue;
+        pbzero::ClockSnapshot::Decoder snapshot(packet.clock_snapshot());
+        bool hasTicks = false;
+        bool hasBootTime = false;
+        uint64_t ticks = 0;
+        uint64_t bootTime = 0;
+        for (auto clock = snapshot.clocks(); clock; ++clock) {
+            pbzero::ClockSnapshot::Clock::Decoder clockDecoder(*clock);
+            if (clockDecoder.clock_id() == kRawCpuClockId) {
+                hasTicks = true;
+                ticks = clockDecoder.timestamp();
+            } else if (clockDecoder.clock_id() == kBootTimeClockId) {
+                hasBootTime = true;
+                bootTime = clockDecoder.timestamp();
+            }
+        }
+        if (!hasTicks) continue;
+        EXPECT_TRUE(hasBootTime);
+        snapshots.push_back({ ticks, bootTime });
+    }
+    ASSERT_GE(snapshots.size(), 2u);
+    for (size_t i = 1; i < snapshots.size(); ++i) {
+        EXPECT_GT(snapshots[i].first, snapshots[i - 1].first);
+        EXPECT_GT(snapshots[i].second, snapshots[i - 1].second);
+    }
+
+    setTraceConfig([](VirtualDeviceTraceConfig& config) {
+        config.rawCpuClock = false;
+    });
+
+    std::filesystem::remove(std::filesystem::path(hostFileName));
+}
+
+#endif // VPERFETTO_TEST_NON_SDK
+
 } // namespace virtualdeviceperfetto